@@ -6,12 +6,19 @@
 #include <buxn/asm/asm.h>
 #include <buxn/asm/annotation.h>
 #include <buxn/asm/chess.h>
-#include <bio/file.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <assert.h>
 
+static const size_t BUXN_LS_DEFAULT_ANALYSIS_CACHE_BUDGET = 8 * 1024 * 1024;
+static const int BUXN_LS_DEFAULT_ANALYSIS_WORKERS = 4;
+static const size_t BUXN_LS_YIELD_INTERVAL = 16 * 1024;
+static const bhash_index_t BUXN_LS_CHESS_CACHE_CAPACITY = 4096;
+static const int BUXN_LS_DEFAULT_CHESS_STEP_BUDGET = 1000000;
+static const int BUXN_LS_DEFAULT_CHESS_TIME_BUDGET = 2000;
+static const int BUXN_LS_CHESS_CLOCK_INTERVAL = 1024;
+
 typedef enum {
 	BUXN_LS_ANNO_DOC,
 	BUXN_LS_ANNO_BUXN_DEVICE,
@@ -19,16 +26,102 @@ typedef enum {
 	BUXN_LS_ANNO_BUXN_ENUM,
 } buxn_ls_anno_type_t;
 
+typedef enum {
+	BUXN_LS_JOB_COPY,
+	BUXN_LS_JOB_ASSEMBLE,
+} buxn_ls_analysis_job_type_t;
+
+struct buxn_ls_analysis_job_s {
+	buxn_ls_analysis_job_type_t type;
+	buxn_ls_src_node_t* node;  // In the current context
+
+	// For copying: where the result comes from.
+	// For assembling: the entry from the previous run which predicts what
+	// files will be opened.
+	const buxn_ls_analyzer_ctx_t* src_ctx;
+	const buxn_ls_src_node_t* src_entry;
+
+	// Assembly result, merged into the current context in queue order
+	buxn_ls_analyzer_ctx_t result;
+	buxn_ls_src_node_t* result_entry;
+	buxn_ls_chess_input_t* chess_input;
+	bool missing_file;
+};
+
+typedef struct {
+	uint16_t addr;
+	buxn_asm_sym_t sym;
+} buxn_ls_chess_sym_t;
+
+// Everything buxn-chess needs to check an entry after its assembly is done
+struct buxn_ls_chess_input_s {
+	buxn_ls_src_node_t* entry;
+	barray(buxn_ls_chess_sym_t) symbols;
+	size_t rom_size;
+	uint8_t rom[];
+};
+
+// A root trace of buxn-chess verifies a single routine
+typedef struct {
+	const buxn_ls_sym_node_t* label;
+	bhash_hash_t key;
+	int end_line;  // Diagnostics from this line on are outside of the routine
+	int num_steps;  // ROM reads by this trace and its branches
+	bool is_identified;
+	bool is_cached;
+	bool is_cacheable;
+	bool is_truncated;  // Ran out of budget, later reports are meaningless
+	barray(buxn_ls_chess_cached_diag_t) diags;
+} buxn_ls_routine_trace_t;
+
+typedef struct {
+	barray(const buxn_ls_sym_node_t*) labels;  // Sorted by address
+	BHASH_TABLE(uint16_t, size_t) label_indices;
+	BHASH_TABLE(buxn_chess_id_t, buxn_chess_id_t) trace_roots;
+	BHASH_TABLE(buxn_chess_id_t, buxn_ls_routine_trace_t) routines;  // By root trace
+	// The root trace being run.
+	// It is only identified by its first ROM read.
+	// ROM reads do not say which trace they are for so they are charged to
+	// the most recently begun root.
+	// That holds as long as a root and all of its branches end before the
+	// next root begins, which is checked through the number of live traces.
+	buxn_chess_id_t current_root;
+	int num_live_traces;
+	bool is_interleaved;  // Reads can't be attributed, the cache is bypassed
+
+	bio_time_t deadline;
+	int steps_until_clock;
+	bool is_out_of_time;
+} buxn_ls_stack_check_t;
+
+typedef struct {
+	buxn_ls_analyzer_t* analyzer;
+	buxn_ls_workspace_t* workspace;
+	int worker_index;
+	int num_tasks;
+	bio_signal_t done;
+} buxn_ls_worker_task_t;
+
 struct buxn_asm_ctx_s {
 	buxn_ls_src_node_t* entry_node;
 	buxn_ls_analyzer_t* analyzer;
 	buxn_ls_workspace_t* workspace;
+	buxn_ls_analysis_worker_t* worker;
+	buxn_ls_analysis_job_t* job;
+	buxn_ls_analyzer_ctx_t* result;  // Where symbols and diagnostics go
+	bool is_async;  // Running on a worker thread, must not log or do I/O
+	bool is_cancelled;
+	size_t work_since_yield;
 	buxn_asm_sym_t previous_sym;
 	buxn_ls_str_t enum_scope;
 	buxn_anno_spec_t anno_spec;
 	buxn_ls_sym_node_t* current_sym_node;
 	buxn_chess_t* chess;
 	barena_t chess_arena;
+	buxn_ls_chess_input_t* chess_input;
+	barray(buxn_ls_chess_sym_t) chess_symbols;
+	buxn_ls_stack_check_t* stack_check;
+	size_t rom_size;
 	bool rom_is_empty;
 	uint8_t rom[UINT16_MAX + 1 - 256];
 };
@@ -40,12 +133,38 @@ buxn_ls_cmp_diagnostic(const void* lhs, const void* rhs) {
 	return strcmp(dlhs->location.uri, drhs->location.uri);
 }
 
+static buxn_ls_file_t*
+buxn_ls_find_file(buxn_ls_file_map_t* files, const char* filename) {
+	bhash_index_t file_index = bhash_find(files, filename);
+	if (bhash_is_valid(file_index)) {
+		return &files->values[file_index];
+	} else {
+		return NULL;
+	}
+}
+
+static buxn_ls_line_slice_t
+buxn_ls_split_loaded_file(buxn_ls_file_t* file, barray(buxn_ls_str_t)* lines) {
+	if (file->first_line_index >= 0) {
+		return (buxn_ls_line_slice_t){
+			.lines = &(*lines)[file->first_line_index],
+			.num_lines = file->num_lines,
+		};
+	}
+
+	file->first_line_index = (int)barray_len(*lines);
+	buxn_ls_line_slice_t slice = buxn_ls_split_file(file->content, lines);
+	file->num_lines = slice.num_lines;
+
+	return slice;
+}
+
 buxn_ls_line_slice_t
 buxn_ls_analyzer_split_file(buxn_ls_analyzer_t* analyzer, const char* filename) {
 	BIO_DEBUG("Splitting file %s", filename);
 
-	bhash_index_t file_index = bhash_find(&analyzer->files, filename);
-	if (!bhash_is_valid(file_index)) {  // Invalid file
+	buxn_ls_file_t* file = buxn_ls_find_file(&analyzer->files, filename);
+	if (file == NULL) {  // Invalid file
 		BIO_WARN("Invalid file");
 		return (buxn_ls_line_slice_t){
 			.lines = NULL,
@@ -53,29 +172,211 @@ buxn_ls_analyzer_split_file(buxn_ls_analyzer_t* analyzer, const char* filename)
 		};
 	}
 
-	buxn_ls_file_t* file = &analyzer->files.values[file_index];
-	if (file->first_line_index >= 0) {
-		return (buxn_ls_line_slice_t){
-			.lines = &analyzer->lines[file->first_line_index],
-			.num_lines = file->num_lines,
-		};
+	return buxn_ls_split_loaded_file(file, &analyzer->lines);
+}
+
+static int
+buxn_ls_cmp_sym_start(const void* lhs, const void* rhs) {
+	const buxn_ls_sym_node_t* lhs_sym = *(const buxn_ls_sym_node_t* const*)lhs;
+	const buxn_ls_sym_node_t* rhs_sym = *(const buxn_ls_sym_node_t* const*)rhs;
+	return bio_lsp_cmp_pos(lhs_sym->range.start, rhs_sym->range.start);
+}
+
+static buxn_ls_sym_index_t
+buxn_ls_build_sym_index(barena_t* arena, buxn_ls_sym_node_t* syms) {
+	int len = 0;
+	for (buxn_ls_sym_node_t* sym = syms; sym != NULL; sym = sym->next) { ++len; }
+	if (len == 0) { return (buxn_ls_sym_index_t){ 0 }; }
+
+	buxn_ls_sym_index_t index = {
+		.syms = barena_memalign(
+			arena,
+			sizeof(buxn_ls_sym_node_t*) * len, _Alignof(buxn_ls_sym_node_t*)
+		),
+		.len = len,
+	};
+	int i = 0;
+	for (buxn_ls_sym_node_t* sym = syms; sym != NULL; sym = sym->next) {
+		index.syms[i++] = sym;
 	}
+	qsort(index.syms, len, sizeof(index.syms[0]), buxn_ls_cmp_sym_start);
+	return index;
+}
 
-	buxn_ls_str_t content = analyzer->files.values[file_index].content;
-	file->first_line_index = (int)barray_len(analyzer->lines);
-	buxn_ls_line_slice_t slice = buxn_ls_split_file(content, &analyzer->lines);
-	file->num_lines = slice.num_lines;
+// The result stays sorted by position
+static buxn_ls_sym_index_t
+buxn_ls_filter_labels(barena_t* arena, const buxn_ls_sym_index_t* defs) {
+	int len = 0;
+	for (int i = 0; i < defs->len; ++i) {
+		if (defs->syms[i]->type == BUXN_ASM_SYM_LABEL) { ++len; }
+	}
+	if (len == 0) { return (buxn_ls_sym_index_t){ 0 }; }
 
-	return slice;
+	buxn_ls_sym_index_t index = {
+		.syms = barena_memalign(
+			arena,
+			sizeof(buxn_ls_sym_node_t*) * len, _Alignof(buxn_ls_sym_node_t*)
+		),
+		.len = len,
+	};
+	int label_index = 0;
+	for (int i = 0; i < defs->len; ++i) {
+		if (defs->syms[i]->type == BUXN_ASM_SYM_LABEL) {
+			index.syms[label_index++] = defs->syms[i];
+		}
+	}
+	return index;
+}
+
+static int
+buxn_ls_cmp_name(buxn_ls_str_t lhs, buxn_ls_str_t rhs) {
+	size_t len = lhs.len < rhs.len ? lhs.len : rhs.len;
+	int cmp = len > 0 ? memcmp(lhs.chars, rhs.chars, len) : 0;
+	if (cmp != 0) { return cmp; }
+	return (lhs.len > rhs.len) - (lhs.len < rhs.len);
+}
+
+static int
+buxn_ls_cmp_sym_name(const void* lhs, const void* rhs) {
+	const buxn_ls_sym_node_t* lhs_sym = *(const buxn_ls_sym_node_t* const*)lhs;
+	const buxn_ls_sym_node_t* rhs_sym = *(const buxn_ls_sym_node_t* const*)rhs;
+	return buxn_ls_cmp_name(lhs_sym->name, rhs_sym->name);
+}
+
+void
+buxn_ls_sort_symbols(buxn_ls_analyzer_ctx_t* ctx) {
+	int num_defs = 0;
+	bhash_index_t num_sources = bhash_len(&ctx->sources);
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		buxn_ls_src_node_t* node = ctx->sources.values[i];
+		node->reference_index = buxn_ls_build_sym_index(&ctx->arena, node->references);
+		node->definition_index = buxn_ls_build_sym_index(&ctx->arena, node->definitions);
+		node->label_index = buxn_ls_filter_labels(&ctx->arena, &node->definition_index);
+		num_defs += node->definition_index.len;
+	}
+
+	// Completion looks up candidates by prefix instead of walking every
+	// definition
+	++ctx->generation;
+	ctx->name_index = (buxn_ls_sym_index_t){ .len = num_defs };
+	if (num_defs == 0) { return; }
+	ctx->name_index.syms = barena_memalign(
+		&ctx->arena,
+		sizeof(buxn_ls_sym_node_t*) * num_defs, _Alignof(buxn_ls_sym_node_t*)
+	);
+	int def_index = 0;
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		const buxn_ls_sym_index_t* defs = &ctx->sources.values[i]->definition_index;
+		if (defs->len == 0) { continue; }
+		memcpy(
+			ctx->name_index.syms + def_index,
+			defs->syms,
+			sizeof(buxn_ls_sym_node_t*) * defs->len
+		);
+		def_index += defs->len;
+	}
+	for (int i = 0; i < num_defs; ++i) {
+		buxn_ls_sym_node_t* def = ctx->name_index.syms[i];
+		def->name_mask = buxn_ls_fuzzy_mask(def->name);
+	}
+	qsort(
+		ctx->name_index.syms, num_defs, sizeof(ctx->name_index.syms[0]),
+		buxn_ls_cmp_sym_name
+	);
+}
+
+buxn_ls_sym_node_t*
+buxn_ls_find_symbol_before(const buxn_ls_sym_index_t* index, bio_lsp_position_t position) {
+	// Find the first symbol which does not start before the position
+	int begin = 0;
+	int end = index->len;
+	while (begin < end) {
+		int mid = begin + (end - begin) / 2;
+		if (bio_lsp_cmp_pos(index->syms[mid]->range.start, position) < 0) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	return begin > 0 ? index->syms[begin - 1] : NULL;
+}
+
+buxn_ls_sym_index_t
+buxn_ls_find_symbols_with_prefix(const buxn_ls_sym_index_t* index, buxn_ls_str_t prefix) {
+	// Find the first name which is not less than the prefix
+	int begin = 0;
+	int end = index->len;
+	while (begin < end) {
+		int mid = begin + (end - begin) / 2;
+		if (buxn_ls_cmp_name(index->syms[mid]->name, prefix) < 0) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	// Names with the prefix follow it
+	int first = begin;
+	end = index->len;
+	while (begin < end) {
+		int mid = begin + (end - begin) / 2;
+		buxn_ls_str_t name = index->syms[mid]->name;
+		if (
+			name.len >= prefix.len
+			&& (prefix.len == 0 || memcmp(name.chars, prefix.chars, prefix.len) == 0)
+		) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	return (buxn_ls_sym_index_t){
+		.syms = index->syms + first,
+		.len = begin - first,
+	};
+}
+
+buxn_ls_sym_node_t*
+buxn_ls_find_symbol_at(const buxn_ls_sym_index_t* index, bio_lsp_position_t position) {
+	// Find the first symbol starting after the position
+	int begin = 0;
+	int end = index->len;
+	while (begin < end) {
+		int mid = begin + (end - begin) / 2;
+		if (bio_lsp_cmp_pos(index->syms[mid]->range.start, position) <= 0) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	// Symbols don't overlap, only the ones starting right before can contain
+	// the position.
+	// There may be several when the file is included by multiple entries.
+	for (int i = begin - 1; i >= 0; --i) {
+		buxn_ls_sym_node_t* sym = index->syms[i];
+		if (bio_lsp_cmp_pos(sym->range.start, index->syms[begin - 1]->range.start) != 0) {
+			break;
+		}
+		if (bio_lsp_cmp_pos(position, sym->range.end) < 0) { return sym; }
+	}
+
+	return NULL;
 }
 
 static bio_lsp_position_t
 buxn_ls_convert_position(
-	buxn_ls_analyzer_t* analyzer,
+	buxn_asm_ctx_t* ctx,
 	const char* filename,
 	buxn_asm_file_pos_t basm_pos
 ) {
-	buxn_ls_line_slice_t line_slice = buxn_ls_analyzer_split_file(analyzer, filename);
+	buxn_ls_file_t* file = buxn_ls_find_file(&ctx->worker->files, filename);
+	buxn_ls_line_slice_t line_slice = { 0 };
+	if (file != NULL) {
+		line_slice = buxn_ls_split_loaded_file(file, &ctx->worker->lines);
+	}
 	bio_lsp_position_t lsp_pos = { .line = basm_pos.line - 1 };
 
 	if (lsp_pos.line >= line_slice.num_lines || line_slice.lines == NULL) {
@@ -84,9 +385,13 @@ buxn_ls_convert_position(
 		return lsp_pos;
 	}
 
+	// Byte offsets are also UTF-16 offsets in ASCII text
 	buxn_ls_str_t line = line_slice.lines[lsp_pos.line];
-	lsp_pos.character = (int)bio_lsp_utf16_offset_from_byte_offset(
-		line.chars, line.len, basm_pos.col - 1
+	bio_lsp_position_encoding_t encoding = file->is_ascii
+		? BIO_LSP_POSITION_ENCODING_UTF8
+		: ctx->analyzer->position_encoding;
+	lsp_pos.character = (int)bio_lsp_character_from_byte_offset(
+		encoding, line.chars, line.len, basm_pos.col - 1
 	);
 
 	return lsp_pos;
@@ -94,34 +399,34 @@ buxn_ls_convert_position(
 
 static bio_lsp_range_t
 buxn_ls_convert_range(
-	buxn_ls_analyzer_t* analyzer,
+	buxn_asm_ctx_t* ctx,
 	const char* filename,
 	buxn_asm_file_range_t basm_range
 ) {
 	return (bio_lsp_range_t){
-		.start = buxn_ls_convert_position(analyzer, filename, basm_range.start),
-		.end = buxn_ls_convert_position(analyzer, filename, basm_range.end),
+		.start = buxn_ls_convert_position(ctx, filename, basm_range.start),
+		.end = buxn_ls_convert_position(ctx, filename, basm_range.end),
 	};
 }
 
 static bio_lsp_location_t
 buxn_ls_convert_region(
-	buxn_ls_analyzer_t* analyzer,
+	buxn_asm_ctx_t* ctx,
 	buxn_asm_source_region_t basm_region
 ) {
 	bio_lsp_location_t location = {
 		.range = buxn_ls_convert_range(
-			analyzer, basm_region.filename, basm_region.range
+			ctx, basm_region.filename, basm_region.range
 		),
 	};
 
 	bhash_index_t src_node_index = bhash_find(
-		&analyzer->current_ctx->sources,
+		&ctx->result->sources,
 		basm_region.filename
 	);
 	if (bhash_is_valid(src_node_index)) {
-		location.uri = analyzer->current_ctx->sources.values[src_node_index]->uri;
-	} else {
+		location.uri = ctx->result->sources.values[src_node_index]->uri;
+	} else if (!ctx->is_async) {
 		BIO_WARN("Could not resolve filename: %s", basm_region.filename);
 	}
 
@@ -130,17 +435,17 @@ buxn_ls_convert_region(
 
 static buxn_ls_src_node_t*
 buxn_ls_alloc_node(
-	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_analyzer_ctx_t* ctx,
 	buxn_ls_workspace_t* workspace,
 	const char* filename
 ) {
 	buxn_ls_src_node_t* node = barena_memalign(
-		&analyzer->current_ctx->arena,
+		&ctx->arena,
 		sizeof(buxn_ls_src_node_t), _Alignof(buxn_ls_src_node_t)
 	);
 
 	size_t uri_len = (sizeof("file://") - 1) + workspace->root_dir_len + strlen(filename) + 1;
-	char* uri = barena_memalign(&analyzer->current_ctx->arena, uri_len, _Alignof(char));
+	char* uri = barena_memalign(&ctx->arena, uri_len, _Alignof(char));
 	// TODO: do we need to url encode?
 	snprintf(uri, uri_len, "file://%s%s", workspace->root_dir, filename);
 	*node = (buxn_ls_src_node_t){
@@ -150,13 +455,30 @@ buxn_ls_alloc_node(
 	return node;
 }
 
+buxn_ls_src_node_t*
+buxn_ls_find_or_alloc_node(
+	buxn_ls_analyzer_ctx_t* ctx,
+	buxn_ls_workspace_t* workspace,
+	const char* filename
+) {
+	bhash_alloc_result_t alloc_result = bhash_alloc(&ctx->sources, filename);
+	if (alloc_result.is_new) {
+		buxn_ls_src_node_t* node = buxn_ls_alloc_node(ctx, workspace, filename);
+		ctx->sources.keys[alloc_result.index] = node->filename;
+		ctx->sources.values[alloc_result.index] = node;
+		return node;
+	} else {
+		return ctx->sources.values[alloc_result.index];
+	}
+}
+
 static void
 buxn_ls_do_queue_file(
 	buxn_ls_analyzer_t* analyzer,
 	buxn_ls_workspace_t* workspace,
 	const char* filename
 ) {
-	buxn_ls_src_node_t* node = buxn_ls_alloc_node(analyzer, workspace, filename);
+	buxn_ls_src_node_t* node = buxn_ls_alloc_node(analyzer->current_ctx, workspace, filename);
 	bhash_put(&analyzer->current_ctx->sources, node->filename, node);
 	barray_push(analyzer->analyze_queue, node, NULL);
 }
@@ -167,8 +489,11 @@ buxn_ls_maybe_queue_node(
 	buxn_ls_workspace_t* workspace,
 	buxn_ls_src_node_t* node
 ) {
+	if (node->visit_epoch == analyzer->epoch) { return; }
+	node->visit_epoch = analyzer->epoch;
+
 	bhash_index_t node_index = bhash_find(&analyzer->current_ctx->sources, node->filename);
-	if (bhash_is_valid(node_index)) { return; }  // Already visited
+	if (bhash_is_valid(node_index)) { return; }  // Already queued
 
 	bhash_index_t doc_index = bhash_find(&workspace->docs, (char*){ (char*)node->filename });
 	if (bhash_is_valid(doc_index)) {  // The document is opened
@@ -195,6 +520,9 @@ buxn_ls_queue_from_root(
 	buxn_ls_workspace_t* workspace,
 	buxn_ls_src_node_t* node
 ) {
+	if (node->climb_epoch == analyzer->epoch) { return; }
+	node->climb_epoch = analyzer->epoch;
+
 	if (node->base.in_edges != NULL) {
 		for (
 			buxn_ls_edge_t* edge = node->base.in_edges;
@@ -213,19 +541,14 @@ buxn_ls_queue_from_root(
 }
 
 static buxn_ls_sym_node_t*
-buxn_ls_make_sym_node(
-	buxn_ls_analyzer_t* analyzer,
-	const buxn_asm_sym_t* sym
-) {
-	bhash_index_t src_node_index = bhash_find(
-		&analyzer->current_ctx->sources,
-		sym->region.filename
-	);
+buxn_ls_make_sym_node(buxn_asm_ctx_t* ctx, const buxn_asm_sym_t* sym) {
+	buxn_ls_analyzer_ctx_t* result = ctx->result;
+	bhash_index_t src_node_index = bhash_find(&result->sources, sym->region.filename);
 	assert(bhash_is_valid(src_node_index) && "Symbol comes from unopened file");
-	buxn_ls_src_node_t* src_node = analyzer->current_ctx->sources.values[src_node_index];
+	buxn_ls_src_node_t* src_node = result->sources.values[src_node_index];
 
 	buxn_ls_sym_node_t* sym_node = barena_memalign(
-		&analyzer->current_ctx->arena,
+		&result->arena,
 		sizeof(buxn_ls_sym_node_t), _Alignof(buxn_ls_sym_node_t)
 	);
 	*sym_node = (buxn_ls_sym_node_t){
@@ -235,27 +558,44 @@ buxn_ls_make_sym_node(
 			.len = strlen(sym->name),
 		},
 		.source = src_node,
+		.entry = ctx->entry_node,
 		.byte_offset = sym->region.range.start.byte,
 		.range = buxn_ls_convert_range(
-			analyzer, sym->region.filename, sym->region.range
+			ctx, sym->region.filename, sym->region.range
 		),
 	};
 	return sym_node;
 }
 
-static buxn_ls_file_t*
-buxn_ls_find_file(buxn_ls_analyzer_t* analyzer, const char* filename) {
-	bhash_index_t file_index = bhash_find(&analyzer->files, filename);
-	if (bhash_is_valid(file_index)) {
-		return &analyzer->files.values[file_index];
-	} else {
-		return NULL;
-	}
+static buxn_ls_sym_node_t*
+buxn_ls_copy_sym_node(
+	buxn_ls_analyzer_ctx_t* ctx,
+	const buxn_ls_sym_node_t* sym_node,
+	buxn_ls_src_node_t* source,
+	buxn_ls_src_node_t* entry
+) {
+	buxn_ls_sym_node_t* sym_copy = barena_memalign(
+		&ctx->arena,
+		sizeof(buxn_ls_sym_node_t), _Alignof(buxn_ls_sym_node_t)
+	);
+	*sym_copy = (buxn_ls_sym_node_t){
+		.name = buxn_ls_arena_cstrcpy(&ctx->arena, sym_node->name),
+		.documentation = buxn_ls_arena_cstrcpy(&ctx->arena, sym_node->documentation),
+		.signature = buxn_ls_arena_cstrcpy(&ctx->arena, sym_node->signature),
+		.source = source,
+		.entry = entry,
+		.type = sym_node->type,
+		.semantics = sym_node->semantics,
+		.byte_offset = sym_node->byte_offset,
+		.range = sym_node->range,
+		.address = sym_node->address,
+	};
+	return sym_copy;
 }
 
 static buxn_ls_str_t
-buxn_ls_slice_file(buxn_ls_analyzer_t* analyzer, const buxn_asm_source_region_t* region) {
-	buxn_ls_file_t* file = buxn_ls_find_file(analyzer, region->filename);
+buxn_ls_slice_file(buxn_asm_ctx_t* ctx, const buxn_asm_source_region_t* region) {
+	buxn_ls_file_t* file = buxn_ls_find_file(&ctx->worker->files, region->filename);
 	if (file == NULL) {
 		return (buxn_ls_str_t){ 0 };
 	} else {
@@ -266,6 +606,38 @@ buxn_ls_slice_file(buxn_ls_analyzer_t* analyzer, const buxn_asm_source_region_t*
 	}
 }
 
+static buxn_ls_file_t*
+buxn_ls_load_file(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const char* filename
+) {
+	bhash_index_t file_index = bhash_find(&analyzer->files, filename);
+	if (bhash_is_valid(file_index)) {  // File is already read
+		return &analyzer->files.values[file_index];
+	}
+
+	// Pin the current snapshot so that even if the workspace gets updated or
+	// the file changes on disk, we analyze based on the current content
+	buxn_ls_doc_t* doc = buxn_ls_workspace_load_file(workspace, filename);
+	if (doc == NULL) { return NULL; }
+	barray_push(analyzer->current_ctx->docs, doc, NULL);
+	buxn_ls_str_t content = buxn_ls_doc_content(doc);
+
+	file_index = bhash_alloc(&analyzer->files, filename).index;
+	analyzer->files.keys[file_index] = filename;
+	buxn_ls_file_t* file = &analyzer->files.values[file_index];
+	*file = (buxn_ls_file_t){
+		.content = content,
+		.content_hash = doc->content_hash,
+		.zero_page_semantics = BUXN_LS_SYMBOL_AS_VARIABLE,
+		.first_line_index = -1,
+		.has_error = false,
+		.is_ascii = bio_lsp_ascii_prefix_len(content.chars, content.len) == content.len,
+	};
+	return file;
+}
+
 static void
 buxn_ls_handle_annotation(
 	void* anno_ctx,
@@ -277,12 +649,12 @@ buxn_ls_handle_annotation(
 	buxn_asm_ctx_t* ctx = anno_ctx;
 
 	if (annotation != NULL) {
-		buxn_ls_file_t* file = buxn_ls_find_file(ctx->analyzer, region->filename);
+		buxn_ls_file_t* file = buxn_ls_find_file(&ctx->worker->files, region->filename);
 		assert((file != NULL) && "Annotation comes from unopened file");
 
 		switch ((buxn_ls_anno_type_t)(annotation - ctx->anno_spec.annotations)) {
 			case BUXN_LS_ANNO_DOC:
-				ctx->current_sym_node->documentation = buxn_ls_slice_file(ctx->analyzer, region);
+				ctx->current_sym_node->documentation = buxn_ls_slice_file(ctx, region);
 				break;
 			case BUXN_LS_ANNO_BUXN_DEVICE:
 				file->zero_page_semantics = BUXN_LS_SYMBOL_AS_DEVICE_PORT;
@@ -297,31 +669,1301 @@ buxn_ls_handle_annotation(
 		}
 	} else {
 		ctx->current_sym_node->semantics = BUXN_LS_SYMBOL_AS_SUBROUTINE;
-		ctx->current_sym_node->signature = buxn_ls_slice_file(ctx->analyzer, region);
+		ctx->current_sym_node->signature = buxn_ls_slice_file(ctx, region);
+	}
+}
+
+static buxn_ls_file_t*
+buxn_ls_load_node_file(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const char* filename
+) {
+	// Load through a node in the current context so that the filename outlives
+	// whichever context or assembly requested it
+	buxn_ls_src_node_t* current_node = buxn_ls_find_or_alloc_node(
+		analyzer->current_ctx, workspace, filename
+	);
+	return buxn_ls_load_file(analyzer, workspace, current_node->filename);
+}
+
+// Load a file seen in an older context without adding a node for it to the
+// current context since it may not be opened again.
+// The older context is either the previous one or a cached entry and both
+// outlive the loaded files which are dropped when the next analysis starts.
+static buxn_ls_file_t*
+buxn_ls_load_old_node_file(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const buxn_ls_src_node_t* old_node
+) {
+	return buxn_ls_load_file(analyzer, workspace, old_node->filename);
+}
+
+static bool
+buxn_ls_is_file_unchanged(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const buxn_ls_src_node_t* old_node
+) {
+	buxn_ls_file_t* file = buxn_ls_load_old_node_file(analyzer, workspace, old_node);
+	return file != NULL && file->content_hash == old_node->content_hash;
+}
+
+static bool
+buxn_ls_entry_has_error(
+	const buxn_ls_analyzer_ctx_t* ctx,
+	const buxn_ls_src_node_t* entry
+) {
+	size_t num_diags = barray_len(ctx->diagnostics);
+	for (size_t i = 0; i < num_diags; ++i) {
+		const buxn_ls_diagnostic_t* diag = &ctx->diagnostics[i];
+		if (diag->entry == entry && diag->severity == BIO_LSP_DIAGNOSTIC_ERROR) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+buxn_ls_can_reuse_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const buxn_ls_analyzer_ctx_t* old_ctx,
+	const buxn_ls_src_node_t* old_entry
+) {
+	if (!old_entry->is_entry) { return false; }
+
+	// Stack checking was cancelled
+	if (!old_entry->is_checked) { return false; }
+
+	// Always reassemble a file with error so that symbols after the error can
+	// be brought forward
+	if (buxn_ls_entry_has_error(old_ctx, old_entry)) { return false; }
+
+	if (!buxn_ls_is_file_unchanged(analyzer, workspace, old_entry)) {
+		return false;
+	}
+
+	// Every file opened while assembling the entry is linked to it
+	for (
+		const buxn_ls_edge_t* edge = old_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		const buxn_ls_src_node_t* include = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		if (!buxn_ls_is_file_unchanged(analyzer, workspace, include)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+buxn_ls_copy_definitions(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_analyzer_ctx_t* dst_ctx,
+	buxn_ls_src_node_t* dst_entry,
+	buxn_ls_src_node_t* dst_node,
+	const buxn_ls_src_node_t* src_entry,
+	const buxn_ls_src_node_t* src_node
+) {
+	buxn_ls_sym_node_t** tail = &dst_node->definitions;
+	while (*tail != NULL) { tail = &(*tail)->next; }
+
+	for (
+		const buxn_ls_sym_node_t* def = src_node->definitions;
+		def != NULL;
+		def = def->next
+	) {
+		if (def->entry != src_entry) { continue; }
+
+		buxn_ls_sym_node_t* def_copy = buxn_ls_copy_sym_node(
+			dst_ctx, def, dst_node, dst_entry
+		);
+		*tail = def_copy;
+		tail = &def_copy->next;
+		bhash_put(&analyzer->sym_map, def, def_copy);
+	}
+}
+
+static void
+buxn_ls_copy_references(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_analyzer_ctx_t* dst_ctx,
+	buxn_ls_src_node_t* dst_entry,
+	buxn_ls_src_node_t* dst_node,
+	const buxn_ls_src_node_t* src_entry,
+	const buxn_ls_src_node_t* src_node
+) {
+	buxn_ls_sym_node_t** tail = &dst_node->references;
+	while (*tail != NULL) { tail = &(*tail)->next; }
+
+	for (
+		const buxn_ls_sym_node_t* ref = src_node->references;
+		ref != NULL;
+		ref = ref->next
+	) {
+		if (ref->entry != src_entry || ref->base.out_edges == NULL) { continue; }
+
+		const buxn_ls_sym_node_t* def = BCONTAINER_OF(
+			ref->base.out_edges->to, buxn_ls_sym_node_t, base
+		);
+		bhash_index_t def_index = bhash_find(&analyzer->sym_map, def);
+		if (!bhash_is_valid(def_index)) { continue; }
+
+		buxn_ls_sym_node_t* ref_copy = buxn_ls_copy_sym_node(
+			dst_ctx, ref, dst_node, dst_entry
+		);
+		*tail = ref_copy;
+		tail = &ref_copy->next;
+		buxn_ls_graph_add_edge(
+			&dst_ctx->arena,
+			&ref_copy->base,
+			&analyzer->sym_map.values[def_index]->base
+		);
+	}
+}
+
+static bool
+buxn_ls_is_linked(const buxn_ls_src_node_t* from, const buxn_ls_src_node_t* to) {
+	for (
+		const buxn_ls_edge_t* edge = from->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		if (edge->to == &to->base) { return true; }
+	}
+
+	return false;
+}
+
+static const char*
+buxn_ls_copy_uri(
+	buxn_ls_analyzer_ctx_t* dst_ctx,
+	buxn_ls_workspace_t* workspace,
+	const char* uri
+) {
+	if (uri == NULL) { return NULL; }
+
+	const char* filename = uri + (sizeof("file://") - 1) + workspace->root_dir_len;
+	bhash_index_t node_index = bhash_find(&dst_ctx->sources, filename);
+	if (bhash_is_valid(node_index)) {
+		return dst_ctx->sources.values[node_index]->uri;
+	} else {
+		return NULL;
+	}
+}
+
+// Copy everything produced by assembling an entry from one context to another.
+// Only symbols and diagnostics tagged with the entry are copied since other
+// entries may share some of the same files.
+static void
+buxn_ls_copy_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_analyzer_ctx_t* dst_ctx,
+	buxn_ls_src_node_t* dst_entry,
+	const buxn_ls_analyzer_ctx_t* src_ctx,
+	const buxn_ls_src_node_t* src_entry
+) {
+	bhash_clear(&analyzer->sym_map);
+
+	dst_entry->analyzed = true;
+	dst_entry->is_entry = true;
+	dst_entry->is_checked = src_entry->is_checked;
+	dst_entry->content_hash = src_entry->content_hash;
+	for (
+		const buxn_ls_edge_t* edge = src_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		const buxn_ls_src_node_t* src_node = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		buxn_ls_src_node_t* dst_node = buxn_ls_find_or_alloc_node(
+			dst_ctx, workspace, src_node->filename
+		);
+		if (buxn_ls_is_linked(dst_entry, dst_node)) { continue; }  // Included twice
+
+		dst_node->analyzed = true;
+		dst_node->content_hash = src_node->content_hash;
+		buxn_ls_graph_add_edge(&dst_ctx->arena, &dst_entry->base, &dst_node->base);
+	}
+
+	// Definitions must all be copied before references can be reconnected
+	buxn_ls_copy_definitions(analyzer, dst_ctx, dst_entry, dst_entry, src_entry, src_entry);
+	for (
+		const buxn_ls_edge_t* edge = dst_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		buxn_ls_src_node_t* dst_node = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		bhash_index_t src_index = bhash_find(&src_ctx->sources, dst_node->filename);
+		buxn_ls_copy_definitions(
+			analyzer, dst_ctx, dst_entry, dst_node,
+			src_entry, src_ctx->sources.values[src_index]
+		);
+	}
+
+	buxn_ls_copy_references(analyzer, dst_ctx, dst_entry, dst_entry, src_entry, src_entry);
+	for (
+		const buxn_ls_edge_t* edge = dst_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		buxn_ls_src_node_t* dst_node = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		bhash_index_t src_index = bhash_find(&src_ctx->sources, dst_node->filename);
+		buxn_ls_copy_references(
+			analyzer, dst_ctx, dst_entry, dst_node,
+			src_entry, src_ctx->sources.values[src_index]
+		);
+	}
+
+	size_t num_diags = barray_len(src_ctx->diagnostics);
+	for (size_t i = 0; i < num_diags; ++i) {
+		const buxn_ls_diagnostic_t* diag = &src_ctx->diagnostics[i];
+		if (diag->entry != src_entry) { continue; }
+
+		buxn_ls_diagnostic_t diag_copy = *diag;
+		diag_copy.location.uri = buxn_ls_copy_uri(dst_ctx, workspace, diag->location.uri);
+		if (diag_copy.location.uri == NULL) { continue; }
+
+		diag_copy.entry = dst_entry;
+		diag_copy.related_location.uri = buxn_ls_copy_uri(dst_ctx, workspace, diag->related_location.uri);
+		diag_copy.message = buxn_ls_arena_strcpy(&dst_ctx->arena, diag->message);
+		if (diag->related_message != NULL) {
+			diag_copy.related_message = buxn_ls_arena_strcpy(&dst_ctx->arena, diag->related_message);
+		}
+
+		barray_push(dst_ctx->diagnostics, diag_copy, NULL);
+	}
+}
+
+struct buxn_ls_analysis_cache_entry_s {
+	buxn_ls_analysis_cache_entry_t* next;
+	buxn_ls_analysis_cache_entry_t* prev;
+
+	buxn_ls_analyzer_ctx_t ctx;
+	buxn_ls_src_node_t* entry;
+	bhash_hash_t key;
+	size_t size;
+};
+
+static void
+buxn_ls_init_analyzer_ctx(buxn_ls_analyzer_ctx_t* ctx, barena_pool_t* pool) {
+	barena_init(&ctx->arena, pool);
+	ctx->name_index = (buxn_ls_sym_index_t){ 0 };
+	ctx->generation = 0;
+
+	bhash_config_t hash_config = bhash_config_default();
+	hash_config.eq = buxn_ls_str_eq;
+	hash_config.hash = buxn_ls_str_hash;
+	hash_config.removable = false;
+	bhash_init(&ctx->sources, hash_config);
+}
+
+static void
+buxn_ls_unpin_docs(buxn_ls_analyzer_ctx_t* ctx) {
+	size_t num_docs = barray_len(ctx->docs);
+	for (size_t i = 0; i < num_docs; ++i) {
+		buxn_ls_doc_unref(ctx->docs[i]);
+	}
+	barray_clear(ctx->docs);
+}
+
+static void
+buxn_ls_reset_analyzer_ctx(buxn_ls_analyzer_ctx_t* ctx) {
+	buxn_ls_unpin_docs(ctx);
+	barena_reset(&ctx->arena);
+	bhash_clear(&ctx->sources);
+	barray_clear(ctx->diagnostics);
+	ctx->name_index = (buxn_ls_sym_index_t){ 0 };
+	++ctx->generation;
+}
+
+static void
+buxn_ls_cleanup_analyzer_ctx(buxn_ls_analyzer_ctx_t* ctx) {
+	buxn_ls_unpin_docs(ctx);
+	barray_free(NULL, ctx->docs);
+	barray_free(NULL, ctx->diagnostics);
+	bhash_cleanup(&ctx->sources);
+	barena_reset(&ctx->arena);
+}
+
+static bhash_hash_t
+buxn_ls_hash_combine(bhash_hash_t seed, bhash_hash_t hash) {
+	bhash_hash_t pair[2] = { seed, hash };
+	return bhash_hash(pair, sizeof(pair));
+}
+
+static bhash_hash_t
+buxn_ls_entry_key(const buxn_ls_src_node_t* entry) {
+	bhash_hash_t key = bhash_hash(entry->filename, strlen(entry->filename));
+	key = buxn_ls_hash_combine(key, entry->content_hash);
+	for (
+		const buxn_ls_edge_t* edge = entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		const buxn_ls_src_node_t* include = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		key = buxn_ls_hash_combine(key, bhash_hash(include->filename, strlen(include->filename)));
+		key = buxn_ls_hash_combine(key, include->content_hash);
+	}
+	return key;
+}
+
+static size_t
+buxn_ls_estimate_sym_size(const buxn_ls_sym_node_t* sym) {
+	return sizeof(buxn_ls_sym_node_t)
+		+ sym->name.len + 1
+		+ sym->documentation.len + 1
+		+ sym->signature.len + 1;
+}
+
+static size_t
+buxn_ls_estimate_ctx_size(const buxn_ls_analyzer_ctx_t* ctx) {
+	size_t size = 0;
+
+	bhash_index_t num_sources = bhash_len(&ctx->sources);
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		const buxn_ls_src_node_t* node = ctx->sources.values[i];
+		size += sizeof(buxn_ls_src_node_t) + strlen(node->uri) + 1 + sizeof(buxn_ls_edge_t);
+
+		for (const buxn_ls_sym_node_t* def = node->definitions; def != NULL; def = def->next) {
+			size += buxn_ls_estimate_sym_size(def);
+		}
+		for (const buxn_ls_sym_node_t* ref = node->references; ref != NULL; ref = ref->next) {
+			size += buxn_ls_estimate_sym_size(ref) + sizeof(buxn_ls_edge_t);
+		}
+	}
+
+	size_t num_diags = barray_len(ctx->diagnostics);
+	for (size_t i = 0; i < num_diags; ++i) {
+		const buxn_ls_diagnostic_t* diag = &ctx->diagnostics[i];
+		size += sizeof(buxn_ls_diagnostic_t) + strlen(diag->message) + 1;
+		if (diag->related_message != NULL) {
+			size += strlen(diag->related_message) + 1;
+		}
+	}
+
+	return size;
+}
+
+static void
+buxn_ls_destroy_cache_entry(buxn_ls_analysis_cache_entry_t* entry) {
+	buxn_ls_cleanup_analyzer_ctx(&entry->ctx);
+	buxn_ls_free(entry);
+}
+
+static void
+buxn_ls_unlink_cache_entry(
+	buxn_ls_analysis_cache_t* cache,
+	buxn_ls_analysis_cache_entry_t* entry
+) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->first = entry->next;
+	}
+
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->last = entry->prev;
+	}
+
+	entry->next = entry->prev = NULL;
+}
+
+static void
+buxn_ls_link_cache_entry(
+	buxn_ls_analysis_cache_t* cache,
+	buxn_ls_analysis_cache_entry_t* entry
+) {
+	entry->prev = NULL;
+	entry->next = cache->first;
+	if (cache->first != NULL) {
+		cache->first->prev = entry;
+	} else {
+		cache->last = entry;
+	}
+	cache->first = entry;
+}
+
+static buxn_ls_analysis_cache_entry_t*
+buxn_ls_find_cached_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const char* filename
+) {
+	buxn_ls_analysis_cache_t* cache = &analyzer->cache;
+	for (
+		buxn_ls_analysis_cache_entry_t* entry = cache->first;
+		entry != NULL;
+		entry = entry->next
+	) {
+		if (
+			strcmp(entry->entry->filename, filename) == 0
+			&& buxn_ls_can_reuse_entry(analyzer, workspace, &entry->ctx, entry->entry)
+		) {
+			buxn_ls_unlink_cache_entry(cache, entry);
+			buxn_ls_link_cache_entry(cache, entry);
+			cache->num_hits += 1;
+			return entry;
+		}
+	}
+
+	cache->num_misses += 1;
+	return NULL;
+}
+
+static void
+buxn_ls_cache_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const buxn_ls_analyzer_ctx_t* ctx,
+	const buxn_ls_src_node_t* node
+) {
+	// Result depends on the previous run when error recovery kicks in
+	if (buxn_ls_entry_has_error(ctx, node)) { return; }
+	// Stack checking was cancelled or assembly was cut short before it
+	if (!node->is_checked) { return; }
+
+	buxn_ls_analysis_cache_t* cache = &analyzer->cache;
+	bhash_hash_t key = buxn_ls_entry_key(node);
+	for (
+		buxn_ls_analysis_cache_entry_t* entry = cache->first;
+		entry != NULL;
+		entry = entry->next
+	) {
+		if (entry->key == key && strcmp(entry->entry->filename, node->filename) == 0) {
+			buxn_ls_unlink_cache_entry(cache, entry);
+			buxn_ls_link_cache_entry(cache, entry);
+			return;
+		}
+	}
+
+	buxn_ls_analysis_cache_entry_t* entry = buxn_ls_malloc(sizeof(buxn_ls_analysis_cache_entry_t));
+	*entry = (buxn_ls_analysis_cache_entry_t){ .key = key };
+	buxn_ls_init_analyzer_ctx(&entry->ctx, analyzer->arena_pool);
+	entry->entry = buxn_ls_find_or_alloc_node(&entry->ctx, workspace, node->filename);
+	buxn_ls_copy_entry(analyzer, workspace, &entry->ctx, entry->entry, ctx, node);
+	entry->size = buxn_ls_estimate_ctx_size(&entry->ctx);
+
+	if (entry->size > cache->budget) {
+		buxn_ls_destroy_cache_entry(entry);
+		return;
+	}
+
+	while (cache->size + entry->size > cache->budget) {
+		buxn_ls_analysis_cache_entry_t* lru_entry = cache->last;
+		BIO_DEBUG("Evicting %s from analysis cache", lru_entry->entry->filename);
+		buxn_ls_unlink_cache_entry(cache, lru_entry);
+		cache->size -= lru_entry->size;
+		buxn_ls_destroy_cache_entry(lru_entry);
+	}
+	cache->size += entry->size;
+	buxn_ls_link_cache_entry(cache, entry);
+}
+
+// Entries of the previous context are cached right before it is reset.
+// Those which are still in the current context with the same key are alive
+// and do not need a copy.
+static void
+buxn_ls_cache_dropped_entries(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace
+) {
+	const buxn_ls_analyzer_ctx_t* previous_ctx = analyzer->previous_ctx;
+	const buxn_ls_analyzer_ctx_t* current_ctx = analyzer->current_ctx;
+	bhash_index_t num_sources = bhash_len(&previous_ctx->sources);
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		const buxn_ls_src_node_t* node = previous_ctx->sources.values[i];
+		if (!node->is_entry) { continue; }
+
+		bhash_index_t current_index = bhash_find(&current_ctx->sources, node->filename);
+		if (bhash_is_valid(current_index)) {
+			const buxn_ls_src_node_t* current_node = current_ctx->sources.values[current_index];
+			if (
+				current_node->is_entry
+				&& buxn_ls_entry_key(current_node) == buxn_ls_entry_key(node)
+			) {
+				continue;
+			}
+		}
+
+		buxn_ls_cache_entry(analyzer, workspace, previous_ctx, node);
+	}
+}
+
+static bool
+buxn_ls_is_file_expected(const buxn_ls_analysis_job_t* job, const char* filename) {
+	if (strcmp(job->src_entry->filename, filename) == 0) { return true; }
+
+	for (
+		const buxn_ls_edge_t* edge = job->src_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		const buxn_ls_src_node_t* include = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		if (strcmp(include->filename, filename) == 0) { return true; }
+	}
+
+	return false;
+}
+
+static void
+buxn_ls_init_worker(buxn_ls_analysis_worker_t* worker) {
+	*worker = (buxn_ls_analysis_worker_t){ 0 };
+
+	bhash_config_t hash_config = bhash_config_default();
+	hash_config.removable = false;
+	bhash_init(&worker->label_defs, hash_config);
+
+	hash_config.eq = buxn_ls_str_eq;
+	hash_config.hash = buxn_ls_str_hash;
+	bhash_init(&worker->files, hash_config);
+
+	barena_pool_init(&worker->arena_pool, 1);
+}
+
+static void
+buxn_ls_cleanup_worker(buxn_ls_analysis_worker_t* worker) {
+	barray_free(NULL, worker->lines);
+	barray_free(NULL, worker->macro_defs);
+	barray_free(NULL, worker->references);
+
+	bhash_cleanup(&worker->files);
+	bhash_cleanup(&worker->label_defs);
+
+	barena_pool_cleanup(&worker->arena_pool);
+}
+
+static void
+buxn_ls_assemble_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_analysis_worker_t* worker,
+	buxn_ls_analysis_job_t* job,
+	bool is_async
+) {
+	bhash_clear(&worker->files);
+	barray_clear(worker->lines);
+	barray_clear(worker->macro_defs);
+	bhash_clear(&worker->label_defs);
+	barray_clear(worker->references);
+
+	buxn_ls_init_analyzer_ctx(&job->result, &worker->arena_pool);
+	job->missing_file = false;
+	job->chess_input = NULL;
+	buxn_ls_src_node_t* node = buxn_ls_find_or_alloc_node(
+		&job->result, workspace, job->node->filename
+	);
+	node->is_entry = true;
+	job->result_entry = node;
+
+	buxn_anno_t annotations[] = {
+		[BUXN_LS_ANNO_DOC] = {
+			.type = BUXN_ANNOTATION_PREFIX,
+			.name = "doc",
+		},
+		[BUXN_LS_ANNO_BUXN_DEVICE] = {
+			.type = BUXN_ANNOTATION_IMMEDIATE,
+			.name = "buxn:device",
+		},
+		[BUXN_LS_ANNO_BUXN_MEMORY] = {
+			.type = BUXN_ANNOTATION_IMMEDIATE,
+			.name = "buxn:memory",
+		},
+		[BUXN_LS_ANNO_BUXN_ENUM] = {
+			.type = BUXN_ANNOTATION_PREFIX,
+			.name = "buxn:enum",
+		},
+	};
+	buxn_asm_ctx_t ctx = {
+		.entry_node = node,
+		.analyzer = analyzer,
+		.workspace = workspace,
+		.worker = worker,
+		.job = job,
+		.result = &job->result,
+		.is_async = is_async,
+		.rom_is_empty = true,
+		.anno_spec = {
+			.annotations = annotations,
+			.num_annotations = BCOUNT_OF(annotations),
+			.ctx = &ctx,
+			.handler = buxn_ls_handle_annotation,
+		},
+	};
+	bool success = buxn_asm(&ctx, node->filename);
+
+	// Stack checking is deferred so that symbols can be published sooner
+	if (success && !ctx.rom_is_empty && !job->missing_file) {
+		buxn_ls_chess_input_t* input = buxn_ls_malloc(
+			sizeof(buxn_ls_chess_input_t) + ctx.rom_size
+		);
+		input->entry = NULL;
+		input->symbols = ctx.chess_symbols;
+		input->rom_size = ctx.rom_size;
+		memcpy(input->rom, ctx.rom, ctx.rom_size);
+		job->chess_input = input;
+	} else {
+		barray_free(NULL, ctx.chess_symbols);
+		node->is_checked = true;  // Nothing to check
+	}
+
+	// The result will be discarded and the entry assembled again on the bio
+	// thread
+	if (job->missing_file) { return; }
+
+	// Bring forward old symbols in files with error to have some degree
+	// of error tolerance
+	bhash_index_t num_files = bhash_len(&worker->files);
+	for (bhash_index_t file_index = 0; file_index < num_files; ++file_index) {
+		buxn_ls_file_t* file = &worker->files.values[file_index];
+		if (!file->has_error) { continue; }
+
+		bhash_index_t previous_src_index = bhash_find(
+			&analyzer->previous_ctx->sources, worker->files.keys[file_index]
+		);
+		if (!bhash_is_valid(previous_src_index)) { continue; }
+		buxn_ls_src_node_t* previous_src_node = analyzer->previous_ctx->sources.values[previous_src_index];
+
+		bhash_index_t current_src_index = bhash_find(
+			&job->result.sources, worker->files.keys[file_index]
+		);
+		if (!bhash_is_valid(current_src_index)) { continue; }
+		buxn_ls_src_node_t* current_src_node = job->result.sources.values[current_src_index];
+
+		for (
+			buxn_ls_sym_node_t* sym_node = previous_src_node->definitions;
+			sym_node != NULL;
+			sym_node = sym_node->next
+		) {
+			if (sym_node->byte_offset <= file->last_symbol_byte) {
+				continue;
+			}
+
+			// Symbol appears after error
+			buxn_ls_sym_node_t* sym_copy = buxn_ls_copy_sym_node(
+				&job->result, sym_node, current_src_node, node
+			);
+			sym_copy->next = sym_copy->source->definitions;
+			sym_copy->source->definitions = sym_copy;
+		}
+	}
+
+	// Connect references to definitions
+	size_t num_refs = barray_len(worker->references);
+	for (size_t sym_index = 0; sym_index < num_refs; ++sym_index) {
+		const buxn_asm_sym_t* sym = &worker->references[sym_index];
+
+		buxn_ls_sym_node_t* def_node = NULL;
+		if (sym->type == BUXN_ASM_SYM_MACRO_REF) {
+			// Macros cannot be forward declared so references can only
+			// be resolved when a macro is already declared
+			def_node = worker->macro_defs[sym->id - 1];
+		} else if (sym->type == BUXN_ASM_SYM_LABEL_REF) {
+			bhash_index_t def_index = bhash_find(&worker->label_defs, sym->id);
+			if (bhash_is_valid(def_index)) {
+				def_node = worker->label_defs.values[def_index];
+			}
+		}
+
+		if (def_node == NULL) {  // Unresolved reference
+			continue;
+		}
+
+		buxn_ls_sym_node_t* ref_node = buxn_ls_make_sym_node(&ctx, sym);
+		ref_node->next = ref_node->source->references;
+		ref_node->source->references = ref_node;
+		buxn_ls_graph_add_edge(
+			&job->result.arena,
+			&ref_node->base,
+			&def_node->base
+		);
+		/*BIO_TRACE(*/
+			/*"Connecting reference for %s"*/
+			/*" from %s:%d:%d:%d:%d"*/
+			/*" to %s:%d:%d:%d:%d",*/
+			/*sym->name,*/
+
+			/*ref_node->source->uri,*/
+			/*ref_node->range.start.line, ref_node->range.start.character,*/
+			/*ref_node->range.end.line, ref_node->range.end.character,*/
+
+			/*def_node->source->uri,*/
+			/*def_node->range.start.line, def_node->range.start.character,*/
+			/*def_node->range.end.line, def_node->range.end.character*/
+		/*);*/
+	}
+}
+
+static void
+buxn_ls_run_worker(void* userdata) {
+	const buxn_ls_worker_task_t* task = userdata;
+	buxn_ls_analyzer_t* analyzer = task->analyzer;
+	buxn_ls_analysis_worker_t* worker = &analyzer->workers[task->worker_index];
+
+	// Assembly jobs are dealt out in a fixed order so no synchronization is
+	// needed between workers
+	int assembly_index = 0;
+	size_t num_jobs = barray_len(analyzer->jobs);
+	for (size_t i = 0; i < num_jobs; ++i) {
+		buxn_ls_analysis_job_t* job = &analyzer->jobs[i];
+		if (job->type != BUXN_LS_JOB_ASSEMBLE) { continue; }
+
+		if (assembly_index++ % task->num_tasks == task->worker_index) {
+			buxn_ls_assemble_entry(analyzer, task->workspace, worker, job, true);
+		}
+	}
+}
+
+// Preload every file an entry opened in the previous run so that it can be
+// assembled on a worker.
+static bool
+buxn_ls_preload_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const buxn_ls_src_node_t* old_entry
+) {
+	if (analyzer->num_workers <= 1) { return false; }
+	if (old_entry == NULL || !old_entry->is_entry) { return false; }
+
+	if (buxn_ls_load_old_node_file(analyzer, workspace, old_entry) == NULL) {
+		return false;
+	}
+
+	for (
+		const buxn_ls_edge_t* edge = old_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		const buxn_ls_src_node_t* include = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		if (buxn_ls_load_old_node_file(analyzer, workspace, include) == NULL) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+buxn_ls_schedule_job(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_analysis_job_type_t type,
+	buxn_ls_src_node_t* node,
+	const buxn_ls_analyzer_ctx_t* src_ctx,
+	const buxn_ls_src_node_t* src_entry
+) {
+	// Queued files which this job is expected to open are only skipped once
+	// it is merged
+	node->schedule_epoch = analyzer->batch_epoch;
+	for (
+		const buxn_ls_edge_t* edge = src_entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		const buxn_ls_src_node_t* include = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+		buxn_ls_find_or_alloc_node(
+			analyzer->current_ctx, workspace, include->filename
+		)->schedule_epoch = analyzer->batch_epoch;
+	}
+
+	buxn_ls_analysis_job_t job = {
+		.type = type,
+		.node = node,
+		.src_ctx = src_ctx,
+		.src_entry = src_entry,
+	};
+	barray_push(analyzer->jobs, job, NULL);
+}
+
+static void
+buxn_ls_free_chess_input(buxn_ls_chess_input_t* input) {
+	barray_free(NULL, input->symbols);
+	buxn_ls_free(input);
+}
+
+static void
+buxn_ls_queue_chess_input(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_analysis_job_t* job
+) {
+	buxn_ls_chess_input_t* input = job->chess_input;
+	job->chess_input = NULL;
+	input->entry = job->node;
+
+	// Strings are owned by the assembly result which is about to be discarded
+	size_t num_symbols = barray_len(input->symbols);
+	for (size_t i = 0; i < num_symbols; ++i) {
+		buxn_asm_sym_t* sym = &input->symbols[i].sym;
+		if (sym->name != NULL) {
+			sym->name = buxn_ls_arena_strcpy(&analyzer->current_ctx->arena, sym->name);
+		}
+		sym->region.filename = buxn_ls_find_or_alloc_node(
+			analyzer->current_ctx, workspace, sym->region.filename
+		)->filename;
+	}
+
+	barray_push(analyzer->chess_queue, input, NULL);
+}
+
+static void
+buxn_ls_merge_job(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_analysis_job_t* job
+) {
+	if (job->node->analyzed) {  // Opened by an entry merged before this
+		BIO_INFO("Skipping %s", job->node->filename);
+	} else if (job->type == BUXN_LS_JOB_COPY) {
+		buxn_ls_copy_entry(
+			analyzer, workspace,
+			analyzer->current_ctx, job->node,
+			job->src_ctx, job->src_entry
+		);
+	} else {
+		buxn_ls_copy_entry(
+			analyzer, workspace,
+			analyzer->current_ctx, job->node,
+			&job->result, job->result_entry
+		);
+		if (job->chess_input != NULL) {
+			buxn_ls_queue_chess_input(analyzer, workspace, job);
+		}
+	}
+
+	if (job->type == BUXN_LS_JOB_ASSEMBLE) {
+		if (job->chess_input != NULL) {
+			buxn_ls_free_chess_input(job->chess_input);
+			job->chess_input = NULL;
+		}
+		buxn_ls_cleanup_analyzer_ctx(&job->result);
+	}
+}
+
+static void
+buxn_ls_clear_chess_queue(buxn_ls_analyzer_t* analyzer) {
+	size_t num_inputs = barray_len(analyzer->chess_queue);
+	for (size_t i = 0; i < num_inputs; ++i) {
+		buxn_ls_free_chess_input(analyzer->chess_queue[i]);
+	}
+	barray_clear(analyzer->chess_queue);
+}
+
+static void
+buxn_ls_run_jobs(buxn_ls_analyzer_t* analyzer, buxn_ls_workspace_t* workspace) {
+	size_t num_jobs = barray_len(analyzer->jobs);
+	int num_assemblies = 0;
+	for (size_t i = 0; i < num_jobs; ++i) {
+		if (analyzer->jobs[i].type == BUXN_LS_JOB_ASSEMBLE) {
+			++num_assemblies;
+		}
+	}
+
+	if (num_assemblies > 0) {
+		int num_tasks = num_assemblies < analyzer->num_workers
+			? num_assemblies
+			: analyzer->num_workers;
+		BIO_DEBUG("Assembling %d entries on %d worker(s)", num_assemblies, num_tasks);
+
+		buxn_ls_worker_task_t* tasks = buxn_ls_malloc(sizeof(buxn_ls_worker_task_t) * num_tasks);
+		for (int i = 0; i < num_tasks; ++i) {
+			tasks[i] = (buxn_ls_worker_task_t){
+				.analyzer = analyzer,
+				.workspace = workspace,
+				.worker_index = i,
+				.num_tasks = num_tasks,
+				.done = bio_make_signal(),
+			};
+			bio_run_async(buxn_ls_run_worker, &tasks[i], tasks[i].done);
+		}
+		for (int i = 0; i < num_tasks; ++i) {
+			bio_wait_for_one_signal(tasks[i].done);
+		}
+		buxn_ls_free(tasks);
+	}
+
+	// Merge in queue order so that the result does not depend on scheduling
+	for (size_t i = 0; i < num_jobs; ++i) {
+		buxn_ls_analysis_job_t* job = &analyzer->jobs[i];
+		if (job->type == BUXN_LS_JOB_ASSEMBLE && job->missing_file) {
+			BIO_INFO("Reanalyzing %s since its includes changed", job->node->filename);
+			if (job->chess_input != NULL) {
+				buxn_ls_free_chess_input(job->chess_input);
+			}
+			buxn_ls_cleanup_analyzer_ctx(&job->result);
+			buxn_ls_assemble_entry(analyzer, workspace, &analyzer->workers[0], job, false);
+		}
+
+		buxn_ls_merge_job(analyzer, workspace, job);
+	}
+
+	barray_clear(analyzer->jobs);
+
+	// Files which were expected to be opened but were not have to be analyzed
+	// on their own
+	size_t num_deferred = barray_len(analyzer->deferred_nodes);
+	for (size_t i = 0; i < num_deferred; ++i) {
+		buxn_ls_src_node_t* node = analyzer->deferred_nodes[i];
+		if (!node->analyzed) {
+			barray_push(analyzer->analyze_queue, node, NULL);
+		}
+	}
+	barray_clear(analyzer->deferred_nodes);
+
+	analyzer->batch_epoch = buxn_ls_analyzer_next_epoch(analyzer);
+}
+
+static void
+buxn_ls_free_cached_diags(barray(buxn_ls_chess_cached_diag_t) diags) {
+	size_t num_diags = barray_len(diags);
+	for (size_t i = 0; i < num_diags; ++i) {
+		buxn_ls_free(diags[i].message);
+		buxn_ls_free(diags[i].related_message);
+	}
+	barray_free(NULL, diags);
+}
+
+static int
+buxn_ls_cmp_label_address(const void* lhs, const void* rhs) {
+	const buxn_ls_sym_node_t* lsym = *(const buxn_ls_sym_node_t* const*)lhs;
+	const buxn_ls_sym_node_t* rsym = *(const buxn_ls_sym_node_t* const*)rhs;
+	return (int)lsym->address - (int)rsym->address;
+}
+
+static void
+buxn_ls_collect_labels(
+	buxn_ls_stack_check_t* check,
+	const buxn_ls_src_node_t* entry,
+	const buxn_ls_src_node_t* source
+) {
+	for (const buxn_ls_sym_node_t* sym = source->definitions; sym != NULL; sym = sym->next) {
+		if (
+			sym->entry != entry
+			|| sym->type != BUXN_ASM_SYM_LABEL
+			|| sym->address < 256
+		) {
+			continue;
+		}
+		barray_push(check->labels, sym, NULL);
+	}
+}
+
+static void
+buxn_ls_begin_stack_check(buxn_ls_stack_check_t* check, const buxn_ls_src_node_t* entry) {
+	barray_clear(check->labels);
+	bhash_clear(&check->label_indices);
+	bhash_clear(&check->trace_roots);
+	bhash_clear(&check->routines);
+	check->current_root = BUXN_CHESS_NO_TRACE;
+	check->num_live_traces = 0;
+	check->is_interleaved = false;
+	check->is_out_of_time = false;
+
+	buxn_ls_collect_labels(check, entry, entry);
+	for (
+		const buxn_ls_edge_t* edge = entry->base.out_edges;
+		edge != NULL;
+		edge = edge->next_out
+	) {
+		buxn_ls_collect_labels(check, entry, BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base));
+	}
+
+	size_t num_labels = barray_len(check->labels);
+	if (num_labels > 0) {
+		qsort(
+			check->labels,
+			num_labels, sizeof(check->labels[0]),
+			buxn_ls_cmp_label_address
+		);
+	}
+	for (size_t i = 0; i < num_labels; ++i) {
+		bhash_alloc_result_t alloc_result = bhash_alloc(&check->label_indices, check->labels[i]->address);
+		if (alloc_result.is_new) {
+			check->label_indices.keys[alloc_result.index] = check->labels[i]->address;
+			check->label_indices.values[alloc_result.index] = i;
+		}
+	}
+}
+
+static void
+buxn_ls_end_stack_check(buxn_ls_stack_check_t* check) {
+	bhash_index_t num_routines = bhash_len(&check->routines);
+	for (bhash_index_t i = 0; i < num_routines; ++i) {
+		buxn_ls_free_cached_diags(check->routines.values[i].diags);
+	}
+	bhash_clear(&check->routines);
+}
+
+static const buxn_ls_sym_node_t*
+buxn_ls_find_label_at(const buxn_ls_stack_check_t* check, uint16_t address, size_t* index_out) {
+	bhash_index_t index = bhash_find(&check->label_indices, address);
+	if (!bhash_is_valid(index)) { return NULL; }
+
+	size_t label_index = check->label_indices.values[index];
+	if (index_out != NULL) { *index_out = label_index; }
+	return check->labels[label_index];
+}
+
+static bhash_hash_t
+buxn_ls_hash_callee(bhash_hash_t key, const buxn_ls_sym_node_t* callee) {
+	key = buxn_ls_hash_combine(key, bhash_hash(callee->name.chars, callee->name.len));
+	return buxn_ls_hash_combine(key, bhash_hash(callee->signature.chars, callee->signature.len));
+}
+
+// JMP, JCN or JSR in any mode
+static bool
+buxn_ls_is_jump(uint8_t opcode) {
+	uint8_t base = opcode & 0x1f;
+	return base == 0x0c || base == 0x0d || base == 0x0e;
+}
+
+// Whether a literal is immediately used as the target of a jump on the same
+// stack
+static bool
+buxn_ls_is_literal_jump(uint8_t lit_opcode, uint8_t next_opcode, bool is_short) {
+	return buxn_ls_is_jump(next_opcode)
+		&& ((next_opcode & 0x20) != 0) == is_short
+		&& (next_opcode & 0x40) == (lit_opcode & 0x40);
+}
+
+// Returns false if the target is outside of the routine and not a label
+static bool
+buxn_ls_resolve_jump(
+	const buxn_ls_stack_check_t* check,
+	bhash_hash_t* key,
+	uint16_t target,
+	size_t code_start,
+	size_t code_end
+) {
+	const buxn_ls_sym_node_t* callee = buxn_ls_find_label_at(check, target, NULL);
+	if (callee != NULL) {
+		*key = buxn_ls_hash_callee(*key, callee);
+		return true;
+	}
+
+	return (size_t)target >= code_start + 256 && (size_t)target < code_end + 256;
+}
+
+// The key covers everything a trace of the routine depends on:
+// * Its code, which ends where a label of a different scope starts.
+// * Its source, so cached diagnostics still point to the right place.
+// * The signatures of itself and the routines it calls.
+static void
+buxn_ls_identify_routine(
+	buxn_asm_ctx_t* ctx,
+	buxn_ls_routine_trace_t* routine,
+	uint16_t address
+) {
+	const buxn_ls_stack_check_t* check = ctx->stack_check;
+	const buxn_ls_chess_input_t* input = ctx->chess_input;
+
+	size_t label_index;
+	const buxn_ls_sym_node_t* label = buxn_ls_find_label_at(check, address, &label_index);
+	if (label == NULL) { return; }
+
+	buxn_ls_str_t scope = buxn_ls_label_scope(label->name);
+	const buxn_ls_sym_node_t* next_label = NULL;
+	size_t num_labels = barray_len(check->labels);
+	for (size_t i = label_index + 1; i < num_labels; ++i) {
+		buxn_ls_str_t next_scope = buxn_ls_label_scope(check->labels[i]->name);
+		if (!buxn_ls_cstr_eq(&scope, &next_scope, 0)) {
+			next_label = check->labels[i];
+			break;
+		}
+	}
+
+	const buxn_ls_file_t* file = buxn_ls_find_file(&ctx->worker->files, label->source->filename);
+	if (file == NULL) { return; }
+
+	size_t code_start = (size_t)label->address - 256;
+	size_t code_end = next_label != NULL ? (size_t)next_label->address - 256 : input->rom_size;
+	if (code_end > input->rom_size) { code_end = input->rom_size; }
+	if (code_start >= code_end) { return; }
+
+	size_t source_start = (size_t)label->byte_offset;
+	size_t source_end = file->content.len;
+	routine->end_line = INT_MAX;
+	if (next_label != NULL && next_label->source == label->source) {
+		source_end = (size_t)next_label->byte_offset;
+		routine->end_line = next_label->range.start.line;
+	}
+	if (source_start > source_end) { return; }
+
+	bhash_hash_t key = bhash_hash(label->name.chars, label->name.len);
+	key = buxn_ls_hash_combine(key, bhash_hash(label->signature.chars, label->signature.len));
+	key = buxn_ls_hash_combine(key, bhash_hash(&input->rom[code_start], code_end - code_start));
+	key = buxn_ls_hash_combine(
+		key,
+		bhash_hash(file->content.chars + source_start, source_end - source_start)
+	);
+
+	// A callee outside of the routine is resolved to a label so a change to
+	// its signature changes the key.
+	// A jump whose target cannot be resolved depends on code which is not
+	// hashed.
+	bool is_cacheable = true;
+	for (size_t i = code_start; i < code_end && is_cacheable;) {
+		uint8_t opcode = input->rom[i];
+		switch (opcode) {
+			case 0x20:  // JCI
+			case 0x40:  // JMI
+			case 0x60: {  // JSI
+				if (i + 2 >= input->rom_size) { i = code_end; break; }
+
+				int16_t offset = (int16_t)(((uint16_t)input->rom[i + 1] << 8) | input->rom[i + 2]);
+				uint16_t target = (uint16_t)(i + 256 + 3 + offset);
+				is_cacheable = buxn_ls_resolve_jump(check, &key, target, code_start, code_end);
+				i += 3;
+			} break;
+			case 0x80:  // LIT
+			case 0xc0: {  // LITr
+				if (i + 2 >= input->rom_size) { i = code_end; break; }
+
+				// A relative offset used by the next JMP, JCN or JSR
+				if (buxn_ls_is_literal_jump(opcode, input->rom[i + 2], false)) {
+					int8_t offset = (int8_t)input->rom[i + 1];
+					uint16_t target = (uint16_t)(i + 256 + 3 + offset);
+					is_cacheable = buxn_ls_resolve_jump(check, &key, target, code_start, code_end);
+					i += 3;
+				} else {
+					i += 2;
+				}
+			} break;
+			case 0xa0:  // LIT2
+			case 0xe0: {  // LIT2r
+				if (i + 3 >= input->rom_size) { i = code_end; break; }
+
+				// An absolute address used by the next JMP2, JCN2 or JSR2
+				if (buxn_ls_is_literal_jump(opcode, input->rom[i + 3], true)) {
+					uint16_t target = (uint16_t)(((uint16_t)input->rom[i + 1] << 8) | input->rom[i + 2]);
+					is_cacheable = buxn_ls_resolve_jump(check, &key, target, code_start, code_end);
+					i += 4;
+				} else {
+					i += 3;
+				}
+			} break;
+			case 0x6c:  // JMP2r
+			case 0xec:  // JMP2kr
+				// Returns
+				i += 1;
+				break;
+			default:
+				// A computed address, e.g. from a table
+				if (buxn_ls_is_jump(opcode) && (opcode & 0x20) != 0) {
+					is_cacheable = false;
+				}
+				i += 1;
+				break;
+		}
+	}
+
+	routine->label = label;
+	routine->key = key;
+	routine->is_cacheable = is_cacheable;
+}
+
+static buxn_ls_routine_trace_t*
+buxn_ls_find_routine_trace(buxn_asm_ctx_t* ctx, buxn_chess_id_t trace_id) {
+	buxn_ls_stack_check_t* check = ctx->stack_check;
+	bhash_index_t root_index = bhash_find(&check->trace_roots, trace_id);
+	if (!bhash_is_valid(root_index)) { return NULL; }
+
+	bhash_index_t routine_index = bhash_find(&check->routines, check->trace_roots.values[root_index]);
+	return bhash_is_valid(routine_index) ? &check->routines.values[routine_index] : NULL;
+}
+
+static void
+buxn_ls_remember_chess_diag(
+	buxn_ls_routine_trace_t* routine,
+	const buxn_ls_diagnostic_t* diag
+) {
+	if (!routine->is_cacheable) { return; }
+
+	// The diagnostic must be within the source covered by the key
+	int first_line = routine->label->range.start.line;
+	if (
+		diag->location.uri != routine->label->source->uri
+		|| diag->location.range.start.line < first_line
+		|| diag->location.range.end.line >= routine->end_line
+	) {
+		routine->is_cacheable = false;
+		return;
+	}
+
+	buxn_ls_chess_cached_diag_t cached_diag = {
+		.range = diag->location.range,
+		.related_range = diag->related_location.range,
+		.severity = diag->severity,
+		.message = buxn_ls_strcpy(diag->message),
+		.related_message = diag->related_message != NULL
+			? buxn_ls_strcpy(diag->related_message)
+			: NULL,
+	};
+	cached_diag.range.start.line -= first_line;
+	cached_diag.range.end.line -= first_line;
+	if (diag->related_message != NULL) {
+		cached_diag.related_range.start.line -= first_line;
+		cached_diag.related_range.end.line -= first_line;
 	}
+	barray_push(routine->diags, cached_diag, NULL);
 }
 
 static void
-buxn_ls_init_analyzer_ctx(buxn_ls_analyzer_ctx_t* ctx, barena_pool_t* pool) {
-	barena_init(&ctx->arena, pool);
-
-	bhash_config_t hash_config = bhash_config_default();
-	hash_config.eq = buxn_ls_str_eq;
-	hash_config.hash = buxn_ls_str_hash;
-	hash_config.removable = false;
-	bhash_init(&ctx->sources, hash_config);
+buxn_ls_replay_chess_diags(
+	buxn_asm_ctx_t* ctx,
+	const buxn_ls_routine_trace_t* routine,
+	const buxn_ls_chess_cache_entry_t* entry
+) {
+	buxn_ls_analyzer_ctx_t* result = ctx->result;
+	int first_line = routine->label->range.start.line;
+	size_t num_diags = barray_len(entry->diags);
+	for (size_t i = 0; i < num_diags; ++i) {
+		const buxn_ls_chess_cached_diag_t* cached_diag = &entry->diags[i];
+		buxn_ls_diagnostic_t diag = {
+			.location = {
+				.uri = routine->label->source->uri,
+				.range = cached_diag->range,
+			},
+			.severity = cached_diag->severity,
+			.message = buxn_ls_arena_strcpy(&result->arena, cached_diag->message),
+			.source = "buxn-chess",
+			.entry = ctx->entry_node,
+		};
+		diag.location.range.start.line += first_line;
+		diag.location.range.end.line += first_line;
+		if (cached_diag->related_message != NULL) {
+			diag.related_location = (bio_lsp_location_t){
+				.uri = routine->label->source->uri,
+				.range = cached_diag->related_range,
+			};
+			diag.related_location.range.start.line += first_line;
+			diag.related_location.range.end.line += first_line;
+			diag.related_message = buxn_ls_arena_strcpy(&result->arena, cached_diag->related_message);
+		}
+		barray_push(result->diagnostics, diag, NULL);
+	}
 }
 
 static void
-buxn_ls_reset_analyzer_ctx(buxn_ls_analyzer_ctx_t* ctx) {
-	barena_reset(&ctx->arena);
-	bhash_clear(&ctx->sources);
-}
+buxn_ls_evict_chess_cache(buxn_ls_chess_cache_t* cache) {
+	bhash_index_t num_routines = bhash_len(&cache->routines);
+	if (num_routines <= BUXN_LS_CHESS_CACHE_CAPACITY) { return; }
 
-static void
-buxn_ls_cleanup_analyzer_ctx(buxn_ls_analyzer_ctx_t* ctx) {
-	bhash_cleanup(&ctx->sources);
-	barena_reset(&ctx->arena);
+	// Only keep the routines used by the latest pass.
+	// Iterate backward since removal moves the last entry into the hole.
+	for (bhash_index_t i = num_routines - 1; i >= 0; --i) {
+		if (cache->routines.values[i].last_used == cache->num_passes) { continue; }
+
+		bhash_index_t removed_index = bhash_remove(&cache->routines, cache->routines.keys[i]);
+		buxn_ls_free_cached_diags(cache->routines.values[removed_index].diags);
+	}
 }
 
 void
@@ -331,11 +1973,21 @@ buxn_ls_analyzer_init(buxn_ls_analyzer_t* analyzer, barena_pool_t* pool) {
 	buxn_ls_init_analyzer_ctx(&analyzer->ctx_b, pool);
 	analyzer->current_ctx = &analyzer->ctx_a;
 	analyzer->previous_ctx = &analyzer->ctx_b;
+	analyzer->snapshot = analyzer->current_ctx;
+	analyzer->cache.budget = BUXN_LS_DEFAULT_ANALYSIS_CACHE_BUDGET;
+	analyzer->num_workers = BUXN_LS_DEFAULT_ANALYSIS_WORKERS;
+	analyzer->chess_step_budget = BUXN_LS_DEFAULT_CHESS_STEP_BUDGET;
+	analyzer->chess_time_budget = BUXN_LS_DEFAULT_CHESS_TIME_BUDGET;
+	analyzer->position_encoding = BIO_LSP_POSITION_ENCODING_UTF16;
 
 	bhash_config_t hash_config = bhash_config_default();
 	hash_config.removable = false;
-	bhash_init(&analyzer->label_defs, hash_config);
+	bhash_init(&analyzer->sym_map, hash_config);
 
+	hash_config.removable = true;
+	bhash_init(&analyzer->chess_cache.routines, hash_config);
+
+	hash_config.removable = false;
 	hash_config.eq = buxn_ls_str_eq;
 	hash_config.hash = buxn_ls_str_hash;
 	bhash_init(&analyzer->files, hash_config);
@@ -343,243 +1995,433 @@ buxn_ls_analyzer_init(buxn_ls_analyzer_t* analyzer, barena_pool_t* pool) {
 
 void
 buxn_ls_analyzer_cleanup(buxn_ls_analyzer_t* analyzer) {
-	barray_free(NULL, analyzer->macro_defs);
-	barray_free(NULL, analyzer->references);
-	barray_free(NULL, analyzer->diagnostics);
 	barray_free(NULL, analyzer->lines);
 	barray_free(NULL, analyzer->analyze_queue);
+	barray_free(NULL, analyzer->jobs);
+	barray_free(NULL, analyzer->deferred_nodes);
+	buxn_ls_clear_chess_queue(analyzer);
+	barray_free(NULL, analyzer->chess_queue);
+
+	if (analyzer->workers != NULL) {
+		for (int i = 0; i < analyzer->num_workers; ++i) {
+			buxn_ls_cleanup_worker(&analyzer->workers[i]);
+		}
+		buxn_ls_free(analyzer->workers);
+	}
 
-	bhash_cleanup(&analyzer->label_defs);
+	bhash_cleanup(&analyzer->sym_map);
 	bhash_cleanup(&analyzer->files);
+	for (
+		buxn_ls_analysis_cache_entry_t* itr = analyzer->cache.first;
+		itr != NULL;
+	) {
+		buxn_ls_analysis_cache_entry_t* next = itr->next;
+		buxn_ls_destroy_cache_entry(itr);
+		itr = next;
+	}
+	bhash_index_t num_routines = bhash_len(&analyzer->chess_cache.routines);
+	for (bhash_index_t i = 0; i < num_routines; ++i) {
+		buxn_ls_free_cached_diags(analyzer->chess_cache.routines.values[i].diags);
+	}
+	bhash_cleanup(&analyzer->chess_cache.routines);
 	buxn_ls_cleanup_analyzer_ctx(&analyzer->ctx_a);
 	buxn_ls_cleanup_analyzer_ctx(&analyzer->ctx_b);
 }
 
-void
+static void
+buxn_ls_process_queue(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_progress_fn_t progress_fn,
+	void* progress_userdata
+) {
+	// Analyze files in order.
+	// Entries whose included files are known from a previous run are batched
+	// and assembled concurrently.
+	// Others have to be assembled alone after everything before them is
+	// merged since they may open a file which comes later in the queue.
+	analyzer->batch_epoch = buxn_ls_analyzer_next_epoch(analyzer);
+	for (size_t i = 0; ; ++i) {
+		// Pending jobs are dropped without being run
+		bio_yield();
+		if (analyzer->should_cancel) { break; }
+
+		if (progress_fn != NULL) {
+			progress_fn(progress_userdata, (int)i, (int)barray_len(analyzer->analyze_queue));
+		}
+
+		if (i == barray_len(analyzer->analyze_queue)) {
+			// This may requeue some deferred files
+			buxn_ls_run_jobs(analyzer, workspace);
+			if (i == barray_len(analyzer->analyze_queue)) { break; }
+		}
+
+		buxn_ls_src_node_t* node = analyzer->analyze_queue[i];
+		if (node->analyzed) {
+			BIO_INFO("Skipping %s", node->filename);
+			continue;
+		}
+
+		if (node->schedule_epoch == analyzer->batch_epoch) {
+			barray_push(analyzer->deferred_nodes, node, NULL);
+			continue;
+		}
+
+		bhash_index_t previous_node_index = bhash_find(&analyzer->previous_ctx->sources, node->filename);
+		buxn_ls_src_node_t* previous_node = bhash_is_valid(previous_node_index)
+			? analyzer->previous_ctx->sources.values[previous_node_index]
+			: NULL;
+		buxn_ls_analysis_cache_entry_t* cache_entry;
+		if (
+			previous_node != NULL
+			&& buxn_ls_can_reuse_entry(analyzer, workspace, analyzer->previous_ctx, previous_node)
+		) {
+			BIO_INFO("Reusing %s", node->filename);
+			buxn_ls_schedule_job(
+				analyzer, workspace,
+				BUXN_LS_JOB_COPY, node,
+				analyzer->previous_ctx, previous_node
+			);
+		} else if ((cache_entry = buxn_ls_find_cached_entry(analyzer, workspace, node->filename)) != NULL) {
+			BIO_INFO("Restoring %s from cache", node->filename);
+			buxn_ls_schedule_job(
+				analyzer, workspace,
+				BUXN_LS_JOB_COPY, node,
+				&cache_entry->ctx, cache_entry->entry
+			);
+		} else if (buxn_ls_preload_entry(analyzer, workspace, previous_node)) {
+			BIO_INFO("Analyzing %s", node->filename);
+			buxn_ls_schedule_job(
+				analyzer, workspace,
+				BUXN_LS_JOB_ASSEMBLE, node,
+				analyzer->previous_ctx, previous_node
+			);
+		} else {
+			buxn_ls_run_jobs(analyzer, workspace);
+			if (node->analyzed) {
+				BIO_INFO("Skipping %s", node->filename);
+				continue;
+			}
+
+			BIO_INFO("Analyzing %s", node->filename);
+			buxn_ls_analysis_job_t job = {
+				.type = BUXN_LS_JOB_ASSEMBLE,
+				.node = node,
+			};
+			buxn_ls_assemble_entry(analyzer, workspace, &analyzer->workers[0], &job, false);
+			buxn_ls_merge_job(analyzer, workspace, &job);
+		}
+	}
+}
+
+static void
+buxn_ls_queue_root(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const char* filename
+) {
+	bhash_index_t current_node_index = bhash_find(&analyzer->current_ctx->sources, filename);
+	if (bhash_is_valid(current_node_index)) {  // File is already added
+		return;
+	}
+
+	bhash_index_t previous_node_index = bhash_find(&analyzer->previous_ctx->sources, filename);
+	if (bhash_is_valid(previous_node_index)) {  // We saw this file before
+		buxn_ls_queue_from_root(
+			analyzer,
+			workspace,
+			analyzer->previous_ctx->sources.values[previous_node_index]
+		);
+	} else {  // This was never seen before
+		buxn_ls_do_queue_file(analyzer, workspace, filename);
+	}
+}
+
+static void
+buxn_ls_queue_entry(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	const char* filename
+) {
+	bhash_index_t node_index = bhash_find(&analyzer->current_ctx->sources, filename);
+	if (!bhash_is_valid(node_index)) {
+		buxn_ls_do_queue_file(analyzer, workspace, filename);
+	}
+}
+
+static void
+buxn_ls_drop_pending_jobs(buxn_ls_analyzer_t* analyzer) {
+	barray_clear(analyzer->jobs);
+	barray_clear(analyzer->deferred_nodes);
+	buxn_ls_clear_chess_queue(analyzer);
+}
+
+bool
 buxn_ls_analyze(buxn_ls_analyzer_t* analyzer, buxn_ls_workspace_t* workspace) {
+	if (analyzer->workers == NULL) {
+		if (analyzer->num_workers < 1) { analyzer->num_workers = 1; }
+		analyzer->workers = buxn_ls_malloc(sizeof(buxn_ls_analysis_worker_t) * analyzer->num_workers);
+		for (int i = 0; i < analyzer->num_workers; ++i) {
+			buxn_ls_init_worker(&analyzer->workers[i]);
+		}
+	}
+
+	// A cancellation requested after the last run stopped is for this one's
+	// content which is about to be loaded
+	analyzer->should_cancel = false;
+
+	// Loaded files may be keyed by the filenames of dropped nodes
+	bhash_clear(&analyzer->files);
 	{
+		buxn_ls_cache_dropped_entries(analyzer, workspace);
 		buxn_ls_reset_analyzer_ctx(analyzer->previous_ctx);
 		buxn_ls_analyzer_ctx_t* tmp = analyzer->current_ctx;
 		analyzer->current_ctx = analyzer->previous_ctx;
 		analyzer->previous_ctx = tmp;
 	}
 	barray_clear(analyzer->analyze_queue);
+	barray_clear(analyzer->lines);
+	buxn_ls_clear_chess_queue(analyzer);
+
+	// Files from the previous run are likely to be opened again
+	bhash_index_t num_previous_files = bhash_len(&analyzer->previous_ctx->sources);
+	if (num_previous_files > 0) {
+		buxn_ls_workspace_prefetch(
+			workspace,
+			analyzer->previous_ctx->sources.keys,
+			(size_t)num_previous_files
+		);
+	}
 
 	// Based on dependency of files in the previous run, try to figure out in
 	// what order the files should be compiled.
+	buxn_ls_analyzer_next_epoch(analyzer);
+
+	// Workspace entries which were already indexed go first so that open
+	// documents they include are analyzed as part of them.
+	// They are cheap to carry over, the others are left to buxn_ls_index.
+	size_t num_roots = barray_len(workspace->roots);
+	for (size_t i = 0; i < num_roots; ++i) {
+		const char* filename = workspace->roots[i];
+		bhash_index_t previous_node_index = bhash_find(&analyzer->previous_ctx->sources, filename);
+		if (
+			bhash_is_valid(previous_node_index)
+			&& analyzer->previous_ctx->sources.values[previous_node_index]->is_entry
+		) {
+			buxn_ls_queue_entry(analyzer, workspace, filename);
+		}
+	}
+
 	bhash_index_t num_docs = bhash_len(&workspace->docs);
 	for (bhash_index_t doc_index = 0 ; doc_index < num_docs; ++doc_index) {
-		const char* filename = workspace->docs.keys[doc_index];
-		bhash_index_t current_node_index = bhash_find(&analyzer->current_ctx->sources, filename);
-		if (bhash_is_valid(current_node_index)) {  // File is already added
-			continue;
-		}
+		buxn_ls_queue_root(analyzer, workspace, workspace->docs.keys[doc_index]);
+	}
+	// A document may no longer be included by the entry it was reached from
+	for (bhash_index_t doc_index = 0 ; doc_index < num_docs; ++doc_index) {
+		buxn_ls_queue_entry(analyzer, workspace, workspace->docs.keys[doc_index]);
+	}
 
-		bhash_index_t previous_node_index = bhash_find(&analyzer->previous_ctx->sources, filename);
-		if (bhash_is_valid(previous_node_index)) {  // We saw this file before
-			buxn_ls_queue_from_root(
-				analyzer,
-				workspace,
-				analyzer->previous_ctx->sources.values[previous_node_index]
-			);
-		} else {  // This was never seen before
-			buxn_ls_do_queue_file(analyzer, workspace, filename);
-		}
+	buxn_ls_process_queue(analyzer, workspace, NULL, NULL);
+
+	if (analyzer->should_cancel) {
+		BIO_INFO("Analysis cancelled");
+		analyzer->should_cancel = false;
+		buxn_ls_drop_pending_jobs(analyzer);
+
+		// The last complete result is the base for the next analysis
+		buxn_ls_reset_analyzer_ctx(analyzer->current_ctx);
+		buxn_ls_analyzer_ctx_t* tmp = analyzer->current_ctx;
+		analyzer->current_ctx = analyzer->previous_ctx;
+		analyzer->previous_ctx = tmp;
+		return false;
 	}
 
-	// Analyze files in order
-	barray_clear(analyzer->lines);
-	bhash_clear(&analyzer->files);
-	barray_clear(analyzer->diagnostics);
-	for (size_t i = 0; i < barray_len(analyzer->analyze_queue); ++i) {
-		buxn_ls_src_node_t* node = analyzer->analyze_queue[i];
-		if (!node->analyzed) {
-			BIO_INFO("Analyzing %s", node->filename);
+	BIO_INFO(
+		"Analysis cache: %d hit(s), %d miss(es), %zu/%zu bytes",
+		analyzer->cache.num_hits, analyzer->cache.num_misses,
+		analyzer->cache.size, analyzer->cache.budget
+	);
 
-			barray_clear(analyzer->macro_defs);
-			bhash_clear(&analyzer->label_defs);
-			barray_clear(analyzer->references);
-
-			buxn_anno_t annotations[] = {
-				[BUXN_LS_ANNO_DOC] = {
-					.type = BUXN_ANNOTATION_PREFIX,
-					.name = "doc",
-				},
-				[BUXN_LS_ANNO_BUXN_DEVICE] = {
-					.type = BUXN_ANNOTATION_IMMEDIATE,
-					.name = "buxn:device",
-				},
-				[BUXN_LS_ANNO_BUXN_MEMORY] = {
-					.type = BUXN_ANNOTATION_IMMEDIATE,
-					.name = "buxn:memory",
-				},
-				[BUXN_LS_ANNO_BUXN_ENUM] = {
-					.type = BUXN_ANNOTATION_PREFIX,
-					.name = "buxn:enum",
-				},
-			};
-			buxn_asm_ctx_t ctx = {
-				.entry_node = node,
-				.analyzer = analyzer,
-				.workspace = workspace,
-				.anno_spec = {
-					.annotations = annotations,
-					.num_annotations = BCOUNT_OF(annotations),
-					.ctx = &ctx,
-					.handler = buxn_ls_handle_annotation,
-				},
-			};
-			barena_init(&ctx.chess_arena, analyzer->arena_pool);
-			ctx.chess = buxn_chess_begin(&ctx);
-			bool success = buxn_asm(&ctx, node->filename);
-			if (success && !ctx.rom_is_empty) {
-				buxn_chess_end(ctx.chess);
-			}
-			barena_reset(&ctx.chess_arena);
-
-			// Bring forward old symbols in files with error to have some degree
-			// of error tolerance
-			bhash_index_t num_files = bhash_len(&analyzer->files);
-			for (bhash_index_t file_index = 0; file_index < num_files; ++file_index) {
-				buxn_ls_file_t* file = &analyzer->files.values[file_index];
-				if (!file->has_error) { continue; }
-
-				bhash_index_t previous_src_index = bhash_find(
-					&analyzer->previous_ctx->sources, analyzer->files.keys[file_index]
-				);
-				if (!bhash_is_valid(previous_src_index)) { continue; }
-				buxn_ls_src_node_t* previous_src_node = analyzer->previous_ctx->sources.values[previous_src_index];
-
-				bhash_index_t current_src_index = bhash_find(
-					&analyzer->current_ctx->sources, analyzer->files.keys[file_index]
-				);
-				if (!bhash_is_valid(current_src_index)) { continue; }
-				buxn_ls_src_node_t* current_src_node = analyzer->current_ctx->sources.values[current_src_index];
-
-				for (
-					buxn_ls_sym_node_t* sym_node = previous_src_node->definitions;
-					sym_node != NULL;
-					sym_node = sym_node->next
-				) {
-					if (sym_node->byte_offset <= file->last_symbol_byte) {
-						continue;
-					}
+	// Sort diagnostics so that messages for the same file are grouped together
+	size_t num_diags = barray_len(analyzer->current_ctx->diagnostics);
+	if (num_diags > 0) {
+		qsort(
+			analyzer->current_ctx->diagnostics,
+			num_diags, sizeof(analyzer->current_ctx->diagnostics[0]),
+			buxn_ls_cmp_diagnostic
+		);
+	}
 
-					// Symbol appears after error
-					buxn_ls_sym_node_t* sym_copy = barena_memalign(
-						&analyzer->current_ctx->arena,
-						sizeof(buxn_ls_sym_node_t), _Alignof(buxn_ls_sym_node_t)
-					);
-					*sym_copy = (buxn_ls_sym_node_t){
-						.name = buxn_ls_arena_cstrcpy(
-							&analyzer->current_ctx->arena,
-							sym_node->name
-						),
-						.documentation = buxn_ls_arena_cstrcpy(
-							&analyzer->current_ctx->arena,
-							sym_node->documentation
-						),
-						.signature = buxn_ls_arena_cstrcpy(
-							&analyzer->current_ctx->arena,
-							sym_node->signature
-						),
-						.source = current_src_node,
-						.type = sym_node->type,
-						.semantics = sym_node->semantics,
-						.byte_offset = sym_node->byte_offset,
-						.range = sym_node->range,
-						.address = sym_node->address,
-					};
-
-					sym_copy->next = sym_copy->source->definitions;
-					sym_copy->source->definitions = sym_copy;
-				}
-			}
+	buxn_ls_sort_symbols(analyzer->current_ctx);
+	analyzer->snapshot = analyzer->current_ctx;
+	return true;
+}
 
-			// Connect references to definitions
-			size_t num_refs = barray_len(analyzer->references);
-			for (size_t sym_index = 0; sym_index < num_refs; ++sym_index) {
-				const buxn_asm_sym_t* sym = &analyzer->references[sym_index];
-
-				buxn_ls_sym_node_t* def_node = NULL;
-				if (sym->type == BUXN_ASM_SYM_MACRO_REF) {
-					// Macros cannot be forward declared so references can only
-					// be resolved when a macro is already declared
-					def_node = analyzer->macro_defs[sym->id - 1];
-				} else if (sym->type == BUXN_ASM_SYM_LABEL_REF) {
-					bhash_index_t def_index = bhash_find(&analyzer->label_defs, sym->id);
-					if (bhash_is_valid(def_index)) {
-						def_node = analyzer->label_defs.values[def_index];
-					}
-				}
+bool
+buxn_ls_index(
+	buxn_ls_analyzer_t* analyzer,
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_progress_fn_t progress_fn,
+	void* progress_userdata
+) {
+	barray_clear(analyzer->analyze_queue);
+	buxn_ls_analyzer_next_epoch(analyzer);
+	size_t num_roots = barray_len(workspace->roots);
+	for (size_t i = 0; i < num_roots; ++i) {
+		buxn_ls_queue_entry(analyzer, workspace, workspace->roots[i]);
+	}
+	if (barray_len(analyzer->analyze_queue) == 0) { return true; }
 
-				if (def_node == NULL) {  // Unresolved reference
-					continue;
-				}
+	BIO_INFO("Indexing %zu file(s)", barray_len(analyzer->analyze_queue));
+	buxn_ls_process_queue(analyzer, workspace, progress_fn, progress_userdata);
 
-				buxn_ls_sym_node_t* ref_node = buxn_ls_make_sym_node(analyzer, sym);
-				ref_node->next = ref_node->source->references;
-				ref_node->source->references = ref_node;
-				buxn_ls_graph_add_edge(
-					&analyzer->current_ctx->arena,
-					&ref_node->base,
-					&def_node->base
-				);
-				/*BIO_TRACE(*/
-					/*"Connecting reference for %s"*/
-					/*" from %s:%d:%d:%d:%d"*/
-					/*" to %s:%d:%d:%d:%d",*/
-					/*sym->name,*/
-
-					/*ref_node->source->uri,*/
-					/*ref_node->range.start.line, ref_node->range.start.character,*/
-					/*ref_node->range.end.line, ref_node->range.end.character,*/
-
-					/*def_node->source->uri,*/
-					/*def_node->range.start.line, def_node->range.start.character,*/
-					/*def_node->range.end.line, def_node->range.end.character*/
-				/*);*/
-			}
-		} else {
-			BIO_INFO("Skipping %s", node->filename);
+	size_t num_diags = barray_len(analyzer->current_ctx->diagnostics);
+	if (num_diags > 0) {
+		qsort(
+			analyzer->current_ctx->diagnostics,
+			num_diags, sizeof(analyzer->current_ctx->diagnostics[0]),
+			buxn_ls_cmp_diagnostic
+		);
+	}
+
+	buxn_ls_sort_symbols(analyzer->current_ctx);
+
+	// Entries merged so far are kept, the next analysis carries them over
+	if (analyzer->should_cancel) {
+		BIO_INFO("Indexing interrupted");
+		analyzer->should_cancel = false;
+		buxn_ls_drop_pending_jobs(analyzer);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+buxn_ls_check_stack(buxn_ls_analyzer_t* analyzer, buxn_ls_workspace_t* workspace) {
+	// Regions are converted using the files loaded by the last analysis
+	buxn_ls_analysis_worker_t* worker = &analyzer->workers[0];
+	bhash_clear(&worker->files);
+	barray_clear(worker->lines);
+	bhash_index_t num_files = bhash_len(&analyzer->files);
+	for (bhash_index_t i = 0; i < num_files; ++i) {
+		buxn_ls_file_t file = analyzer->files.values[i];
+		file.first_line_index = -1;
+		bhash_put(&worker->files, analyzer->files.keys[i], file);
+	}
+
+	buxn_ls_chess_cache_t* cache = &analyzer->chess_cache;
+	cache->num_passes += 1;
+	buxn_ls_stack_check_t stack_check = { 0 };
+	bhash_config_t hash_config = bhash_config_default();
+	hash_config.removable = false;
+	bhash_init(&stack_check.label_indices, hash_config);
+	bhash_init(&stack_check.trace_roots, hash_config);
+	bhash_init(&stack_check.routines, hash_config);
+
+	size_t num_inputs = barray_len(analyzer->chess_queue);
+	for (size_t i = 0; i < num_inputs; ++i) {
+		bio_yield();
+		if (analyzer->should_cancel) { break; }
+
+		buxn_ls_chess_input_t* input = analyzer->chess_queue[i];
+		BIO_INFO("Checking %s", input->entry->filename);
+		buxn_asm_ctx_t ctx = {
+			.entry_node = input->entry,
+			.analyzer = analyzer,
+			.workspace = workspace,
+			.worker = worker,
+			.result = analyzer->current_ctx,
+			.chess_input = input,
+			.stack_check = &stack_check,
+		};
+		buxn_ls_begin_stack_check(&stack_check, input->entry);
+		stack_check.deadline = bio_current_time_ms() + analyzer->chess_time_budget;
+		stack_check.steps_until_clock = BUXN_LS_CHESS_CLOCK_INTERVAL;
+		barena_init(&ctx.chess_arena, &worker->arena_pool);
+		ctx.chess = buxn_chess_begin(&ctx);
+		size_t num_symbols = barray_len(input->symbols);
+		for (size_t sym_index = 0; sym_index < num_symbols; ++sym_index) {
+			const buxn_ls_chess_sym_t* chess_sym = &input->symbols[sym_index];
+			buxn_chess_handle_symbol(ctx.chess, chess_sym->addr, &chess_sym->sym);
 		}
+		buxn_chess_end(ctx.chess);
+		barena_reset(&ctx.chess_arena);
+		buxn_ls_end_stack_check(&stack_check);
+
+		if (ctx.is_cancelled) { break; }
+		input->entry->is_checked = true;
 	}
+	buxn_ls_clear_chess_queue(analyzer);
+	barray_free(NULL, stack_check.labels);
+	bhash_cleanup(&stack_check.label_indices);
+	bhash_cleanup(&stack_check.trace_roots);
+	bhash_cleanup(&stack_check.routines);
+
+	BIO_INFO(
+		"Stack checking cache: %d hit(s), %d miss(es), %d routine(s)",
+		cache->num_hits, cache->num_misses, (int)bhash_len(&cache->routines)
+	);
+	buxn_ls_evict_chess_cache(cache);
 
-	// Sort diagnostics so that messages for the same file are grouped together
-	size_t num_diags = barray_len(analyzer->diagnostics);
+	if (analyzer->should_cancel) {
+		BIO_INFO("Stack checking cancelled");
+		analyzer->should_cancel = false;
+		return false;
+	}
+
+	size_t num_diags = barray_len(analyzer->current_ctx->diagnostics);
 	if (num_diags > 0) {
 		qsort(
-			analyzer->diagnostics,
-			num_diags, sizeof(analyzer->diagnostics[0]),
+			analyzer->current_ctx->diagnostics,
+			num_diags, sizeof(analyzer->current_ctx->diagnostics[0]),
 			buxn_ls_cmp_diagnostic
 		);
 	}
+
+	return true;
+}
+
+// Let other coroutines run once in a while during a long assembly.
+// Returns false when the analysis should be abandoned.
+static bool
+buxn_ls_yield_point(buxn_asm_ctx_t* ctx, size_t cost) {
+	if (ctx->is_async) { return true; }
+
+	ctx->work_since_yield += cost;
+	if (ctx->work_since_yield >= BUXN_LS_YIELD_INTERVAL) {
+		ctx->work_since_yield = 0;
+		bio_yield();
+		ctx->is_cancelled = ctx->analyzer->should_cancel;
+	}
+
+	return !ctx->is_cancelled;
 }
 
 void*
 buxn_asm_alloc(buxn_asm_ctx_t* ctx, size_t size, size_t alignment) {
-	return barena_memalign(&ctx->analyzer->current_ctx->arena, size, alignment);
+	return barena_memalign(&ctx->result->arena, size, alignment);
 }
 
 void
 buxn_asm_report(buxn_asm_ctx_t* ctx, buxn_asm_report_type_t type, const buxn_asm_report_t* report) {
-	buxn_ls_analyzer_t* analyzer = ctx->analyzer;
+	buxn_ls_analyzer_ctx_t* result = ctx->result;
 
 	// Only save reports about source regions, not top level reports
 	if (report->region->range.start.line == 0) { return; }
 
 	if (type == BUXN_ASM_REPORT_ERROR) {
-		bhash_index_t file_index = bhash_find(&analyzer->files, report->region->filename);
-		if (bhash_is_valid(file_index)) {
-			buxn_ls_file_t* file = &analyzer->files.values[file_index];
+		buxn_ls_file_t* file = buxn_ls_find_file(&ctx->worker->files, report->region->filename);
+		if (file != NULL) {
 			file->has_error = true;
 		}
 	}
 
 	buxn_ls_diagnostic_t diag = {
-		.location = buxn_ls_convert_region(ctx->analyzer, *report->region),
-		.message = buxn_ls_arena_strcpy(&ctx->analyzer->current_ctx->arena, report->message),
+		.location = buxn_ls_convert_region(ctx, *report->region),
+		.message = buxn_ls_arena_strcpy(&result->arena, report->message),
 		.source = "buxn-asm",
+		.entry = ctx->entry_node,
 	};
 	switch (type) {
 		case BUXN_ASM_REPORT_WARNING:
@@ -596,22 +2438,26 @@ buxn_asm_report(buxn_asm_ctx_t* ctx, buxn_asm_report_type_t type, const buxn_asm
 		report->related_message != NULL
 		&& report->related_region->filename == report->region->filename
 	) {
-		diag.related_location = buxn_ls_convert_region(ctx->analyzer, *report->region);
-		diag.related_message = buxn_ls_arena_strcpy(&ctx->analyzer->current_ctx->arena, report->related_message);
+		diag.related_location = buxn_ls_convert_region(ctx, *report->region);
+		diag.related_message = buxn_ls_arena_strcpy(&result->arena, report->related_message);
 	}
 
-	barray_push(analyzer->diagnostics, diag, NULL);
+	barray_push(result->diagnostics, diag, NULL);
 }
 
 void
 buxn_asm_put_rom(buxn_asm_ctx_t* ctx, uint16_t addr, uint8_t value) {
 	ctx->rom[addr - 256] = value;
 	ctx->rom_is_empty = false;
+	if ((size_t)(addr - 256) >= ctx->rom_size) {
+		ctx->rom_size = (size_t)(addr - 256) + 1;
+	}
 }
 
 void
 buxn_asm_put_symbol(buxn_asm_ctx_t* ctx, uint16_t addr, const buxn_asm_sym_t* sym) {
-	buxn_chess_handle_symbol(ctx->chess, addr, sym);
+	buxn_ls_chess_sym_t chess_sym = { .addr = addr, .sym = *sym };
+	barray_push(ctx->chess_symbols, chess_sym, NULL);
 
 	// When an address reference is 16 bit, there will be two identical symbols
 	// emitted for both bytes.
@@ -626,18 +2472,18 @@ buxn_asm_put_symbol(buxn_asm_ctx_t* ctx, uint16_t addr, const buxn_asm_sym_t* sy
 		return;
 	}
 
-	buxn_ls_analyzer_t* analyzer = ctx->analyzer;
+	buxn_ls_analysis_worker_t* worker = ctx->worker;
 	switch (sym->type) {
 		case BUXN_ASM_SYM_MACRO:
 		case BUXN_ASM_SYM_LABEL: {
-			buxn_ls_file_t* file = buxn_ls_find_file(analyzer, sym->region.filename);
+			buxn_ls_file_t* file = buxn_ls_find_file(&worker->files, sym->region.filename);
 			assert((file != NULL) && "Symbol comes from unopened file");
 			if (sym->region.range.start.byte > file->last_symbol_byte) {
 				file->last_symbol_byte = sym->region.range.start.byte;
 			}
 
 			if (!sym->name_is_generated) {
-				buxn_ls_sym_node_t* sym_node = buxn_ls_make_sym_node(analyzer, sym);
+				buxn_ls_sym_node_t* sym_node = buxn_ls_make_sym_node(ctx, sym);
 				sym_node->next = sym_node->source->definitions;
 				sym_node->source->definitions = sym_node;
 				if (sym->type == BUXN_ASM_SYM_LABEL) {
@@ -657,17 +2503,17 @@ buxn_asm_put_symbol(buxn_asm_ctx_t* ctx, uint16_t addr, const buxn_asm_sym_t* sy
 					}
 
 					uint16_t id = sym->id;
-					bhash_put(&analyzer->label_defs, id, sym_node);
+					bhash_put(&worker->label_defs, id, sym_node);
 				} else {
 					sym_node->semantics = BUXN_LS_SYMBOL_AS_SUBROUTINE;
-					barray_push(analyzer->macro_defs, sym_node, NULL);
+					barray_push(worker->macro_defs, sym_node, NULL);
 				}
 				ctx->current_sym_node = sym_node;
 			}
 		} break;
 		case BUXN_ASM_SYM_MACRO_REF:
 		case BUXN_ASM_SYM_LABEL_REF:
-			barray_push(analyzer->references, *sym, NULL);
+			barray_push(worker->references, *sym, NULL);
 			break;
 		default:
 			break;
@@ -680,83 +2526,39 @@ buxn_asm_put_symbol(buxn_asm_ctx_t* ctx, uint16_t addr, const buxn_asm_sym_t* sy
 buxn_asm_file_t*
 buxn_asm_fopen(buxn_asm_ctx_t* ctx, const char* filename) {
 	buxn_ls_analyzer_t* analyzer = ctx->analyzer;
-	bhash_index_t file_index = bhash_find(&analyzer->files, filename);
-	buxn_ls_str_t content;
-	if (bhash_is_valid(file_index)) {  // File is already read
-		content = analyzer->files.values[file_index].content;
-	} else {  // New file
-		bhash_index_t doc_index = bhash_find(&ctx->workspace->docs, (char*){ (char*)filename });
-		if (bhash_is_valid(doc_index)) {  // File is managed
-			// Make a copy so that even if workspace gets updated, we analyze
-			// based on the current content
-			buxn_ls_str_t content_str = ctx->workspace->docs.values[doc_index];
-			char* content_copy = barena_memalign(
-				&ctx->analyzer->current_ctx->arena,
-				content_str.len,
-				_Alignof(char)
-			);
-			memcpy(content_copy, content_str.chars, content_str.len);
-			content = (buxn_ls_str_t){
-				.chars = content_copy,
-				.len = content_str.len,
-			};
-		} else {  // File is unmanaged
-			bio_file_t fd;
-			bio_error_t error = { 0 };
-			char full_path[1024];
-			snprintf(full_path, sizeof(full_path), "%s%s", ctx->workspace->root_dir, filename);
-			if (!bio_fopen(&fd, full_path, "r", &error)) {
-				BIO_ERROR("Could not open %s: " BIO_ERROR_FMT, full_path, BIO_ERROR_FMT_ARGS(&error));
-				return NULL;
-			}
-
-			bio_stat_t stat;
-			if (!bio_fstat(fd, &stat,&error)) {
-				BIO_ERROR("Could not stat %s: " BIO_ERROR_FMT, full_path, BIO_ERROR_FMT_ARGS(&error));
-				bio_fclose(fd, NULL);
-				return NULL;
-			}
-
-			char* read_buf = barena_memalign(&ctx->analyzer->current_ctx->arena, stat.size, _Alignof(char));
-			if (bio_fread_exactly(fd, read_buf, stat.size, &error) != stat.size) {
-				BIO_ERROR("Error while reading %s: " BIO_ERROR_FMT, full_path, BIO_ERROR_FMT_ARGS(&error));
-				bio_fclose(fd, NULL);
-				return NULL;
-			}
-
-			content = (buxn_ls_str_t){
-				.chars = read_buf,
-				.len = stat.size,
-			};
-			bio_fclose(fd, NULL);
+	buxn_ls_analyzer_ctx_t* result = ctx->result;
+
+	// Files are only loaded from the bio thread.
+	// A worker can only open what was preloaded for its job.
+	const buxn_ls_file_t* shared_file;
+	if (ctx->is_async) {
+		if (!buxn_ls_is_file_expected(ctx->job, filename)) {
+			ctx->job->missing_file = true;
+			return NULL;
 		}
-
-		buxn_ls_file_t file = {
-			.content = content,
-			.zero_page_semantics = BUXN_LS_SYMBOL_AS_VARIABLE,
-			.first_line_index = -1,
-			.has_error = false,
-		};
-		bhash_put(&analyzer->files, filename, file);
+		shared_file = buxn_ls_find_file(&analyzer->files, filename);
+	} else {
+		shared_file = buxn_ls_load_node_file(analyzer, ctx->workspace, filename);
 	}
+	if (shared_file == NULL) { return NULL; }
 
-	buxn_asm_file_t* file = buxn_ls_malloc(sizeof(buxn_asm_file_t));
-	*file = (buxn_asm_file_t){ .content = content };
+	buxn_ls_src_node_t* node = buxn_ls_find_or_alloc_node(result, ctx->workspace, filename);
+	node->analyzed = true;
+	node->content_hash = shared_file->content_hash;
 
-	bhash_alloc_result_t alloc_result = bhash_alloc(&analyzer->current_ctx->sources, filename);
-	buxn_ls_src_node_t* node;
-	if (alloc_result.is_new) {
-		node = buxn_ls_alloc_node(analyzer, ctx->workspace, filename);
-		analyzer->current_ctx->sources.keys[alloc_result.index] = node->filename;
-		analyzer->current_ctx->sources.values[alloc_result.index] = node;
-	} else {
-		node = analyzer->current_ctx->sources.values[alloc_result.index];
+	bhash_index_t file_index = bhash_find(&ctx->worker->files, node->filename);
+	if (!bhash_is_valid(file_index)) {
+		file_index = bhash_alloc(&ctx->worker->files, node->filename).index;
+		ctx->worker->files.keys[file_index] = node->filename;
+		ctx->worker->files.values[file_index] = *shared_file;
 	}
-	node->analyzed = true;
+
+	buxn_asm_file_t* file = buxn_ls_malloc(sizeof(buxn_asm_file_t));
+	*file = (buxn_asm_file_t){ .content = shared_file->content };
 
 	if (node != ctx->entry_node) {
 		buxn_ls_graph_add_edge(
-			&analyzer->current_ctx->arena,
+			&result->arena,
 			&ctx->entry_node->base,
 			&node->base
 		);
@@ -773,6 +2575,8 @@ buxn_asm_fclose(buxn_asm_ctx_t* ctx, buxn_asm_file_t* file) {
 
 int
 buxn_asm_fgetc(buxn_asm_ctx_t* ctx, buxn_asm_file_t* file) {
+	if (!buxn_ls_yield_point(ctx, 1)) { return EOF; }
+
 	if (file->offset < file->content.len) {
 		return (int)file->content.chars[file->offset++];
 	} else {
@@ -795,9 +2599,119 @@ buxn_chess_end_mem_region(buxn_asm_ctx_t* ctx, void* region) {
 	barena_restore(&ctx->chess_arena, (barena_snapshot_t)region);
 }
 
+// Stop tracing a routine while keeping the diagnostics gathered so far
+static void
+buxn_ls_truncate_routine(
+	buxn_asm_ctx_t* ctx,
+	buxn_ls_routine_trace_t* routine,
+	const char* reason
+) {
+	buxn_ls_analyzer_ctx_t* result = ctx->result;
+	routine->is_truncated = true;
+	routine->is_cacheable = false;
+
+	buxn_ls_diagnostic_t diag = {
+		.severity = BIO_LSP_DIAGNOSTIC_INFORMATION,
+		.source = "buxn-chess",
+		.entry = ctx->entry_node,
+	};
+	if (routine->label != NULL) {
+		diag.location = (bio_lsp_location_t){
+			.uri = routine->label->source->uri,
+			.range = routine->label->range,
+		};
+		diag.message = buxn_ls_arena_fmt(
+			&result->arena,
+			"[%d] Trace of %.*s was truncated: %s",
+			ctx->stack_check->current_root,
+			(int)routine->label->name.len, routine->label->name.chars,
+			reason
+		).chars;
+	} else {
+		diag.location.uri = ctx->entry_node->uri;
+		diag.message = buxn_ls_arena_fmt(
+			&result->arena,
+			"[%d] Trace was truncated: %s",
+			ctx->stack_check->current_root,
+			reason
+		).chars;
+	}
+	barray_push(result->diagnostics, diag, NULL);
+}
+
+// Enforce the step budget of a routine and the time budget of its entry.
+// Returns false when the trace should be cut short.
+static bool
+buxn_ls_spend_chess_step(buxn_asm_ctx_t* ctx, buxn_ls_routine_trace_t* routine) {
+	buxn_ls_analyzer_t* analyzer = ctx->analyzer;
+	buxn_ls_stack_check_t* check = ctx->stack_check;
+
+	routine->num_steps += 1;
+	if (
+		analyzer->chess_step_budget > 0
+		&& routine->num_steps > analyzer->chess_step_budget
+	) {
+		buxn_ls_truncate_routine(
+			ctx, routine,
+			buxn_ls_arena_fmt(
+				&ctx->result->arena,
+				"ran out of steps (%d)", analyzer->chess_step_budget
+			).chars
+		);
+		return false;
+	}
+
+	if (analyzer->chess_time_budget > 0 && --check->steps_until_clock <= 0) {
+		check->steps_until_clock = BUXN_LS_CHESS_CLOCK_INTERVAL;
+		if (bio_current_time_ms() >= check->deadline) {
+			check->is_out_of_time = true;
+			buxn_ls_truncate_routine(
+				ctx, routine,
+				buxn_ls_arena_fmt(
+					&ctx->result->arena,
+					"ran out of time (%dms), the remaining routines are not checked",
+					analyzer->chess_time_budget
+				).chars
+			);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 uint8_t
 buxn_chess_get_rom(buxn_asm_ctx_t* ctx, uint16_t address) {
-	return ctx->rom[address - 256];
+	// BRK ends every trace quickly
+	if (ctx->is_cancelled) { return 0x00; }
+
+	buxn_ls_stack_check_t* check = ctx->stack_check;
+	bhash_index_t routine_index = bhash_find(&check->routines, check->current_root);
+	if (bhash_is_valid(routine_index)) {
+		buxn_ls_routine_trace_t* routine = &check->routines.values[routine_index];
+		if (!routine->is_identified) {
+			routine->is_identified = true;
+			buxn_ls_identify_routine(ctx, routine, address);
+			if (check->is_interleaved) { routine->is_cacheable = false; }
+			if (routine->is_cacheable) {
+				buxn_ls_chess_cache_t* cache = &ctx->analyzer->chess_cache;
+				if (bhash_is_valid(bhash_find(&cache->routines, routine->key))) {
+					// Its diagnostics are replayed when the trace ends
+					routine->is_cached = true;
+					cache->num_hits += 1;
+				} else {
+					cache->num_misses += 1;
+				}
+			}
+		}
+
+		if (routine->is_cached || routine->is_truncated) { return 0x00; }
+		if (!buxn_ls_spend_chess_step(ctx, routine)) { return 0x00; }
+	}
+
+	const buxn_ls_chess_input_t* input = ctx->chess_input;
+	size_t offset = address - 256;
+	return offset < input->rom_size ? input->rom[offset] : 0x00;
 }
 
 void
@@ -807,11 +2721,15 @@ buxn_chess_report(
 	buxn_chess_report_type_t type,
 	const buxn_asm_report_t* report
 ) {
-	buxn_ls_analyzer_t* analyzer = ctx->analyzer;
+	buxn_ls_analyzer_ctx_t* result = ctx->result;
 
 	// Only save reports about source regions, not top level reports
 	if (report->region->range.start.line == 0) { return; }
 
+	// A cached or truncated routine is cut short so its reports are meaningless
+	buxn_ls_routine_trace_t* routine = buxn_ls_find_routine_trace(ctx, trace_id);
+	if (routine != NULL && (routine->is_cached || routine->is_truncated)) { return; }
+
 	buxn_ls_diagnostic_t diag = { 0 };
 
 	switch (type) {
@@ -826,30 +2744,31 @@ buxn_chess_report(
 	}
 
 	if (type == BUXN_CHESS_REPORT_ERROR) {
-		bhash_index_t file_index = bhash_find(&analyzer->files, report->region->filename);
-		if (bhash_is_valid(file_index)) {
-			buxn_ls_file_t* file = &analyzer->files.values[file_index];
+		buxn_ls_file_t* file = buxn_ls_find_file(&ctx->worker->files, report->region->filename);
+		if (file != NULL) {
 			file->has_error = true;
 		}
 	}
 
 	if (trace_id != BUXN_CHESS_NO_TRACE) {
 		diag = (buxn_ls_diagnostic_t){
-			.location = buxn_ls_convert_region(ctx->analyzer, *report->region),
+			.location = buxn_ls_convert_region(ctx, *report->region),
 			.message = buxn_ls_arena_fmt(
-				&ctx->analyzer->current_ctx->arena,
+				&result->arena,
 				"[%d] %s", trace_id, report->message
 			).chars,
 			.source = "buxn-chess",
+			.entry = ctx->entry_node,
 		};
 	} else {
 		diag = (buxn_ls_diagnostic_t){
-			.location = buxn_ls_convert_region(ctx->analyzer, *report->region),
+			.location = buxn_ls_convert_region(ctx, *report->region),
 			.message = buxn_ls_arena_strcpy(
-				&ctx->analyzer->current_ctx->arena,
+				&result->arena,
 				report->message
 			),
 			.source = "buxn-chess",
+			.entry = ctx->entry_node,
 		};
 	}
 
@@ -857,11 +2776,14 @@ buxn_chess_report(
 		report->related_message != NULL
 		&& report->related_region->filename == report->region->filename
 	) {
-		diag.related_location = buxn_ls_convert_region(ctx->analyzer, *report->region);
-		diag.related_message = buxn_ls_arena_strcpy(&ctx->analyzer->current_ctx->arena, report->related_message);
+		diag.related_location = buxn_ls_convert_region(ctx, *report->region);
+		diag.related_message = buxn_ls_arena_strcpy(&result->arena, report->related_message);
 	}
 
-	barray_push(analyzer->diagnostics, diag, NULL);
+	if (routine != NULL) {
+		buxn_ls_remember_chess_diag(routine, &diag);
+	}
+	barray_push(result->diagnostics, diag, NULL);
 }
 
 void
@@ -873,6 +2795,10 @@ buxn_chess_deo(
 	uint8_t port
 ) {
 	if (port == 0x0e && value == 0x2b) {
+		buxn_ls_routine_trace_t* routine = buxn_ls_find_routine_trace(ctx, trace_id);
+		if (routine != NULL && (routine->is_cached || routine->is_truncated)) { return; }
+
+		buxn_ls_analyzer_ctx_t* result = ctx->result;
 		void* mem_region = buxn_chess_begin_mem_region(ctx);
 
 		buxn_chess_str_t wst_str = buxn_chess_format_stack(
@@ -884,17 +2810,21 @@ buxn_chess_deo(
 
 		buxn_ls_diagnostic_t diag = {
 			.severity = BIO_LSP_DIAGNOSTIC_INFORMATION,
-			.location = buxn_ls_convert_region(ctx->analyzer, state->src_region),
+			.location = buxn_ls_convert_region(ctx, state->src_region),
 			.message = buxn_ls_arena_fmt(
-				&ctx->analyzer->current_ctx->arena,
+				&result->arena,
 				"[%d] Stack:\nWST(%d):%.*s\nRST(%d):%.*s",
 				trace_id,
 				state->wst.size, wst_str.len, wst_str.chars,
 				state->rst.size, rst_str.len, rst_str.chars
 			).chars,
 			.source = "buxn-chess",
+			.entry = ctx->entry_node,
 		};
-		barray_push(ctx->analyzer->diagnostics, diag, NULL);
+		if (routine != NULL) {
+			buxn_ls_remember_chess_diag(routine, &diag);
+		}
+		barray_push(result->diagnostics, diag, NULL);
 
 		buxn_chess_end_mem_region(ctx, mem_region);
 	}
@@ -906,9 +2836,30 @@ buxn_chess_begin_trace(
 	buxn_chess_id_t trace_id,
 	buxn_chess_id_t parent_id
 ) {
-	(void)ctx;
-	(void)trace_id;
-	(void)parent_id;
+	buxn_ls_stack_check_t* check = ctx->stack_check;
+	if (parent_id == BUXN_CHESS_NO_TRACE) {
+		// Another root is still being traced
+		if (check->num_live_traces > 0) {
+			check->is_interleaved = true;
+		}
+
+		bhash_put(&check->trace_roots, trace_id, trace_id);
+		bhash_index_t routine_index = bhash_put(
+			&check->routines, trace_id, (buxn_ls_routine_trace_t){ 0 }
+		);
+		check->current_root = trace_id;
+		// Once the time is up, every routine is skipped
+		check->routines.values[routine_index].is_truncated = check->is_out_of_time;
+	} else {
+		bhash_index_t parent_index = bhash_find(&check->trace_roots, parent_id);
+		if (bhash_is_valid(parent_index)) {
+			bhash_put(&check->trace_roots, trace_id, check->trace_roots.values[parent_index]);
+		}
+	}
+
+	++check->num_live_traces;
+
+	buxn_ls_yield_point(ctx, BUXN_LS_YIELD_INTERVAL / 64);
 }
 
 extern void
@@ -917,7 +2868,30 @@ buxn_chess_end_trace(
 	buxn_chess_id_t trace_id,
 	bool success
 ) {
-	(void)ctx;
-	(void)trace_id;
 	(void)success;
+
+	buxn_ls_stack_check_t* check = ctx->stack_check;
+	--check->num_live_traces;
+	bhash_index_t routine_index = bhash_find(&check->routines, trace_id);
+	if (!bhash_is_valid(routine_index)) { return; }  // Not a root trace
+
+	buxn_ls_routine_trace_t* routine = &check->routines.values[routine_index];
+	buxn_ls_chess_cache_t* cache = &ctx->analyzer->chess_cache;
+	if (routine->is_cached) {
+		bhash_index_t cache_index = bhash_find(&cache->routines, routine->key);
+		buxn_ls_chess_cache_entry_t* entry = &cache->routines.values[cache_index];
+		entry->last_used = cache->num_passes;
+		buxn_ls_replay_chess_diags(ctx, routine, entry);
+	} else if (routine->is_cacheable && !check->is_interleaved && !ctx->is_cancelled) {
+		// The same routine can be traced again from another entry
+		bhash_alloc_result_t alloc_result = bhash_alloc(&cache->routines, routine->key);
+		if (alloc_result.is_new) {
+			cache->routines.keys[alloc_result.index] = routine->key;
+			cache->routines.values[alloc_result.index] = (buxn_ls_chess_cache_entry_t){
+				.diags = routine->diags,
+				.last_used = cache->num_passes,
+			};
+			routine->diags = NULL;
+		}
+	}
 }
@@ -10,6 +10,7 @@
 #include "graph.h"
 
 struct buxn_ls_workspace_s;
+struct buxn_ls_doc_s;
 
 typedef enum {
 	BIO_LSP_DIAGNOSTIC_ERROR = 1,
@@ -25,6 +26,15 @@ typedef enum {
 	BUXN_LS_SYMBOL_AS_ENUM,
 } buxn_ls_symbol_semantics_t;
 
+typedef struct buxn_ls_src_node_s buxn_ls_src_node_t;
+typedef struct buxn_ls_sym_node_s buxn_ls_sym_node_t;
+
+// Symbols of a file sorted by their start position
+typedef struct {
+	buxn_ls_sym_node_t** syms;
+	int len;
+} buxn_ls_sym_index_t;
+
 typedef struct {
 	bio_lsp_location_t location;
 	bio_lsp_location_t related_location;
@@ -33,10 +43,9 @@ typedef struct {
 	const char* source;
 	const char* message;
 	const char* related_message;
-} buxn_ls_diagnostic_t;
 
-typedef struct buxn_ls_src_node_s buxn_ls_src_node_t;
-typedef struct buxn_ls_sym_node_s buxn_ls_sym_node_t;
+	const buxn_ls_src_node_t* entry;  // The entry file which produced this
+} buxn_ls_diagnostic_t;
 
 struct buxn_ls_sym_node_s {
 	buxn_ls_sym_node_t* next;
@@ -45,11 +54,13 @@ struct buxn_ls_sym_node_s {
 	buxn_ls_str_t documentation;
 	buxn_ls_str_t signature;
 	buxn_ls_src_node_t* source;
+	buxn_ls_src_node_t* entry;  // The entry file whose assembly produced this
 	buxn_asm_sym_type_t type;
 	buxn_ls_symbol_semantics_t semantics;
 	int byte_offset;
 	bio_lsp_range_t range;
 	uint16_t address;
+	uint64_t name_mask;  // See buxn_ls_fuzzy_mask
 
 	buxn_ls_node_base_t base;
 };
@@ -59,7 +70,19 @@ struct buxn_ls_src_node_s {
 	const char* uri;
 	buxn_ls_sym_node_t* references;
 	buxn_ls_sym_node_t* definitions;
+	// See buxn_ls_sort_symbols
+	buxn_ls_sym_index_t reference_index;
+	buxn_ls_sym_index_t definition_index;
+	buxn_ls_sym_index_t label_index;  // Only the labels among the definitions
+	bhash_hash_t content_hash;
 	bool analyzed;
+	bool is_entry;
+	bool is_checked;  // Stack checking of this entry is done
+
+	// Traversal stamps, see buxn_ls_analyzer_next_epoch
+	unsigned int climb_epoch;
+	unsigned int visit_epoch;
+	unsigned int schedule_epoch;  // A pending job is expected to open this
 
 	buxn_ls_node_base_t base;
 };
@@ -69,36 +92,120 @@ struct buxn_asm_file_s {
 	size_t offset;
 };
 
-typedef struct {
+typedef struct buxn_ls_analyzer_ctx_s {
 	barena_t arena;
 	BHASH_TABLE(const char*, buxn_ls_src_node_t*) sources;
+	barray(buxn_ls_diagnostic_t) diagnostics;
+	// Definitions of all files sorted by name, see buxn_ls_sort_symbols
+	buxn_ls_sym_index_t name_index;
+	// Changed whenever the indices are rebuilt or the context is reset
+	unsigned int generation;
+	// Documents whose content is referenced by this context
+	barray(struct buxn_ls_doc_s*) docs;
 } buxn_ls_analyzer_ctx_t;
 
+typedef struct buxn_ls_analysis_cache_entry_s buxn_ls_analysis_cache_entry_t;
+
+typedef struct {
+	// Most recently used first
+	buxn_ls_analysis_cache_entry_t* first;
+	buxn_ls_analysis_cache_entry_t* last;
+	size_t size;
+	size_t budget;
+	int num_hits;
+	int num_misses;
+} buxn_ls_analysis_cache_t;
+
+// A buxn-chess diagnostic about a single routine.
+// Lines are relative to the routine's label since only the routine's own
+// source is part of its cache key.
+typedef struct {
+	bio_lsp_range_t range;
+	bio_lsp_range_t related_range;
+	bio_lsp_diagnostic_severity_t severity;
+	char* message;
+	char* related_message;
+} buxn_ls_chess_cached_diag_t;
+
+typedef struct {
+	barray(buxn_ls_chess_cached_diag_t) diags;
+	unsigned int last_used;  // The stack checking pass which last used this
+} buxn_ls_chess_cache_entry_t;
+
+typedef struct {
+	// Keyed by a routine's code, source, signature and its callees' signatures
+	BHASH_TABLE(bhash_hash_t, buxn_ls_chess_cache_entry_t) routines;
+	unsigned int num_passes;
+	int num_hits;
+	int num_misses;
+} buxn_ls_chess_cache_t;
+
 typedef struct {
 	buxn_ls_str_t content;
+	bhash_hash_t content_hash;
 	buxn_ls_symbol_semantics_t zero_page_semantics;
 
 	int first_line_index;
 	int num_lines;
 	int last_symbol_byte;
 	bool has_error;
+	bool is_ascii;  // Byte offsets are also UTF-16 offsets
 } buxn_ls_file_t;
 
+typedef BHASH_TABLE(const char*, buxn_ls_file_t) buxn_ls_file_map_t;
+
+// Scratch space for assembling one entry at a time.
+// Each worker has its own so that entries can be assembled concurrently.
+typedef struct {
+	buxn_ls_file_map_t files;
+	barray(buxn_ls_str_t) lines;
+
+	barray(buxn_ls_sym_node_t*) macro_defs;
+	BHASH_TABLE(uint16_t, buxn_ls_sym_node_t*) label_defs;
+	barray(buxn_asm_sym_t) references;
+
+	barena_pool_t arena_pool;
+} buxn_ls_analysis_worker_t;
+
+typedef struct buxn_ls_analysis_job_s buxn_ls_analysis_job_t;
+typedef struct buxn_ls_chess_input_s buxn_ls_chess_input_t;
+
 typedef struct buxn_ls_analyzer_s {
 	buxn_ls_analyzer_ctx_t ctx_a;
 	buxn_ls_analyzer_ctx_t ctx_b;
 	buxn_ls_analyzer_ctx_t* current_ctx;
 	buxn_ls_analyzer_ctx_t* previous_ctx;
+	// The last complete analysis.
+	// Requests are served from this while an analysis is in progress.
+	buxn_ls_analyzer_ctx_t* snapshot;
+	bool should_cancel;
 
-	barray(buxn_ls_diagnostic_t) diagnostics;
-	BHASH_TABLE(const char*, buxn_ls_file_t) files;
+	buxn_ls_analysis_cache_t cache;
+
+	buxn_ls_file_map_t files;
 	barray(buxn_ls_str_t) lines;
 	barray(buxn_ls_src_node_t*) analyze_queue;
 
-	barray(buxn_ls_sym_node_t*) macro_defs;
-	BHASH_TABLE(uint16_t, buxn_ls_sym_node_t*) label_defs;
-	barray(buxn_asm_sym_t) references;
+	// Entries which are analyzed together before their results are merged
+	barray(buxn_ls_analysis_job_t) jobs;
+	barray(buxn_ls_src_node_t*) deferred_nodes;
+	buxn_ls_analysis_worker_t* workers;
+	int num_workers;  // Can be changed until the first analysis
+
+	// Assembled entries waiting for buxn_ls_check_stack
+	barray(buxn_ls_chess_input_t*) chess_queue;
+	buxn_ls_chess_cache_t chess_cache;
+	// Limits on buxn-chess, 0 means unlimited
+	int chess_step_budget;  // ROM reads per routine
+	int chess_time_budget;  // Milliseconds per entry
+
+	// Negotiated with the client, can be changed until the first analysis
+	bio_lsp_position_encoding_t position_encoding;
 
+	BHASH_TABLE(const buxn_ls_sym_node_t*, buxn_ls_sym_node_t*) sym_map;
+
+	unsigned int epoch;
+	unsigned int batch_epoch;
 	barena_pool_t* arena_pool;
 } buxn_ls_analyzer_t;
 
@@ -108,10 +215,73 @@ buxn_ls_analyzer_init(buxn_ls_analyzer_t* analyzer, barena_pool_t* pool);
 void
 buxn_ls_analyzer_cleanup(buxn_ls_analyzer_t* analyzer);
 
-void
+// Periodically yields to other coroutines.
+// Returns false if it was cancelled through should_cancel.
+bool
 buxn_ls_analyze(buxn_ls_analyzer_t* analyzer, struct buxn_ls_workspace_s* workspace);
 
+typedef void (*buxn_ls_progress_fn_t)(void* userdata, int num_done, int num_total);
+
+// Add the workspace entries which are not part of the last analysis.
+// Results are added to the snapshot as they are merged.
+// Returns false if it was cancelled through should_cancel.
+bool
+buxn_ls_index(
+	buxn_ls_analyzer_t* analyzer,
+	struct buxn_ls_workspace_s* workspace,
+	buxn_ls_progress_fn_t progress_fn,
+	void* progress_userdata
+);
+
+// Run buxn-chess on entries assembled by the last analysis.
+// Its diagnostics are added to the snapshot.
+// Returns false if it was cancelled through should_cancel.
+bool
+buxn_ls_check_stack(buxn_ls_analyzer_t* analyzer, struct buxn_ls_workspace_s* workspace);
+
+buxn_ls_src_node_t*
+buxn_ls_find_or_alloc_node(
+	buxn_ls_analyzer_ctx_t* ctx,
+	struct buxn_ls_workspace_s* workspace,
+	const char* filename
+);
+
+// Build the position indices of every file.
+// Done at the end of an analysis so that lookups don't walk the symbol lists.
+void
+buxn_ls_sort_symbols(buxn_ls_analyzer_ctx_t* ctx);
+
+// Find the symbol whose range contains a position
+buxn_ls_sym_node_t*
+buxn_ls_find_symbol_at(const buxn_ls_sym_index_t* index, bio_lsp_position_t position);
+
+static inline int
+buxn_ls_count_references(const buxn_ls_sym_node_t* def) {
+	int count = 0;
+	for (const buxn_ls_edge_t* edge = def->base.in_edges; edge != NULL; edge = edge->next_in) {
+		++count;
+	}
+	return count;
+}
+
+// Find the last symbol starting before a position
+buxn_ls_sym_node_t*
+buxn_ls_find_symbol_before(const buxn_ls_sym_index_t* index, bio_lsp_position_t position);
+
+// Find the symbols whose name starts with a prefix in a name index
+buxn_ls_sym_index_t
+buxn_ls_find_symbols_with_prefix(const buxn_ls_sym_index_t* index, buxn_ls_str_t prefix);
+
 buxn_ls_line_slice_t
 buxn_ls_analyzer_split_file(buxn_ls_analyzer_t* analyzer, const char* filename);
 
+// Start a new graph traversal.
+// A node whose stamp equals the returned epoch was already visited in that
+// traversal so every node is processed at most once regardless of how many
+// include paths lead to it.
+static inline unsigned int
+buxn_ls_analyzer_next_epoch(buxn_ls_analyzer_t* analyzer) {
+	return ++analyzer->epoch;
+}
+
 #endif
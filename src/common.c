@@ -2,6 +2,14 @@
 #include <stdlib.h>
 #include <bio/logging/file.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BUXN_LS_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 typedef struct {
 	void* userdata;
 	bio_entry_fn_t entry;
@@ -63,39 +71,62 @@ bio_enter(bio_entry_fn_t entry, void* userdata) {
 	return entry_data.exit_code;
 }
 
+size_t
+buxn_ls_find_line_end(const char* chars, size_t start, size_t len) {
+#ifdef BUXN_LS_SSE2
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	for (; start + 16 <= len; start += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(chars + start));
+		__m128i is_eol = _mm_or_si128(_mm_cmpeq_epi8(block, lf), _mm_cmpeq_epi8(block, cr));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(is_eol);
+		if (mask != 0) {
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return start + index;
+#else
+			return start + (size_t)__builtin_ctz(mask);
+#endif
+		}
+	}
+#endif
+	while (start < len && chars[start] != '\n' && chars[start] != '\r') { ++start; }
+	return start;
+}
+
 buxn_ls_line_slice_t
 buxn_ls_split_file(buxn_ls_str_t content, barray(buxn_ls_str_t)* lines) {
-	buxn_ls_str_t line = { .chars = content.chars, };
 	int first_line_index = (int)barray_len(*lines);
 	int num_lines = 0;
 	size_t start_index = 0;
-	for (size_t char_index = 0; char_index < content.len; ++char_index) {
-		char ch = content.chars[char_index];
-		if (ch == '\n') {
-			line.len = char_index - start_index;
-			barray_push(*lines, line, NULL);
-			++num_lines;
-			line.chars = content.chars + char_index + 1;
-			start_index = char_index + 1;
-		} else if (ch == '\r') {
-			if (char_index < content.len - 1 && content.chars[char_index + 1] == '\n') {
-				line.len = char_index - start_index;
-				barray_push(*lines, line, NULL);
-				++num_lines;
-				line.chars = content.chars + char_index + 2;
-				start_index = char_index + 2;
-			} else {
-				line.len = char_index - start_index;
-				barray_push(*lines, line, NULL);
-				++num_lines;
-				line.chars = content.chars + char_index + 1;
-				start_index = char_index + 1;
-			}
+	while (true) {
+		size_t end_index = buxn_ls_find_line_end(content.chars, start_index, content.len);
+		if (end_index >= content.len) { break; }
+
+		buxn_ls_str_t line = {
+			.chars = content.chars + start_index,
+			.len = end_index - start_index,
+		};
+		barray_push(*lines, line, NULL);
+		++num_lines;
+
+		if (
+			content.chars[end_index] == '\r'
+			&& end_index < content.len - 1
+			&& content.chars[end_index + 1] == '\n'
+		) {
+			start_index = end_index + 2;
+		} else {
+			start_index = end_index + 1;
 		}
 	}
 	// Last line
 	if (start_index < content.len) {
-		line.len = content.len - start_index;
+		buxn_ls_str_t line = {
+			.chars = content.chars + start_index,
+			.len = content.len - start_index,
+		};
 		barray_push(*lines, line, NULL);
 		++num_lines;
 	}
@@ -105,3 +136,67 @@ buxn_ls_split_file(buxn_ls_str_t content, barray(buxn_ls_str_t)* lines) {
 		.num_lines = num_lines,
 	};
 }
+
+static inline char
+buxn_ls_fold_case(char ch) {
+	return ('A' <= ch && ch <= 'Z') ? (char)(ch | 0x20) : ch;
+}
+
+uint64_t
+buxn_ls_fuzzy_mask(buxn_ls_str_t str) {
+	uint64_t mask = 0;
+	for (size_t i = 0; i < str.len; ++i) {
+		mask |= (uint64_t)1 << (buxn_ls_fold_case(str.chars[i]) & 63);
+	}
+	return mask;
+}
+
+int
+buxn_ls_fuzzy_score(buxn_ls_str_t pattern, buxn_ls_str_t name) {
+	bool case_sensitive = false;
+	for (size_t i = 0; i < pattern.len; ++i) {
+		char ch = pattern.chars[i];
+		if ('A' <= ch && ch <= 'Z') {
+			case_sensitive = true;
+			break;
+		}
+	}
+
+	// Greedily match each character at its first occurrence.
+	// Matches at the start of a word or right after the previous match are
+	// preferred.
+	int score = 0;
+	size_t name_index = 0;
+	size_t last_match = 0;
+	for (size_t i = 0; i < pattern.len; ++i) {
+		char pattern_ch = case_sensitive ? pattern.chars[i] : buxn_ls_fold_case(pattern.chars[i]);
+		for (; name_index < name.len; ++name_index) {
+			char name_ch = case_sensitive ? name.chars[name_index] : buxn_ls_fold_case(name.chars[name_index]);
+			if (name_ch == pattern_ch) { break; }
+		}
+		if (name_index == name.len) { return -1; }
+
+		score += 1;
+		if (name_index == 0) {
+			score += 8;
+		} else {
+			char prev_ch = name.chars[name_index - 1];
+			if (prev_ch == '/' || prev_ch == '-' || prev_ch == '_' || prev_ch == '.') {
+				score += 6;
+			}
+		}
+		if (i > 0) {
+			if (name_index == last_match + 1) {
+				score += 5;
+			} else {
+				score -= (int)(name_index - last_match - 1);
+			}
+		}
+
+		last_match = name_index++;
+	}
+
+	// Prefer shorter names among equally good matches
+	if (score < 0) { score = 0; }
+	return score * 256 + (name.len < 256 ? (int)(255 - name.len) : 0);
+}
@@ -159,7 +159,24 @@ buxn_ls_serialize_lsp_range(
 	buxn_ls_serialize_lsp_position(doc, yyjson_mut_obj_add_obj(doc, json, "end"), &range->end);
 }
 
+// Index of the first '\r' or '\n' from start, len if there is none.
+// '\r', '\n' and "\r\n" each end a line.
+size_t
+buxn_ls_find_line_end(const char* chars, size_t start, size_t len);
+
 buxn_ls_line_slice_t
 buxn_ls_split_file(buxn_ls_str_t content, barray(buxn_ls_str_t)* lines);
 
+// A pattern fuzzily matches a name if its characters appear in the name in
+// order.
+// Matching is case sensitive only if the pattern has an uppercase letter.
+
+// The set of characters in a string, used to reject names before scoring
+uint64_t
+buxn_ls_fuzzy_mask(buxn_ls_str_t str);
+
+// Higher is better, negative if the pattern does not match
+int
+buxn_ls_fuzzy_score(buxn_ls_str_t pattern, buxn_ls_str_t name);
+
 #endif
@@ -4,6 +4,7 @@
 #include <bmacro.h>
 #include <yyjson.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 #define BUXN_LS_MATCH(X) \
 	X(BUXN_LS_MATCH_ANY_SYMBOL) \
@@ -14,32 +15,28 @@
 	X(BUXN_LS_MATCH_PRECEDING_LABEL)
 BENUM(buxn_ls_sym_match_type, BUXN_LS_MATCH)
 
+// The client asks again as the prefix grows if a list is incomplete
+static const int BUXN_LS_COMPLETION_MAX_ITEMS = 100;
+static const size_t BUXN_LS_COMPLETION_MAX_RECENT_NAMES = 32;
+
 #define BUXN_LS_FORMAT(X) \
 	X(BUXN_LS_FORMAT_FULL_NAME) \
 	X(BUXN_LS_FORMAT_LOCAL_NAME)
 BENUM(buxn_ls_sym_format_type, BUXN_LS_FORMAT)
 
 typedef struct {
-	bool labels_only;
-	bool preceding_labels;
-	bool subroutine_only;
-	bio_lsp_position_t prefix_pos;
-	uint16_t addr_min;
-	uint16_t addr_max;
-	buxn_ls_str_t prefix;
-} buxn_ls_sym_filter_t;
-
-typedef struct {
-	buxn_ls_sym_filter_t filter;
 	buxn_ls_str_t current_scope;
 	buxn_ls_completion_map_t* completion_map;
 	bool group_symbols;
-} buxn_ls_sym_visit_ctx_t;
+} buxn_ls_candidate_ctx_t;
 
 struct buxn_ls_completion_item_s {
 	const struct buxn_ls_sym_node_s* sym;
 	int size;  //  For collapsed item
 	bool is_local;
+	int score;  // Best fuzzy match score in the group
+	int num_references;
+	int recency;  // See buxn_ls_completion_recency
 };
 
 static inline buxn_ls_str_t
@@ -68,6 +65,32 @@ buxn_ls_is_subroutine(const buxn_ls_sym_node_t* def) {
 	}
 }
 
+// The prefix has to match exactly, the pattern after it is matched fuzzily
+static int
+buxn_ls_score_name(
+	const buxn_ls_sym_node_t* def,
+	const buxn_ls_sym_filter_t* filter
+) {
+	if (
+		def->name.len < filter->prefix.len
+		|| (
+			filter->prefix.len > 0
+			&& memcmp(def->name.chars, filter->prefix.chars, filter->prefix.len) != 0
+		)
+	) {
+		return -1;
+	}
+
+	if (filter->pattern.len == 0) { return 0; }
+	if ((filter->pattern_mask & ~def->name_mask) != 0) { return -1; }
+
+	buxn_ls_str_t rest = {
+		.chars = def->name.chars + filter->prefix.len,
+		.len = def->name.len - filter->prefix.len,
+	};
+	return buxn_ls_fuzzy_score(filter->pattern, rest);
+}
+
 static bool
 buxn_ls_match_symbol(
 	const buxn_ls_sym_node_t* def,
@@ -99,8 +122,38 @@ buxn_ls_match_symbol(
 		}
 	}
 
-	return def->name.len >= filter->prefix.len
-		&& memcmp(def->name.chars, filter->prefix.chars, filter->prefix.len) == 0;
+	return buxn_ls_score_name(def, filter) >= 0;
+}
+
+// Items are ranked by the server so the client only has to keep the order
+static void
+buxn_ls_add_sort_text(
+	const buxn_ls_completion_ctx_t* ctx,
+	yyjson_mut_doc* doc,
+	yyjson_mut_val* item_obj,
+	int rank
+) {
+	// Ranks are capped by BUXN_LS_COMPLETION_MAX_ITEMS so 4 digits are enough
+	// and the key can be written without going through printf
+	enum { NUM_DIGITS = 4 };
+	char* sort_key = barena_memalign(ctx->arena, NUM_DIGITS, _Alignof(char));
+	for (int i = NUM_DIGITS - 1; i >= 0; --i) {
+		sort_key[i] = (char)('0' + rank % 10);
+		rank /= 10;
+	}
+	yyjson_mut_obj_add_strn(doc, item_obj, "sortText", sort_key, NUM_DIGITS);
+}
+
+// Identify the symbol of an item for buxn_ls_resolve_completion_item
+static void
+buxn_ls_add_resolve_data(
+	yyjson_mut_doc* doc,
+	yyjson_mut_val* item_obj,
+	const buxn_ls_sym_node_t* sym
+) {
+	yyjson_mut_val* data = yyjson_mut_obj_add_obj(doc, item_obj, "data");
+	yyjson_mut_obj_add_str(doc, data, "file", sym->source->filename);
+	yyjson_mut_obj_add_strn(doc, data, "name", sym->name.chars, sym->name.len);
 }
 
 static void
@@ -110,7 +163,8 @@ buxn_ls_serialize_completion_item_as_symbol(
 	yyjson_mut_val* item_obj,
 	const buxn_ls_completion_item_t* item,
 	buxn_ls_str_t label,
-	bio_lsp_range_t edit_range
+	bio_lsp_range_t edit_range,
+	int rank
 ) {
 	const buxn_ls_sym_node_t* sym = item->sym;
 	BIO_DEBUG(
@@ -141,30 +195,6 @@ buxn_ls_serialize_completion_item_as_symbol(
 	}
 	yyjson_mut_obj_add_int(doc, item_obj, "kind", kind);
 
-	if (sym->semantics == BUXN_LS_SYMBOL_AS_SUBROUTINE) {
-		if (sym->signature.len > 0) {
-			buxn_ls_str_t detail = buxn_ls_arena_fmt(
-				ctx->arena, "( %.*s )",
-				(int)sym->signature.len, sym->signature.chars
-			);
-			yyjson_mut_obj_add_strn(doc, item_obj, "detail", detail.chars, detail.len);
-		}
-	} else if (sym->address <= 0x00ff) {  // Zero page
-		buxn_ls_str_t detail = buxn_ls_arena_fmt(ctx->arena, "|0x%02x", sym->address);
-		yyjson_mut_obj_add_strn(doc, item_obj, "detail", detail.chars, detail.len);
-	} else {
-		buxn_ls_str_t detail = buxn_ls_arena_fmt(ctx->arena, "|0x%04x", sym->address);
-		yyjson_mut_obj_add_strn(doc, item_obj, "detail", detail.chars, detail.len);
-	}
-
-	if (sym->documentation.len > 0) {
-		yyjson_mut_obj_add_strn(
-			doc, item_obj,
-			"documentation",
-			sym->documentation.chars, sym->documentation.len
-		);
-	}
-
 	yyjson_mut_val* text_edit = yyjson_mut_obj_add_obj(doc, item_obj, "textEdit");
 	{
 		yyjson_mut_obj_add_strn(doc, text_edit, "newText", label.chars, label.len);
@@ -175,75 +205,71 @@ buxn_ls_serialize_completion_item_as_symbol(
 		);
 	}
 
-	// Sort key: <is_remote>:<address>:<name>
-	buxn_ls_str_t sort_key = buxn_ls_arena_fmt(
-		ctx->arena,
-		"%s:%04x:%.*s",
-		item->is_local ? "0" : "1",
-		sym->address,
-		(int)sym->name.len, sym->name.chars
-	);
-	yyjson_mut_obj_add_strn(doc, item_obj, "sortText", sort_key.chars, sort_key.len);
+	buxn_ls_add_sort_text(ctx, doc, item_obj, rank);
+	buxn_ls_add_resolve_data(doc, item_obj, sym);
 }
 
 static void
-buxn_ls_visit_symbols(
-	const buxn_ls_sym_visit_ctx_t* ctx,
-	const buxn_ls_src_node_t* src_node
+buxn_ls_add_candidate(
+	const buxn_ls_candidate_ctx_t* ctx,
+	const buxn_ls_sym_node_t* def,
+	int score
 ) {
-	for (
-		const buxn_ls_sym_node_t* def = src_node->definitions;
-		def != NULL;
-		def = def->next
-	) {
-		if (buxn_ls_match_symbol(def, &ctx->filter)) {
-			buxn_ls_str_t scope = buxn_ls_label_scope(def->name);
-			bool is_local = buxn_ls_cstr_eq(&scope, &ctx->current_scope, 0);
-
-			if (ctx->group_symbols) {
-				buxn_ls_str_t key = is_local ? def->name : scope;
-				bhash_alloc_result_t alloc_result = bhash_alloc(ctx->completion_map, key);
-				if (alloc_result.is_new) {
-					ctx->completion_map->keys[alloc_result.index] = key;
-					ctx->completion_map->values[alloc_result.index] = (buxn_ls_completion_item_t){
-						.sym = def,
-						.size = 1,
-						.is_local = is_local,
-					};
-				} else {
-					buxn_ls_completion_item_t* item = &ctx->completion_map->values[alloc_result.index];
-					item->size += 1;
-					if (buxn_ls_cstr_eq(&def->name, &scope, 0)) {
-						// Represent the group by the root label if possible
-						item->sym = def;
-					}
-				}
-			} else {
-				buxn_ls_str_t key = def->name;
-				buxn_ls_completion_item_t value = {
-					.sym = def,
-					.size = 1,
-					.is_local = is_local,
-				};
-				bhash_put(ctx->completion_map, key, value);
+	buxn_ls_str_t scope = buxn_ls_label_scope(def->name);
+	bool is_local = buxn_ls_cstr_eq(&scope, &ctx->current_scope, 0);
+
+	if (ctx->group_symbols) {
+		buxn_ls_str_t key = is_local ? def->name : scope;
+		bhash_alloc_result_t alloc_result = bhash_alloc(ctx->completion_map, key);
+		if (alloc_result.is_new) {
+			ctx->completion_map->keys[alloc_result.index] = key;
+			ctx->completion_map->values[alloc_result.index] = (buxn_ls_completion_item_t){
+				.sym = def,
+				.size = 1,
+				.is_local = is_local,
+				.score = score,
+			};
+		} else {
+			buxn_ls_completion_item_t* item = &ctx->completion_map->values[alloc_result.index];
+			item->size += 1;
+			if (score > item->score) { item->score = score; }
+			if (buxn_ls_cstr_eq(&def->name, &scope, 0)) {
+				// Represent the group by the root label if possible
+				item->sym = def;
 			}
 		}
+	} else {
+		buxn_ls_str_t key = def->name;
+		buxn_ls_completion_item_t value = {
+			.sym = def,
+			.size = 1,
+			.is_local = is_local,
+			.score = score,
+		};
+		bhash_put(ctx->completion_map, key, value);
 	}
+}
+
+// Mark the files whose symbols are visible
+static void
+buxn_ls_visit_symbols(unsigned int epoch, buxn_ls_src_node_t* src_node) {
+	if (src_node->visit_epoch == epoch) { return; }
+	src_node->visit_epoch = epoch;
 
 	for (
 		const buxn_ls_edge_t* edge = src_node->base.out_edges;
 		edge != NULL;
 		edge = edge->next_out
 	) {
-		buxn_ls_visit_symbols(ctx, BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base));
+		buxn_ls_visit_symbols(epoch, BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base));
 	}
 }
 
 static void
-buxn_ls_visit_symbols_from_root(
-	const buxn_ls_sym_visit_ctx_t* ctx,
-	const buxn_ls_src_node_t* src_node
-) {
+buxn_ls_visit_symbols_from_root(unsigned int epoch, buxn_ls_src_node_t* src_node) {
+	if (src_node->climb_epoch == epoch) { return; }
+	src_node->climb_epoch = epoch;
+
 	// An included file can refer to symbols from the includer so we climb to
 	// the top of the include chain before descending
 	if (src_node->base.in_edges != NULL) {
@@ -253,13 +279,87 @@ buxn_ls_visit_symbols_from_root(
 			edge = edge->next_in
 		) {
 			buxn_ls_visit_symbols_from_root(
-				ctx,
+				epoch,
 				BCONTAINER_OF(edge->from, buxn_ls_src_node_t, base)
 			);
 		}
 	} else {
-		buxn_ls_visit_symbols(ctx, src_node);
+		buxn_ls_visit_symbols(epoch, src_node);
+	}
+}
+
+// Higher for a more recently resolved name, 0 if it was not resolved
+static int
+buxn_ls_completion_recency(const buxn_ls_completer_t* completer, buxn_ls_str_t name) {
+	size_t num_names = barray_len(completer->recent_names);
+	for (size_t i = num_names; i > 0; --i) {
+		const char* recent_name = completer->recent_names[i - 1];
+		if (strlen(recent_name) == name.len && memcmp(recent_name, name.chars, name.len) == 0) {
+			return (int)i;
+		}
+	}
+	return 0;
+}
+
+// The client resolves the item that the user highlights
+static void
+buxn_ls_add_recent_name(buxn_ls_completer_t* completer, buxn_ls_str_t name) {
+	size_t num_names = barray_len(completer->recent_names);
+	int recency = buxn_ls_completion_recency(completer, name);
+	size_t removed_index;
+	if (recency > 0) {
+		removed_index = (size_t)recency - 1;
+	} else if (num_names >= BUXN_LS_COMPLETION_MAX_RECENT_NAMES) {
+		removed_index = 0;
+	} else {
+		removed_index = num_names;
+	}
+
+	if (removed_index < num_names) {
+		buxn_ls_free(completer->recent_names[removed_index]);
+		memmove(
+			completer->recent_names + removed_index,
+			completer->recent_names + removed_index + 1,
+			sizeof(completer->recent_names[0]) * (num_names - removed_index - 1)
+		);
+		barray_resize(completer->recent_names, num_names - 1, NULL);
 	}
+
+	char* copy = buxn_ls_malloc(name.len + 1);
+	memcpy(copy, name.chars, name.len);
+	copy[name.len] = '\0';
+	barray_push(completer->recent_names, copy, NULL);
+}
+
+static int
+buxn_ls_cmp_completion_item(const void* lhs, const void* rhs) {
+	const buxn_ls_completion_item_t* lhs_item = *(const buxn_ls_completion_item_t* const*)lhs;
+	const buxn_ls_completion_item_t* rhs_item = *(const buxn_ls_completion_item_t* const*)rhs;
+
+	// Local symbols first, then the better matches, the recently resolved
+	// and the most referenced ones.
+	// Ties are broken by address and name.
+	if (lhs_item->is_local != rhs_item->is_local) {
+		return lhs_item->is_local ? -1 : 1;
+	}
+	if (lhs_item->score != rhs_item->score) {
+		return lhs_item->score > rhs_item->score ? -1 : 1;
+	}
+	if (lhs_item->recency != rhs_item->recency) {
+		return lhs_item->recency > rhs_item->recency ? -1 : 1;
+	}
+	if (lhs_item->num_references != rhs_item->num_references) {
+		return lhs_item->num_references > rhs_item->num_references ? -1 : 1;
+	}
+	if (lhs_item->sym->address != rhs_item->sym->address) {
+		return lhs_item->sym->address < rhs_item->sym->address ? -1 : 1;
+	}
+	buxn_ls_str_t lhs_name = lhs_item->sym->name;
+	buxn_ls_str_t rhs_name = rhs_item->sym->name;
+	size_t len = lhs_name.len < rhs_name.len ? lhs_name.len : rhs_name.len;
+	int cmp = len > 0 ? memcmp(lhs_name.chars, rhs_name.chars, len) : 0;
+	if (cmp != 0) { return cmp; }
+	return (lhs_name.len > rhs_name.len) - (lhs_name.len < rhs_name.len);
 }
 
 void
@@ -269,11 +369,107 @@ buxn_ls_completer_init(buxn_ls_completer_t* completer) {
 	config.hash = buxn_ls_cstr_hash;
 	config.removable = false;
 	bhash_init(&completer->completion_map, config);
+	completer->cache = (buxn_ls_completion_cache_t){ .is_valid = false };
+	completer->ranked_items = NULL;
+	completer->recent_names = NULL;
 }
 
 void
 buxn_ls_completer_cleanup(buxn_ls_completer_t* completer) {
 	bhash_cleanup(&completer->completion_map);
+	barray_free(NULL, completer->cache.prefix_chars);
+	barray_free(NULL, completer->cache.syms);
+	barray_free(NULL, completer->ranked_items);
+	for (size_t i = 0; i < barray_len(completer->recent_names); ++i) {
+		buxn_ls_free(completer->recent_names[i]);
+	}
+	barray_free(NULL, completer->recent_names);
+}
+
+static bool
+buxn_ls_str_has_prefix(buxn_ls_str_t str, buxn_ls_str_t prefix) {
+	return str.len >= prefix.len
+		&& (prefix.len == 0 || memcmp(str.chars, prefix.chars, prefix.len) == 0);
+}
+
+// Whether the last candidates are a superset of the ones for this request
+static bool
+buxn_ls_can_narrow_candidates(
+	const buxn_ls_completion_cache_t* cache,
+	const buxn_ls_completion_ctx_t* ctx,
+	const buxn_ls_sym_filter_t* filter
+) {
+	return cache->is_valid
+		&& cache->snapshot == ctx->analyzer->snapshot
+		&& cache->generation == ctx->analyzer->snapshot->generation
+		&& cache->source == ctx->source
+		&& cache->filter.labels_only == filter->labels_only
+		&& cache->filter.preceding_labels == filter->preceding_labels
+		&& cache->filter.subroutine_only == filter->subroutine_only
+		&& bio_lsp_cmp_pos(cache->filter.prefix_pos, filter->prefix_pos) == 0
+		&& cache->filter.addr_min == filter->addr_min
+		&& cache->filter.addr_max == filter->addr_max
+		&& (
+			// A longer prefix or pattern can only match fewer names
+			(
+				cache->filter.pattern.len == 0
+				&& buxn_ls_str_has_prefix(filter->prefix, cache->filter.prefix)
+			)
+			|| (
+				buxn_ls_cstr_eq(&filter->prefix, &cache->filter.prefix, 0)
+				&& buxn_ls_str_has_prefix(filter->pattern, cache->filter.pattern)
+			)
+		);
+}
+
+static void
+buxn_ls_find_candidates(
+	buxn_ls_completer_t* completer,
+	const buxn_ls_completion_ctx_t* ctx,
+	const buxn_ls_sym_filter_t* filter
+) {
+	buxn_ls_completion_cache_t* cache = &completer->cache;
+	if (buxn_ls_can_narrow_candidates(cache, ctx, filter)) {
+		size_t num_syms = 0;
+		for (size_t i = 0; i < barray_len(cache->syms); ++i) {
+			if (buxn_ls_score_name(cache->syms[i], filter) >= 0) {
+				cache->syms[num_syms++] = cache->syms[i];
+			}
+		}
+		barray_resize(cache->syms, num_syms, NULL);
+	} else {
+		// Collect the names with the prefix in the visible files
+		barray_clear(cache->syms);
+		unsigned int epoch = buxn_ls_analyzer_next_epoch(ctx->analyzer);
+		buxn_ls_visit_symbols_from_root(epoch, ctx->source);
+		buxn_ls_sym_index_t candidates = buxn_ls_find_symbols_with_prefix(
+			&ctx->analyzer->snapshot->name_index, filter->prefix
+		);
+		for (int i = 0; i < candidates.len; ++i) {
+			const buxn_ls_sym_node_t* def = candidates.syms[i];
+			if (
+				def->source->visit_epoch == epoch
+				&& buxn_ls_match_symbol(def, filter)
+			) {
+				barray_push(cache->syms, def, NULL);
+			}
+		}
+	}
+
+	cache->is_valid = true;
+	cache->snapshot = ctx->analyzer->snapshot;
+	cache->generation = ctx->analyzer->snapshot->generation;
+	cache->source = ctx->source;
+	cache->filter = *filter;
+	barray_resize(cache->prefix_chars, filter->prefix.len + filter->pattern.len, NULL);
+	if (filter->prefix.len > 0) {
+		memcpy(cache->prefix_chars, filter->prefix.chars, filter->prefix.len);
+	}
+	if (filter->pattern.len > 0) {
+		memcpy(cache->prefix_chars + filter->prefix.len, filter->pattern.chars, filter->pattern.len);
+	}
+	cache->filter.prefix.chars = cache->prefix_chars;
+	cache->filter.pattern.chars = cache->prefix_chars + filter->prefix.len;
 }
 
 struct yyjson_mut_val*
@@ -381,28 +577,9 @@ buxn_ls_build_completion_list(
 	buxn_ls_str_t current_scope;
 	{
 		// Find the most recently defined label to determine the current scope
-		const buxn_ls_sym_node_t* most_recent_label = NULL;
-		bio_lsp_position_t pos = {
-			.line = -1,
-			.character = -1,
-		};
-		for (
-			const buxn_ls_sym_node_t* def = ctx->source->definitions;
-			def != NULL;
-			def = def->next
-		) {
-			if (def->type != BUXN_ASM_SYM_LABEL) { continue; }
-			bio_lsp_position_t sym_start = def->range.start;
-			// Find the symbol with the greatest position that is defined before
-			// the completion prefix
-			if (
-				bio_lsp_cmp_pos(sym_start, pos) > 0
-				&& bio_lsp_cmp_pos(sym_start, ctx->lsp_range.start) < 0
-			) {
-				most_recent_label = def;
-				pos = def->range.start;
-			}
-		}
+		const buxn_ls_sym_node_t* most_recent_label = buxn_ls_find_symbol_before(
+			&ctx->source->label_index, ctx->lsp_range.start
+		);
 
 		if (most_recent_label == NULL) {
 			current_scope = (buxn_ls_str_t){
@@ -415,12 +592,14 @@ buxn_ls_build_completion_list(
 	}
 
 	// Adjust filter based on match type
+	size_t typed_len = filter.prefix.len;  // Typed by the user, at the end
 	switch (match_type) {
 		case BUXN_LS_MATCH_ANY_SYMBOL:
 			filter.labels_only = false;
 			break;
 		case BUXN_LS_MATCH_LOCAL_LABEL: {
 			filter.prefix = current_scope;
+			typed_len = 0;
 		} break;
 		case BUXN_LS_MATCH_SUB_LABEL: {
 			filter.prefix = buxn_ls_arena_fmt(
@@ -440,26 +619,41 @@ buxn_ls_build_completion_list(
 			break;
 	}
 
+	// Only the first typed character has to match exactly so that candidates
+	// can still be looked up by prefix
+	if (typed_len > 1) {
+		size_t exact_len = filter.prefix.len - typed_len + 1;
+		filter.pattern = (buxn_ls_str_t){
+			.chars = filter.prefix.chars + exact_len,
+			.len = filter.prefix.len - exact_len,
+		};
+		filter.prefix.len = exact_len;
+	}
+	filter.pattern_mask = buxn_ls_fuzzy_mask(filter.pattern);
+
 	BIO_DEBUG("match_type = %s", buxn_ls_sym_match_type_to_str(match_type));
 	BIO_DEBUG("format_type = %s", buxn_ls_sym_format_type_to_str(format_type));
 	BIO_DEBUG("prefix = %.*s", (int)filter.prefix.len, filter.prefix.chars);
+	BIO_DEBUG("pattern = %.*s", (int)filter.pattern.len, filter.pattern.chars);
 	BIO_DEBUG("current_scope = %.*s", (int)current_scope.len, current_scope.chars);
 	BIO_DEBUG("group_symbols = %s", group_symbols ? "true" : "false");
 
 	// Collect candidates
+	buxn_ls_find_candidates(completer, ctx, &filter);
 	bhash_clear(&completer->completion_map);
-	buxn_ls_visit_symbols_from_root(
-		&(buxn_ls_sym_visit_ctx_t){
-			.filter = filter,
-			.current_scope = current_scope,
-			.completion_map = &completer->completion_map,
-			.group_symbols = group_symbols,
-		},
-		ctx->source
-	);
+	buxn_ls_candidate_ctx_t candidate_ctx = {
+		.current_scope = current_scope,
+		.completion_map = &completer->completion_map,
+		.group_symbols = group_symbols,
+	};
+	for (size_t i = 0; i < barray_len(completer->cache.syms); ++i) {
+		const buxn_ls_sym_node_t* def = completer->cache.syms[i];
+		buxn_ls_add_candidate(&candidate_ctx, def, buxn_ls_score_name(def, &filter));
+	}
 
 	// Format result
-	int lsp_text_edit_start = (int)bio_lsp_utf16_offset_from_byte_offset(
+	int lsp_text_edit_start = (int)bio_lsp_character_from_byte_offset(
+		ctx->analyzer->position_encoding,
 		ctx->line_content.chars, ctx->line_content.len, text_edit_start
 	);
 	bio_lsp_range_t edit_range = {
@@ -470,17 +664,42 @@ buxn_ls_build_completion_list(
 		.end = ctx->lsp_range.end,
 	};
 
+	// Rank the candidates so that only the best ones are sent
+	barray_clear(completer->ranked_items);
+	bhash_index_t num_candidates = bhash_len(&completer->completion_map);
+	for (
+		bhash_index_t candidate_index = 0;
+		candidate_index < num_candidates;
+		++candidate_index
+	) {
+		buxn_ls_completion_item_t* item = &completer->completion_map.values[candidate_index];
+		item->num_references = buxn_ls_count_references(item->sym);
+		item->recency = buxn_ls_completion_recency(completer, item->sym->name);
+		barray_push(completer->ranked_items, item, NULL);
+	}
+	if (num_candidates > 0) {
+		qsort(
+			completer->ranked_items, num_candidates, sizeof(completer->ranked_items[0]),
+			buxn_ls_cmp_completion_item
+		);
+	}
+
 	yyjson_mut_val* completion_list_obj = yyjson_mut_obj(response);
-	yyjson_mut_obj_add_bool(response, completion_list_obj, "isIncomplete", false);
 	yyjson_mut_val* completion_items_arr = yyjson_mut_obj_add_arr(response, completion_list_obj, "items");
 
-	bhash_index_t num_candidates = bhash_len(&completer->completion_map);
+	int rank = 0;
+	bool is_incomplete = false;
 	for (
 		bhash_index_t candidate_index = 0;
 		candidate_index < num_candidates;
 		++candidate_index
 	) {
-		const buxn_ls_completion_item_t* item = &completer->completion_map.values[candidate_index];
+		if (rank >= BUXN_LS_COMPLETION_MAX_ITEMS) {
+			is_incomplete = true;
+			break;
+		}
+
+		const buxn_ls_completion_item_t* item = completer->ranked_items[candidate_index];
 		const buxn_ls_sym_node_t* sym = item->sym;
 		buxn_ls_str_t scope = buxn_ls_label_scope(sym->name);
 		bool is_root = buxn_ls_cstr_eq(&sym->name, &scope, 0);
@@ -501,7 +720,7 @@ buxn_ls_build_completion_list(
 						ctx,
 						response,
 						yyjson_mut_arr_add_obj(response, completion_items_arr),
-						item, label, edit_range
+						item, label, edit_range, rank++
 					);
 				} else {
 					if (
@@ -516,7 +735,7 @@ buxn_ls_build_completion_list(
 							ctx,
 							response,
 							yyjson_mut_arr_add_obj(response, completion_items_arr),
-							item, sym->name, edit_range
+							item, sym->name, edit_range, rank++
 						);
 					}
 
@@ -545,12 +764,9 @@ buxn_ls_build_completion_list(
 							item->size - (is_root ? 1 : 0)  // Exclude the root if any
 						);
 						yyjson_mut_obj_add_strn(response, item_obj, "detail", detail.chars, detail.len);
-						if (is_root && sym->documentation.len > 0) {
-							yyjson_mut_obj_add_strn(
-								response, item_obj,
-								"documentation",
-								sym->documentation.chars, sym->documentation.len
-							);
+						if (is_root) {
+							// The documentation of the root label is resolved later
+							buxn_ls_add_resolve_data(response, item_obj, sym);
 						}
 						yyjson_mut_val* text_edit = yyjson_mut_obj_add_obj(response, item_obj, "textEdit");
 						{
@@ -563,18 +779,7 @@ buxn_ls_build_completion_list(
 								&edit_range
 							);
 						}
-						buxn_ls_str_t sort_key = buxn_ls_arena_fmt(
-							ctx->arena,
-							"%s:%04x:%.*s",
-							item->is_local ? "0" : "1",
-							sym->address,
-							(int)label.len, label.chars
-						);
-						yyjson_mut_obj_add_strn(
-							response, item_obj,
-							"sortText",
-							sort_key.chars, sort_key.len
-						);
+						buxn_ls_add_sort_text(ctx, response, item_obj, rank++);
 					}
 				}
 			} break;
@@ -589,12 +794,79 @@ buxn_ls_build_completion_list(
 						ctx,
 						response,
 						yyjson_mut_arr_add_obj(response, completion_items_arr),
-						item, label, edit_range
+						item, label, edit_range, rank++
 					);
 				}
 			} break;
 		}
 	}
+	yyjson_mut_obj_add_bool(response, completion_list_obj, "isIncomplete", is_incomplete);
 
 	return completion_list_obj;
 }
+
+struct yyjson_mut_val*
+buxn_ls_resolve_completion_item(
+	buxn_ls_completer_t* completer,
+	struct buxn_ls_analyzer_s* analyzer,
+	struct barena_s* arena,
+	struct yyjson_val* item,
+	struct yyjson_mut_doc* response
+) {
+	yyjson_mut_val* item_obj = yyjson_val_mut_copy(response, item);
+
+	yyjson_val* data = BIO_LSP_JSON_GET_LIT(item, "data");
+	const char* filename = yyjson_get_str(BIO_LSP_JSON_GET_LIT(data, "file"));
+	yyjson_val* json_name = BIO_LSP_JSON_GET_LIT(data, "name");
+	if (filename == NULL || !yyjson_is_str(json_name)) { return item_obj; }
+	buxn_ls_str_t name = {
+		.chars = yyjson_get_str(json_name),
+		.len = yyjson_get_len(json_name),
+	};
+
+	// The analysis might have been updated since the list was sent
+	const buxn_ls_sym_node_t* sym = NULL;
+	buxn_ls_sym_index_t candidates = buxn_ls_find_symbols_with_prefix(
+		&analyzer->snapshot->name_index, name
+	);
+	for (int i = 0; i < candidates.len; ++i) {
+		const buxn_ls_sym_node_t* candidate = candidates.syms[i];
+		if (candidate->name.len != name.len) { break; }
+		if (strcmp(candidate->source->filename, filename) == 0) {
+			sym = candidate;
+			break;
+		}
+	}
+	if (sym == NULL) { return item_obj; }
+	buxn_ls_add_recent_name(completer, sym->name);
+
+	// Groups already have their size as detail
+	if (BIO_LSP_JSON_GET_LIT(item, "detail") == NULL) {
+		buxn_ls_str_t detail = { 0 };
+		if (sym->semantics == BUXN_LS_SYMBOL_AS_SUBROUTINE) {
+			if (sym->signature.len > 0) {
+				detail = buxn_ls_arena_fmt(
+					arena, "( %.*s )",
+					(int)sym->signature.len, sym->signature.chars
+				);
+			}
+		} else if (sym->address <= 0x00ff) {  // Zero page
+			detail = buxn_ls_arena_fmt(arena, "|0x%02x", sym->address);
+		} else {
+			detail = buxn_ls_arena_fmt(arena, "|0x%04x", sym->address);
+		}
+		if (detail.len > 0) {
+			yyjson_mut_obj_add_strn(response, item_obj, "detail", detail.chars, detail.len);
+		}
+	}
+
+	if (sym->documentation.len > 0) {
+		yyjson_mut_obj_add_strn(
+			response, item_obj,
+			"documentation",
+			sym->documentation.chars, sym->documentation.len
+		);
+	}
+
+	return item_obj;
+}
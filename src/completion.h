@@ -11,6 +11,7 @@ struct yyjson_mut_val;
 struct yyjson_val;
 struct yyjson_mut_doc;
 struct buxn_ls_analyzer_s;
+struct buxn_ls_analyzer_ctx_s;
 struct buxn_ls_src_node_s;
 struct buxn_ls_sym_node_s;
 
@@ -29,8 +30,36 @@ typedef struct {
 typedef struct buxn_ls_completion_item_s buxn_ls_completion_item_t;
 typedef BHASH_TABLE(buxn_ls_str_t, buxn_ls_completion_item_t) buxn_ls_completion_map_t;
 
+typedef struct {
+	bool labels_only;
+	bool preceding_labels;
+	bool subroutine_only;
+	bio_lsp_position_t prefix_pos;
+	uint16_t addr_min;
+	uint16_t addr_max;
+	buxn_ls_str_t prefix;
+	buxn_ls_str_t pattern;  // Fuzzily matched after the prefix
+	uint64_t pattern_mask;
+} buxn_ls_sym_filter_t;
+
+// Candidates of the last request.
+// When the next one only extends the prefix, they are narrowed down instead
+// of being looked up again.
+typedef struct {
+	const struct buxn_ls_analyzer_ctx_s* snapshot;
+	unsigned int generation;
+	const struct buxn_ls_src_node_s* source;
+	buxn_ls_sym_filter_t filter;  // The prefix and pattern are in prefix_chars
+	barray(char) prefix_chars;
+	barray(const struct buxn_ls_sym_node_s*) syms;
+	bool is_valid;
+} buxn_ls_completion_cache_t;
+
 typedef struct {
 	buxn_ls_completion_map_t completion_map;
+	buxn_ls_completion_cache_t cache;
+	barray(buxn_ls_completion_item_t*) ranked_items;
+	barray(char*) recent_names;  // Most recently resolved last
 } buxn_ls_completer_t;
 
 void
@@ -46,4 +75,14 @@ buxn_ls_build_completion_list(
 	struct yyjson_mut_doc* response
 );
 
+// Fill in the details which were left out of the completion list
+struct yyjson_mut_val*
+buxn_ls_resolve_completion_item(
+	buxn_ls_completer_t* completer,
+	struct buxn_ls_analyzer_s* analyzer,
+	struct barena_s* arena,
+	struct yyjson_val* item,
+	struct yyjson_mut_doc* response
+);
+
 #endif
@@ -5,34 +5,67 @@
 #include "workspace.h"
 #include "analyze.h"
 #include "completion.h"
+#include "watcher.h"
+#include "persist.h"
 #include <bmacro.h>
 #include <string.h>
+#include <stdlib.h>
 #include <yyjson.h>
 #include <yuarel.h>
 #include <bio/timer.h>
 #include <bio/file.h>
 
 static const bio_time_t BUXN_LS_ANALYZE_DELAY_MS = 200;
+static const size_t BUXN_LS_MAX_WORKSPACE_SYMBOLS = 100;
 
 typedef BHASH_SET(char*) buxn_ls_str_set_t;
 
+typedef enum {
+	BUXN_LS_PROGRESS_NONE,
+	BUXN_LS_PROGRESS_CREATING,  // Waiting for the client to accept the token
+	BUXN_LS_PROGRESS_ACTIVE,
+	BUXN_LS_PROGRESS_REJECTED,  // Nothing is reported until indexing ends
+} buxn_ls_progress_state_t;
+
+typedef struct {
+	const buxn_ls_sym_node_t* sym;
+	int score;
+	int num_references;
+	int name_order;  // Position in the name index
+} buxn_ls_symbol_match_t;
+
 typedef struct {
 	bio_io_buffer_t in_buf;
 	bio_io_buffer_t out_buf;
 	bool should_terminate;
 	yyjson_alc json_allocator;
 	char name_buf[sizeof("ls:2147483647")];
+	char analysis_name_buf[sizeof("ls:2147483647/analyze")];
 	buxn_ls_workspace_t workspace;
+	buxn_ls_watcher_t watcher;
 	barena_t request_arena;
 
 	bio_timer_t analyze_delay_timer;
+	bool is_analyzing;  // Analysis runs in its own coroutine
+	bool should_index;
+	bool is_finding_roots;
+	bool should_persist;
+	bool has_unsaved_analysis;
 	buxn_ls_analyzer_t analyzer;
 	buxn_ls_completer_t completer;
+	barray(buxn_ls_symbol_match_t) symbol_matches;
 	buxn_ls_str_set_t diag_file_set_a;
 	buxn_ls_str_set_t diag_file_set_b;
 	buxn_ls_str_set_t* currently_diagnosed_files;
 	buxn_ls_str_set_t* previously_diagnosed_files;
-	barray(buxn_ls_str_t) completion_lines;
+
+	bool supports_progress;
+	buxn_ls_progress_state_t progress_state;
+	int progress_request_id;
+	int last_progress_percentage;
+	int next_request_id;
+	int next_progress_id;
+	char progress_token[sizeof("buxn-ls/index/2147483647")];
 } buxn_ls_ctx_t;
 
 typedef yyjson_mut_val* (*buxn_ls_request_handler_t)(
@@ -51,6 +84,12 @@ typedef struct {
 	char* data;
 } buxn_ls_recv_buf_t;
 
+static void
+buxn_ls_handle_file_change(void* userdata, const char* filename);
+
+static void
+buxn_ls_schedule_analysis(buxn_ls_ctx_t* ctx);
+
 static void*
 buxn_ls_json_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
 	(void)ctx;
@@ -109,6 +148,7 @@ buxn_ls_initialize(
 ) {
 	int pid = yyjson_get_int(BIO_LSP_JSON_GET_LIT(msg->value, "processId"));
 	snprintf(ctx->name_buf, sizeof(ctx->name_buf), "ls:%d", pid);
+	snprintf(ctx->analysis_name_buf, sizeof(ctx->analysis_name_buf), "ls:%d/analyze", pid);
 	bio_set_coro_name(ctx->name_buf);
 	BIO_INFO("Initializing");
 
@@ -116,6 +156,58 @@ buxn_ls_initialize(
 	buxn_ls_analyzer_init(&ctx->analyzer, pool);
 	buxn_ls_completer_init(&ctx->completer);
 
+	yyjson_val* init_options = BIO_LSP_JSON_GET_LIT(msg->value, "initializationOptions");
+	yyjson_val* cache_budget = BIO_LSP_JSON_GET_LIT(init_options, "analysisCacheBudget");
+	if (yyjson_is_uint(cache_budget)) {
+		ctx->analyzer.cache.budget = (size_t)yyjson_get_uint(cache_budget);
+	}
+	yyjson_val* num_workers = BIO_LSP_JSON_GET_LIT(init_options, "analysisWorkers");
+	if (yyjson_is_uint(num_workers)) {
+		ctx->analyzer.num_workers = (int)yyjson_get_uint(num_workers);
+	}
+	yyjson_val* step_budget = BIO_LSP_JSON_GET_LIT(init_options, "stackCheckStepBudget");
+	if (yyjson_is_uint(step_budget)) {
+		ctx->analyzer.chess_step_budget = (int)yyjson_get_uint(step_budget);
+	}
+	yyjson_val* time_budget = BIO_LSP_JSON_GET_LIT(init_options, "stackCheckTimeBudget");
+	if (yyjson_is_uint(time_budget)) {
+		ctx->analyzer.chess_time_budget = (int)yyjson_get_uint(time_budget);
+	}
+	yyjson_val* index_workspace = BIO_LSP_JSON_GET_LIT(init_options, "indexWorkspace");
+	ctx->should_index = yyjson_is_bool(index_workspace)
+		? yyjson_get_bool(index_workspace)
+		: true;
+	yyjson_val* persist_index = BIO_LSP_JSON_GET_LIT(init_options, "persistIndex");
+	ctx->should_persist = yyjson_is_bool(persist_index)
+		? yyjson_get_bool(persist_index)
+		: true;
+
+	yyjson_val* work_done_progress = BIO_LSP_JSON_GET_LIT(
+		BIO_LSP_JSON_GET_LIT(
+			BIO_LSP_JSON_GET_LIT(msg->value, "capabilities"),
+			"window"
+		),
+		"workDoneProgress"
+	);
+	ctx->supports_progress = yyjson_get_bool(work_done_progress);
+
+	// Byte offsets can be used as is if the client accepts them
+	yyjson_val* position_encodings = BIO_LSP_JSON_GET_LIT(
+		BIO_LSP_JSON_GET_LIT(
+			BIO_LSP_JSON_GET_LIT(msg->value, "capabilities"),
+			"general"
+		),
+		"positionEncodings"
+	);
+	size_t encoding_index, max_encodings;
+	yyjson_val* encoding;
+	yyjson_arr_foreach(position_encodings, encoding_index, max_encodings, encoding) {
+		if (yyjson_equals_str(encoding, "utf-8")) {
+			ctx->analyzer.position_encoding = BIO_LSP_POSITION_ENCODING_UTF8;
+			break;
+		}
+	}
+
 	bhash_config_t hash_config = bhash_config_default();
 	hash_config.eq = buxn_ls_str_eq;
 	hash_config.hash = buxn_ls_str_hash;
@@ -179,6 +271,19 @@ buxn_ls_initialize(
 	}
 
 	buxn_ls_workspace_init(&ctx->workspace, root_dir);
+	ctx->workspace.position_encoding = ctx->analyzer.position_encoding;
+	// Requests can be served from the last session until the first analysis
+	// completes
+	if (ctx->should_persist) {
+		buxn_ls_persist_load(
+			ctx->analyzer.current_ctx, &ctx->workspace,
+			ctx->analyzer.position_encoding
+		);
+	}
+	buxn_ls_watcher_init(
+		&ctx->watcher, ctx->workspace.root_dir,
+		buxn_ls_handle_file_change, ctx
+	);
 
 	xincbin_data_t initialize_json = XINCBIN_GET(initialize_json);
 	// Can't do in-situ as multiple instances in server mode share the same
@@ -196,6 +301,13 @@ buxn_ls_initialize(
 
 	bio_lsp_out_msg_t reply = buxn_ls_begin_msg(ctx, BIO_LSP_MSG_RESULT, msg);
 	reply.value = yyjson_val_mut_copy(reply.doc, yyjson_doc_get_root(initialize_doc));
+	if (ctx->analyzer.position_encoding == BIO_LSP_POSITION_ENCODING_UTF8) {
+		yyjson_mut_obj_add_str(
+			reply.doc,
+			yyjson_mut_obj_get(reply.value, "capabilities"),
+			"positionEncoding", "utf-8"
+		);
+	}
 	buxn_ls_end_msg(ctx, &reply);
 
 	buxn_ls_free(initialize_mem);
@@ -204,37 +316,46 @@ buxn_ls_initialize(
 
 static void
 buxn_ls_cleanup(buxn_ls_ctx_t* ctx) {
+	// Also set when the connection was lost so nothing is rescheduled
+	ctx->should_terminate = true;
+	buxn_ls_watcher_cleanup(&ctx->watcher);
+	while (ctx->is_finding_roots) { bio_yield(); }
 	bio_cancel_timer(ctx->analyze_delay_timer);
+	if (ctx->is_analyzing) {
+		ctx->analyzer.should_cancel = true;
+		while (ctx->is_analyzing) { bio_yield(); }
+	}
+	if (ctx->has_unsaved_analysis) {
+		buxn_ls_persist_save(
+			ctx->analyzer.snapshot, &ctx->workspace,
+			ctx->analyzer.position_encoding
+		);
+	}
 
 	for (bhash_index_t i = 0; i < bhash_len(ctx->previously_diagnosed_files); ++i) {
 		char* uri = ctx->previously_diagnosed_files->keys[i];
 		buxn_ls_free(uri);
 	}
 
-	barray_free(NULL, ctx->completion_lines);
 	bhash_cleanup(&ctx->diag_file_set_a);
 	bhash_cleanup(&ctx->diag_file_set_b);
 	buxn_ls_workspace_cleanup(&ctx->workspace);
 	buxn_ls_completer_cleanup(&ctx->completer);
+	barray_free(NULL, ctx->symbol_matches);
 	buxn_ls_analyzer_cleanup(&ctx->analyzer);
 	barena_reset(&ctx->request_arena);
 }
 
 static void
-buxn_ls_analyze_workspace(void* userdata) {
-	buxn_ls_ctx_t* ctx = userdata;
+buxn_ls_publish_diagnostics(buxn_ls_ctx_t* ctx) {
 	buxn_ls_analyzer_t* analyzer = &ctx->analyzer;
 
-	BIO_INFO("Analyzing");
-	buxn_ls_analyze(analyzer, &ctx->workspace);
-	BIO_INFO("Done");
-
 	const char* last_uri = NULL;
-	size_t num_diags = barray_len(analyzer->diagnostics);
+	size_t num_diags = barray_len(analyzer->snapshot->diagnostics);
 	bio_lsp_out_msg_t msg = { 0 };
 	yyjson_mut_val* diag_arr = NULL;
 	for (size_t i = 0; i < num_diags; ++i) {
-		const buxn_ls_diagnostic_t* diag = &analyzer->diagnostics[i];
+		const buxn_ls_diagnostic_t* diag = &analyzer->snapshot->diagnostics[i];
 
 		if (diag->location.uri != last_uri) {  // Next file encountered
 			// Move uri to the set of diagnosed files
@@ -322,6 +443,265 @@ buxn_ls_analyze_workspace(void* userdata) {
 	ctx->currently_diagnosed_files = tmp;
 }
 
+static void
+buxn_ls_send_progress(buxn_ls_ctx_t* ctx, const char* kind, int percentage) {
+	bio_lsp_out_msg_t msg = buxn_ls_begin_msg(ctx, BIO_LSP_MSG_NOTIFICATION, NULL);
+	msg.method = "$/progress";
+	msg.value = yyjson_mut_obj(msg.doc);
+	yyjson_mut_obj_add_str(msg.doc, msg.value, "token", ctx->progress_token);
+	yyjson_mut_val* value = yyjson_mut_obj_add_obj(msg.doc, msg.value, "value");
+	yyjson_mut_obj_add_str(msg.doc, value, "kind", kind);
+	if (strcmp(kind, "begin") == 0) {
+		yyjson_mut_obj_add_str(msg.doc, value, "title", "Indexing workspace");
+	}
+	if (percentage >= 0) {
+		yyjson_mut_obj_add_int(msg.doc, value, "percentage", percentage);
+	}
+	buxn_ls_end_msg(ctx, &msg);
+}
+
+static void
+buxn_ls_report_index_progress(void* userdata, int num_done, int num_total) {
+	buxn_ls_ctx_t* ctx = userdata;
+	if (!ctx->supports_progress) { return; }
+
+	int percentage = num_total > 0 ? num_done * 100 / num_total : 0;
+	switch (ctx->progress_state) {
+		case BUXN_LS_PROGRESS_NONE: {
+			snprintf(
+				ctx->progress_token, sizeof(ctx->progress_token),
+				"buxn-ls/index/%d", ctx->next_progress_id++
+			);
+			ctx->progress_request_id = ctx->next_request_id++;
+			bio_lsp_out_msg_t msg = buxn_ls_begin_msg(ctx, BIO_LSP_MSG_REQUEST, NULL);
+			msg.new_id = yyjson_mut_int(msg.doc, ctx->progress_request_id);
+			msg.method = "window/workDoneProgress/create";
+			msg.value = yyjson_mut_obj(msg.doc);
+			yyjson_mut_obj_add_str(msg.doc, msg.value, "token", ctx->progress_token);
+			buxn_ls_end_msg(ctx, &msg);
+
+			// "begin" is sent once the client replies
+			ctx->progress_state = BUXN_LS_PROGRESS_CREATING;
+			ctx->last_progress_percentage = percentage;
+		} break;
+		case BUXN_LS_PROGRESS_CREATING:
+			ctx->last_progress_percentage = percentage;
+			break;
+		case BUXN_LS_PROGRESS_ACTIVE:
+			if (percentage != ctx->last_progress_percentage) {
+				buxn_ls_send_progress(ctx, "report", percentage);
+				ctx->last_progress_percentage = percentage;
+			}
+			break;
+		case BUXN_LS_PROGRESS_REJECTED:
+			break;
+	}
+}
+
+static void
+buxn_ls_handle_reply(buxn_ls_ctx_t* ctx, const bio_lsp_in_msg_t* in_msg) {
+	// Only replies to the current progress token are needed
+	if (
+		ctx->progress_state != BUXN_LS_PROGRESS_CREATING
+		|| !yyjson_is_int(in_msg->id)
+		|| yyjson_get_int(in_msg->id) != ctx->progress_request_id
+	) {
+		return;
+	}
+
+	if (in_msg->type == BIO_LSP_MSG_RESULT) {
+		buxn_ls_send_progress(ctx, "begin", ctx->last_progress_percentage);
+		ctx->progress_state = BUXN_LS_PROGRESS_ACTIVE;
+	} else {
+		BIO_WARN("Client rejected progress token %s", ctx->progress_token);
+		ctx->progress_state = BUXN_LS_PROGRESS_REJECTED;
+	}
+}
+
+static void
+buxn_ls_finish_analysis(buxn_ls_ctx_t* ctx) {
+	buxn_ls_analyzer_t* analyzer = &ctx->analyzer;
+	buxn_ls_publish_diagnostics(ctx);
+
+	// Opened files are tracked through the editor instead
+	bhash_index_t num_files = bhash_len(&analyzer->files);
+	for (bhash_index_t i = 0; i < num_files; ++i) {
+		const char* filename = analyzer->files.keys[i];
+		if (!bhash_is_valid(bhash_find(&ctx->workspace.docs, (char*){ (char*)filename }))) {
+			buxn_ls_watcher_add(&ctx->watcher, filename);
+		}
+	}
+
+	// Stack checking is slower so its diagnostics are published separately
+	if (
+		barray_len(analyzer->chess_queue) > 0
+		&& buxn_ls_check_stack(analyzer, &ctx->workspace)
+	) {
+		BIO_INFO("Stack checked");
+		buxn_ls_publish_diagnostics(ctx);
+	}
+}
+
+static void
+buxn_ls_analyze_workspace(void* userdata) {
+	buxn_ls_ctx_t* ctx = userdata;
+	buxn_ls_analyzer_t* analyzer = &ctx->analyzer;
+	bio_set_coro_name(ctx->analysis_name_buf);
+
+	BIO_INFO("Analyzing");
+	if (buxn_ls_analyze(analyzer, &ctx->workspace)) {
+		BIO_INFO("Done");
+		ctx->has_unsaved_analysis = ctx->should_persist;
+		buxn_ls_finish_analysis(ctx);
+
+		// Entries which are not opened come last so that they never delay
+		// the results for opened documents.
+		// A change to any document interrupts this.
+		if (
+			barray_len(ctx->workspace.roots) > 0
+			&& !analyzer->should_cancel
+			&& !bio_is_timer_pending(ctx->analyze_delay_timer)
+		) {
+			bool indexed = buxn_ls_index(
+				analyzer, &ctx->workspace,
+				buxn_ls_report_index_progress, ctx
+			);
+			// A late reply to the create request is ignored
+			if (ctx->progress_state == BUXN_LS_PROGRESS_ACTIVE) {
+				buxn_ls_send_progress(ctx, "end", -1);
+			}
+			ctx->progress_state = BUXN_LS_PROGRESS_NONE;
+			if (indexed) {
+				BIO_INFO("Indexed");
+				buxn_ls_finish_analysis(ctx);
+				if (ctx->has_unsaved_analysis) {
+					buxn_ls_persist_save(
+						analyzer->snapshot, &ctx->workspace,
+						analyzer->position_encoding
+					);
+					ctx->has_unsaved_analysis = false;
+				}
+			}
+		}
+	}
+
+	// A change which arrived after the last cancellation point was not
+	// analyzed.
+	// Normally its timer is pending but it could have been stopped.
+	bool has_pending_change = analyzer->should_cancel;
+	analyzer->should_cancel = false;
+	ctx->is_analyzing = false;
+	if (
+		has_pending_change
+		&& !ctx->should_terminate
+		&& !bio_is_timer_pending(ctx->analyze_delay_timer)
+	) {
+		buxn_ls_schedule_analysis(ctx);
+	}
+}
+
+static void
+buxn_ls_start_analysis(void* userdata) {
+	buxn_ls_ctx_t* ctx = userdata;
+
+	if (ctx->is_analyzing) {  // Try again after the cancelled one winds down
+		ctx->analyzer.should_cancel = true;
+		ctx->analyze_delay_timer = bio_create_timer(
+			BIO_TIMER_ONESHOT,
+			BUXN_LS_ANALYZE_DELAY_MS,
+			buxn_ls_start_analysis, ctx
+		);
+		return;
+	}
+
+	ctx->is_analyzing = true;
+	bio_spawn(buxn_ls_analyze_workspace, ctx);
+}
+
+static void
+buxn_ls_schedule_analysis(buxn_ls_ctx_t* ctx) {
+	// An analysis in progress is already outdated
+	if (ctx->is_analyzing) {
+		ctx->analyzer.should_cancel = true;
+	}
+	if (bio_is_timer_pending(ctx->analyze_delay_timer)) {
+		bio_reset_timer(ctx->analyze_delay_timer, BUXN_LS_ANALYZE_DELAY_MS);
+	} else {
+		ctx->analyze_delay_timer = bio_create_timer(
+			BIO_TIMER_ONESHOT,
+			BUXN_LS_ANALYZE_DELAY_MS,
+			buxn_ls_start_analysis, ctx
+		);
+	}
+}
+
+static void
+buxn_ls_find_roots(void* userdata) {
+	buxn_ls_ctx_t* ctx = userdata;
+	buxn_ls_workspace_find_roots(&ctx->workspace);
+	ctx->is_finding_roots = false;
+	if (barray_len(ctx->workspace.roots) > 0) {
+		buxn_ls_schedule_analysis(ctx);
+	}
+}
+
+// Only entries including the file are reassembled since the others will be
+// reused after their content hashes are compared
+static void
+buxn_ls_handle_file_change(void* userdata, const char* filename) {
+	buxn_ls_ctx_t* ctx = userdata;
+
+	buxn_ls_workspace_invalidate_file(&ctx->workspace, filename);
+	// The editor content takes precedence
+	if (bhash_is_valid(bhash_find(&ctx->workspace.docs, (char*){ (char*)filename }))) {
+		return;
+	}
+
+	BIO_INFO("%s changed on disk", filename);
+	buxn_ls_schedule_analysis(ctx);
+}
+
+static void
+buxn_ls_handle_watched_files(buxn_ls_ctx_t* ctx, const bio_lsp_in_msg_t* msg) {
+	yyjson_val* changes = BIO_LSP_JSON_GET_LIT(msg->value, "changes");
+	size_t index, max;
+	yyjson_val* change;
+	yyjson_arr_foreach(changes, index, max, change) {
+		const char* uri = yyjson_get_str(BIO_LSP_JSON_GET_LIT(change, "uri"));
+		if (uri == NULL) { continue; }
+
+		// Resolving modifies the uri so it has to be copied
+		char* uri_copy = buxn_ls_strcpy(uri);
+		const char* path = buxn_ls_workspace_resolve_path(&ctx->workspace, uri_copy);
+		if (path != NULL) {
+			buxn_ls_handle_file_change(ctx, path);
+		}
+		buxn_ls_free(uri_copy);
+	}
+}
+
+// Results are served from the last analysis while newer edits are waiting for
+// the next one so positions have to be mapped between the two
+static bool
+buxn_ls_map_to_snapshot(
+	buxn_ls_ctx_t* ctx,
+	const buxn_ls_src_node_t* node,
+	bio_lsp_position_t* position
+) {
+	return buxn_ls_workspace_map_to_snapshot(
+		&ctx->workspace, node->filename, node->content_hash, position
+	);
+}
+
+static bio_lsp_range_t
+buxn_ls_current_range(buxn_ls_ctx_t* ctx, const buxn_ls_sym_node_t* sym) {
+	bio_lsp_range_t range = sym->range;
+	buxn_ls_workspace_map_from_snapshot(
+		&ctx->workspace, sym->source->filename, sym->source->content_hash, &range
+	);
+	return range;
+}
+
 static const buxn_ls_sym_node_t*
 buxn_ls_find_definition(buxn_ls_ctx_t* ctx, yyjson_val* text_document_position) {
 	const char* uri = yyjson_get_str(
@@ -332,25 +712,21 @@ buxn_ls_find_definition(buxn_ls_ctx_t* ctx, yyjson_val* text_document_position)
 	const char* path = buxn_ls_workspace_resolve_path(&ctx->workspace, (char*)uri);
 	if (path == NULL) { return NULL; }
 
-	bhash_index_t node_index = bhash_find(&ctx->analyzer.current_ctx->sources, path);
+	bhash_index_t node_index = bhash_find(&ctx->analyzer.snapshot->sources, path);
 	if (!bhash_is_valid(node_index)) { return NULL; }
 
 	yyjson_val* position = BIO_LSP_JSON_GET_LIT(text_document_position, "position");
-	int line = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "line"));
-	int character = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "character"));
+	bio_lsp_position_t lsp_position = {
+		.line = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "line")),
+		.character = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "character")),
+	};
 
-	const buxn_ls_src_node_t* node = ctx->analyzer.current_ctx->sources.values[node_index];
-	for (buxn_ls_sym_node_t* ref = node->references; ref != NULL; ref = ref->next) {
-		if (
-			(ref->range.start.line <= line && line <= ref->range.end.line)
-			&& (ref->range.start.character <= character && character < ref->range.end.character)
-		) {
-			if (ref->base.out_edges == NULL) { return NULL; }
-			return BCONTAINER_OF(ref->base.out_edges->to, buxn_ls_sym_node_t, base);
-		}
-	}
+	const buxn_ls_src_node_t* node = ctx->analyzer.snapshot->sources.values[node_index];
+	if (!buxn_ls_map_to_snapshot(ctx, node, &lsp_position)) { return NULL; }
+	const buxn_ls_sym_node_t* ref = buxn_ls_find_symbol_at(&node->reference_index, lsp_position);
+	if (ref == NULL || ref->base.out_edges == NULL) { return NULL; }
 
-	return NULL;
+	return BCONTAINER_OF(ref->base.out_edges->to, buxn_ls_sym_node_t, base);
 }
 
 static yyjson_mut_val*
@@ -365,7 +741,8 @@ buxn_ls_handle_find_definition(
 	yyjson_mut_val* result = yyjson_mut_obj(response);
 	yyjson_mut_obj_add_str(response, result, "uri", def->source->uri);
 	yyjson_mut_val* range = yyjson_mut_obj_add_obj(response, result, "range");
-	buxn_ls_serialize_lsp_range(response, range, &def->range);
+	bio_lsp_range_t def_range = buxn_ls_current_range(ctx, def);
+	buxn_ls_serialize_lsp_range(response, range, &def_range);
 	return result;
 }
 
@@ -383,25 +760,20 @@ buxn_ls_handle_find_references(
 	const char* path = buxn_ls_workspace_resolve_path(&ctx->workspace, (char*)uri);
 	if (path == NULL) { return NULL; }
 
-	bhash_index_t src_node_index = bhash_find(&ctx->analyzer.current_ctx->sources, path);
+	bhash_index_t src_node_index = bhash_find(&ctx->analyzer.snapshot->sources, path);
 	if (!bhash_is_valid(src_node_index)) { return NULL; }
 
 	yyjson_val* position = BIO_LSP_JSON_GET_LIT(request, "position");
-	int line = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "line"));
-	int character = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "character"));
-
-	const buxn_ls_src_node_t* src_node = ctx->analyzer.current_ctx->sources.values[src_node_index];
-	const buxn_ls_sym_node_t* def_node = NULL;
-	for (buxn_ls_sym_node_t* def = src_node->definitions; def != NULL; def = def->next) {
-		if (
-			(def->range.start.line <= line && line <= def->range.end.line)
-			&& (def->range.start.character <= character && character < def->range.end.character)
-		) {
-			def_node = def;
-			break;
-		}
-	}
+	bio_lsp_position_t lsp_position = {
+		.line = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "line")),
+		.character = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "character")),
+	};
 
+	const buxn_ls_src_node_t* src_node = ctx->analyzer.snapshot->sources.values[src_node_index];
+	if (!buxn_ls_map_to_snapshot(ctx, src_node, &lsp_position)) { return NULL; }
+	const buxn_ls_sym_node_t* def_node = buxn_ls_find_symbol_at(
+		&src_node->definition_index, lsp_position
+	);
 	if (def_node == NULL) { return NULL; }
 
 	yyjson_mut_val* result = yyjson_mut_arr(response);
@@ -415,10 +787,11 @@ buxn_ls_handle_find_references(
 		);
 		yyjson_mut_val* location_obj = yyjson_mut_arr_add_obj(response, result);
 		yyjson_mut_obj_add_str(response, location_obj, "uri", ref_node->source->uri);
+		bio_lsp_range_t ref_range = buxn_ls_current_range(ctx, ref_node);
 		buxn_ls_serialize_lsp_range(
 			response,
 			yyjson_mut_obj_add_obj(response, location_obj, "range"),
-			&ref_node->range
+			&ref_range
 		);
 	}
 	return result;
@@ -466,7 +839,8 @@ buxn_ls_handle_hover(
 			yyjson_mut_obj_add_strn(response, content_obj, "value", detail.chars, detail.len);
 		}
 		yyjson_mut_val* range_obj = yyjson_mut_obj_add_obj(response, result, "range");
-		buxn_ls_serialize_lsp_range(response, range_obj, &def->range);
+		bio_lsp_range_t def_range = buxn_ls_current_range(ctx, def);
+		buxn_ls_serialize_lsp_range(response, range_obj, &def_range);
 	}
 	return result;
 }
@@ -501,11 +875,11 @@ buxn_ls_handle_list_doc_symbols(
 	const char* path = buxn_ls_workspace_resolve_path(&ctx->workspace, (char*)uri);
 	if (path == NULL) { return NULL; }
 
-	bhash_index_t src_node_index = bhash_find(&ctx->analyzer.current_ctx->sources, path);
+	bhash_index_t src_node_index = bhash_find(&ctx->analyzer.snapshot->sources, path);
 	if (!bhash_is_valid(src_node_index)) { return NULL; }
 
 	yyjson_mut_val* result = yyjson_mut_arr(response);
-	const buxn_ls_src_node_t* src_node = ctx->analyzer.current_ctx->sources.values[src_node_index];
+	const buxn_ls_src_node_t* src_node = ctx->analyzer.snapshot->sources.values[src_node_index];
 	for (
 		buxn_ls_sym_node_t* sym = src_node->definitions;
 		sym != NULL;
@@ -519,21 +893,37 @@ buxn_ls_handle_list_doc_symbols(
 		);
 
 		// TODO: Add signature
+		bio_lsp_range_t sym_range = buxn_ls_current_range(ctx, sym);
 		buxn_ls_serialize_lsp_range(
 			response,
 			yyjson_mut_obj_add_obj(response, sym_obj, "range"),
-			&sym->range
+			&sym_range
 		);
 		buxn_ls_serialize_lsp_range(
 			response,
 			yyjson_mut_obj_add_obj(response, sym_obj, "selectionRange"),
-			&sym->range
+			&sym_range
 		);
 	}
 
 	return result;
 }
 
+static int
+buxn_ls_cmp_symbol_match(const void* lhs, const void* rhs) {
+	const buxn_ls_symbol_match_t* lhs_match = lhs;
+	const buxn_ls_symbol_match_t* rhs_match = rhs;
+
+	// Better matches first, then the most referenced symbols, then by name
+	if (lhs_match->score != rhs_match->score) {
+		return lhs_match->score > rhs_match->score ? -1 : 1;
+	}
+	if (lhs_match->num_references != rhs_match->num_references) {
+		return lhs_match->num_references > rhs_match->num_references ? -1 : 1;
+	}
+	return lhs_match->name_order - rhs_match->name_order;
+}
+
 static yyjson_mut_val*
 buxn_ls_handle_list_workspace_symbols(
 	buxn_ls_ctx_t* ctx,
@@ -542,35 +932,59 @@ buxn_ls_handle_list_workspace_symbols(
 ) {
 	const char* query = yyjson_get_str(BIO_LSP_JSON_GET_LIT(request, "query"));
 	if (query == NULL) { return NULL; }
-	size_t query_len = strlen(query);
+	buxn_ls_str_t pattern = { .chars = query, .len = strlen(query) };
+	uint64_t pattern_mask = buxn_ls_fuzzy_mask(pattern);
+
+	barray_clear(ctx->symbol_matches);
+	const buxn_ls_sym_index_t* name_index = &ctx->analyzer.snapshot->name_index;
+	for (int i = 0; i < name_index->len; ++i) {
+		const buxn_ls_sym_node_t* sym = name_index->syms[i];
+		if ((pattern_mask & ~sym->name_mask) != 0) { continue; }
+
+		int score = buxn_ls_fuzzy_score(pattern, sym->name);
+		if (score < 0) { continue; }
+
+		buxn_ls_symbol_match_t match = {
+			.sym = sym,
+			.score = score,
+			.num_references = buxn_ls_count_references(sym),
+			.name_order = i,
+		};
+		barray_push(ctx->symbol_matches, match, NULL);
+	}
+
+	// Only send the best matches
+	size_t num_matches = barray_len(ctx->symbol_matches);
+	if (num_matches > 0) {
+		qsort(
+			ctx->symbol_matches, num_matches, sizeof(ctx->symbol_matches[0]),
+			buxn_ls_cmp_symbol_match
+		);
+	}
+	if (num_matches > BUXN_LS_MAX_WORKSPACE_SYMBOLS) {
+		num_matches = BUXN_LS_MAX_WORKSPACE_SYMBOLS;
+	}
 
 	yyjson_mut_val* result = yyjson_mut_arr(response);
-	bhash_index_t num_sources = bhash_len(&ctx->analyzer.current_ctx->sources);
-	for (bhash_index_t src_index = 0; src_index < num_sources; ++src_index) {
-		const buxn_ls_src_node_t* src_node = ctx->analyzer.current_ctx->sources.values[src_index];
-		for (
-			buxn_ls_sym_node_t* sym = src_node->definitions;
-			sym != NULL;
-			sym = sym->next
-		) {
-			if (strncmp(sym->name.chars, query, query_len) != 0) { continue; }
+	for (size_t i = 0; i < num_matches; ++i) {
+		const buxn_ls_sym_node_t* sym = ctx->symbol_matches[i].sym;
 
-			yyjson_mut_val* sym_obj = yyjson_mut_arr_add_obj(response, result);
-			yyjson_mut_obj_add_strn(response, sym_obj, "name", sym->name.chars, sym->name.len);
+		yyjson_mut_val* sym_obj = yyjson_mut_arr_add_obj(response, result);
+		yyjson_mut_obj_add_strn(response, sym_obj, "name", sym->name.chars, sym->name.len);
 
-			yyjson_mut_obj_add_int(
-				response, sym_obj,
-				"kind", buxn_ls_convert_symbol_semantics(sym->semantics)
-			);
+		yyjson_mut_obj_add_int(
+			response, sym_obj,
+			"kind", buxn_ls_convert_symbol_semantics(sym->semantics)
+		);
 
-			yyjson_mut_val* location_obj = yyjson_mut_obj_add_obj(response, sym_obj, "location");
-			yyjson_mut_obj_add_str(response, location_obj, "uri", sym->source->uri);
-			buxn_ls_serialize_lsp_range(
-				response,
-				yyjson_mut_obj_add_obj(response, location_obj, "range"),
-				&sym->range
-			);
-		}
+		yyjson_mut_val* location_obj = yyjson_mut_obj_add_obj(response, sym_obj, "location");
+		yyjson_mut_obj_add_str(response, location_obj, "uri", sym->source->uri);
+		bio_lsp_range_t sym_range = buxn_ls_current_range(ctx, sym);
+		buxn_ls_serialize_lsp_range(
+			response,
+			yyjson_mut_obj_add_obj(response, location_obj, "range"),
+			&sym_range
+		);
 	}
 	return result;
 }
@@ -592,19 +1006,23 @@ buxn_ls_handle_completion(
 	// Retrieve the doc from workspace since it is not yet analyzed
 	bhash_index_t doc_index = bhash_find(&ctx->workspace.docs, (char*){ (char*)path });
 	if (!bhash_is_valid(doc_index)) { return NULL; }
-	buxn_ls_str_t file_content = ctx->workspace.docs.values[doc_index];
 
 	yyjson_val* position = BIO_LSP_JSON_GET_LIT(request, "position");
 	int line = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "line"));
 	int character = yyjson_get_int(BIO_LSP_JSON_GET_LIT(position, "character"));
 
-	barray_clear(ctx->completion_lines);
-	buxn_ls_line_slice_t slice = buxn_ls_split_file(file_content, &ctx->completion_lines);
-	if (line >= slice.num_lines) { return NULL; }
+	// Only the current line is needed
+	buxn_ls_str_t line_content;
+	if (!buxn_ls_text_copy_line(
+		&ctx->workspace.docs.values[doc_index], line,
+		&ctx->request_arena, &line_content
+	)) {
+		return NULL;
+	}
 
 	// Convert from LSP offset to byte offset
-	buxn_ls_str_t line_content = slice.lines[line];
-	ptrdiff_t byte_offset = bio_lsp_byte_offset_from_utf16_offset(
+	ptrdiff_t byte_offset = bio_lsp_byte_offset_from_character(
+		ctx->analyzer.position_encoding,
 		line_content.chars, line_content.len, character
 	);
 
@@ -625,9 +1043,9 @@ buxn_ls_handle_completion(
 	};
 	if (completion_prefix.len == 0) { return NULL; }
 
-	bhash_index_t src_node_index = bhash_find(&ctx->analyzer.current_ctx->sources, path);
+	bhash_index_t src_node_index = bhash_find(&ctx->analyzer.snapshot->sources, path);
 	if (!bhash_is_valid(src_node_index)) { return NULL; }
-	buxn_ls_src_node_t* src_node = ctx->analyzer.current_ctx->sources.values[src_node_index];
+	buxn_ls_src_node_t* src_node = ctx->analyzer.snapshot->sources.values[src_node_index];
 
 	// Stop analysis since the doc is incomplete
 	bio_cancel_timer(ctx->analyze_delay_timer);
@@ -640,7 +1058,8 @@ buxn_ls_handle_completion(
 		.lsp_range = {
 			.start = {
 				.line = line,
-				.character = (int)bio_lsp_utf16_offset_from_byte_offset(
+				.character = (int)bio_lsp_character_from_byte_offset(
+					ctx->analyzer.position_encoding,
 					line_content.chars, line_content.len, completion_start
 				),
 			},
@@ -653,6 +1072,42 @@ buxn_ls_handle_completion(
 	return buxn_ls_build_completion_list(&ctx->completer, &completion_ctx, response);
 }
 
+static yyjson_mut_val*
+buxn_ls_handle_resolve_completion_item(
+	buxn_ls_ctx_t* ctx,
+	yyjson_val* request,
+	yyjson_mut_doc* response
+) {
+	return buxn_ls_resolve_completion_item(
+		&ctx->completer, &ctx->analyzer, &ctx->request_arena, request, response
+	);
+}
+
+static yyjson_mut_val*
+buxn_ls_handle_cache_stats(
+	buxn_ls_ctx_t* ctx,
+	yyjson_val* request,
+	yyjson_mut_doc* response
+) {
+	const buxn_ls_analysis_cache_t* analysis_cache = &ctx->analyzer.cache;
+	yyjson_mut_val* analysis = yyjson_mut_obj(response);
+	yyjson_mut_obj_add_int(response, analysis, "hits", analysis_cache->num_hits);
+	yyjson_mut_obj_add_int(response, analysis, "misses", analysis_cache->num_misses);
+	yyjson_mut_obj_add_uint(response, analysis, "size", analysis_cache->size);
+	yyjson_mut_obj_add_uint(response, analysis, "budget", analysis_cache->budget);
+
+	const buxn_ls_chess_cache_t* chess_cache = &ctx->analyzer.chess_cache;
+	yyjson_mut_val* stack_check = yyjson_mut_obj(response);
+	yyjson_mut_obj_add_int(response, stack_check, "hits", chess_cache->num_hits);
+	yyjson_mut_obj_add_int(response, stack_check, "misses", chess_cache->num_misses);
+	yyjson_mut_obj_add_int(response, stack_check, "routines", (int)bhash_len(&chess_cache->routines));
+
+	yyjson_mut_val* result = yyjson_mut_obj(response);
+	yyjson_mut_obj_add_val(response, result, "analysis", analysis);
+	yyjson_mut_obj_add_val(response, result, "stackCheck", stack_check);
+	return result;
+}
+
 static yyjson_mut_val*
 buxn_ls_handle_shutdown(
 	buxn_ls_ctx_t* ctx,
@@ -671,7 +1126,9 @@ static const buxn_ls_handler_entry_t BUXN_LS_REQUEST_HANDLERS[] = {
 	{ "textDocument/hover", buxn_ls_handle_hover },
 	{ "textDocument/documentSymbol", buxn_ls_handle_list_doc_symbols },
 	{ "textDocument/completion", buxn_ls_handle_completion },
+	{ "completionItem/resolve", buxn_ls_handle_resolve_completion_item },
 	{ "workspace/symbol", buxn_ls_handle_list_workspace_symbols },
+	{ "buxn-ls/cacheStats", buxn_ls_handle_cache_stats },
 };
 
 static void
@@ -710,19 +1167,17 @@ buxn_ls_handle_msg(buxn_ls_ctx_t* ctx, const bio_lsp_in_msg_t* in_msg) {
 				ctx->should_terminate = true;
 			} else if (BIO_LSP_STR_STARTS_WITH(in_msg->method, "textDocument/")) {
 				buxn_ls_workspace_update(&ctx->workspace, in_msg);
-				if (bio_is_timer_pending(ctx->analyze_delay_timer)) {
-					bio_reset_timer(ctx->analyze_delay_timer, BUXN_LS_ANALYZE_DELAY_MS);
-				} else {
-					ctx->analyze_delay_timer = bio_create_timer(
-						BIO_TIMER_ONESHOT,
-						BUXN_LS_ANALYZE_DELAY_MS,
-						buxn_ls_analyze_workspace, ctx
-					);
-				}
+				buxn_ls_schedule_analysis(ctx);
+			} else if (strcmp(in_msg->method, "workspace/didChangeWatchedFiles") == 0) {
+				buxn_ls_handle_watched_files(ctx, in_msg);
 			} else {
 				BIO_WARN("Dropped notification: %s", in_msg->method);
 			}
 			break;
+		case BIO_LSP_MSG_RESULT:
+		case BIO_LSP_MSG_ERROR:
+			buxn_ls_handle_reply(ctx, in_msg);
+			break;
 		default:
 			BIO_WARN("Dropped message");
 			break;
@@ -836,6 +1291,11 @@ buxn_ls(
 
 	BIO_DEBUG("Initialized");
 
+	if (ctx.should_index) {
+		ctx.is_finding_roots = true;
+		bio_spawn(buxn_ls_find_roots, &ctx);
+	}
+
 	while (!ctx.should_terminate) {
 		if (!buxn_ls_recv_msg(in_buf, &recv_buf, &in_msg, &error)) {
 			BIO_ERROR("Error while reading message: " BIO_ERROR_FMT, BIO_ERROR_FMT_ARGS(&error));
@@ -865,6 +1325,7 @@ buxn_ls_stdio(void* userdata) {
 	bio_io_buffer_t out_buf = bio_make_file_write_buffer(BIO_STDOUT, BUXN_LS_IO_BUF_SIZE, false);
 
 	int exit_code = buxn_ls(in_buf, out_buf, &pool);
+	buxn_ls_file_cache_cleanup();
 
 	bio_destroy_buffer(in_buf);
 	bio_destroy_buffer(out_buf);
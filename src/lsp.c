@@ -3,7 +3,14 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
-#include <utf8proc.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BIO_LSP_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 typedef enum {
 	BIO_LSP_BAD_HEADER,
@@ -153,6 +160,7 @@ bio_lsp_parse_msg(
 	}
 	yyjson_val* root = yyjson_doc_get_root(msg->doc);
 	msg->method = yyjson_get_str(BIO_LSP_JSON_GET_LIT(root, "method"));
+	msg->id = BIO_LSP_JSON_GET_LIT(root, "id");
 	if (msg->method == NULL) {
 		yyjson_val* value = BIO_LSP_JSON_GET_LIT(root, "result");
 		if (value != NULL) {
@@ -169,7 +177,6 @@ bio_lsp_parse_msg(
 			msg->value = value;
 		}
 	} else {
-		msg->id = BIO_LSP_JSON_GET_LIT(root, "id");
 		msg->value = BIO_LSP_JSON_GET_LIT(root, "params");
 		msg->type = msg->id == NULL ? BIO_LSP_MSG_NOTIFICATION : BIO_LSP_MSG_REQUEST;
 	}
@@ -242,56 +249,154 @@ end:
 	return success;
 }
 
+static inline int
+bio_lsp_count_trailing_zeros(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+size_t
+bio_lsp_ascii_prefix_len(const char* str, size_t len) {
+	size_t i = 0;
+#ifdef BIO_LSP_SSE2
+	// The high bit of every byte is collected so 16 bytes are checked at once
+	for (; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(str + i));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(block);
+		if (mask != 0) {
+			return i + (size_t)bio_lsp_count_trailing_zeros(mask);
+		}
+	}
+#endif
+	while (i < len && (unsigned char)str[i] < 0x80) { ++i; }
+	return i;
+}
+
+// A UTF-8 byte starts a codepoint unless it is a continuation byte.
+// A codepoint takes two UTF-16 code units if its sequence has 4 bytes.
+// Invalid sequences are not decoded: every byte which is not a continuation
+// counts as one replacement character.
+static inline size_t
+bio_lsp_utf16_len_of_byte(unsigned char byte) {
+	return ((byte & 0xc0) != 0x80 ? 1 : 0) + ((byte & 0xf8) == 0xf0 ? 1 : 0);
+}
+
+#ifdef BIO_LSP_SSE2
+static inline int
+bio_lsp_popcount(unsigned int mask) {
+#ifdef _MSC_VER
+	return (int)__popcnt(mask);
+#else
+	return __builtin_popcount(mask);
+#endif
+}
+
+// UTF-16 length of 16 bytes
+static inline size_t
+bio_lsp_utf16_len_of_block(const char* str) {
+	__m128i block = _mm_loadu_si128((const __m128i*)str);
+	__m128i is_continuation = _mm_cmpeq_epi8(
+		_mm_and_si128(block, _mm_set1_epi8((char)0xc0)),
+		_mm_set1_epi8((char)0x80)
+	);
+	__m128i is_four_bytes = _mm_cmpeq_epi8(
+		_mm_and_si128(block, _mm_set1_epi8((char)0xf8)),
+		_mm_set1_epi8((char)0xf0)
+	);
+	unsigned int continuation_mask = (unsigned int)_mm_movemask_epi8(is_continuation);
+	unsigned int four_bytes_mask = (unsigned int)_mm_movemask_epi8(is_four_bytes);
+	return (size_t)(16 - bio_lsp_popcount(continuation_mask) + bio_lsp_popcount(four_bytes_mask));
+}
+#endif
+
 ptrdiff_t
 bio_lsp_utf16_offset_from_byte_offset(const char* utf8str, size_t str_size, ptrdiff_t byte_offset) {
-	utf8proc_ssize_t itr = 0;
-	utf8proc_ssize_t line_len = (utf8proc_ssize_t)str_size;
-	ptrdiff_t code_unit_offset = 0;
-	while (true) {
-		if (itr >= byte_offset || itr >= line_len) { break; }
-
-		utf8proc_int32_t codepoint;
-		utf8proc_ssize_t num_bytes = utf8proc_iterate(
-			(const utf8proc_uint8_t*)utf8str + itr,
-			line_len - itr,
-			&codepoint
-		);
-
-		if (num_bytes < 0) {
-			// If an invalid codepoint is encountered, skip the byte
-			itr += 1;
-		} else {
-			itr += num_bytes;
-			code_unit_offset += (codepoint <= 0xFFFF ? 1 : 2);
-		}
+	// A codepoint which starts before the offset is counted whole
+	size_t end = byte_offset > 0 ? (size_t)byte_offset : 0;
+	if (end > str_size) { end = str_size; }
+
+	size_t i = 0;
+	size_t code_unit_offset = 0;
+#ifdef BIO_LSP_SSE2
+	for (; i + 16 <= end; i += 16) {
+		code_unit_offset += bio_lsp_utf16_len_of_block(utf8str + i);
+	}
+#endif
+	for (; i < end; ++i) {
+		code_unit_offset += bio_lsp_utf16_len_of_byte((unsigned char)utf8str[i]);
 	}
 
-	return code_unit_offset;
+	return (ptrdiff_t)code_unit_offset;
 }
 
 ptrdiff_t
 bio_lsp_byte_offset_from_utf16_offset(const char* utf8str, size_t str_size, ptrdiff_t utf16_offset) {
-	utf8proc_ssize_t itr = 0;
-	utf8proc_ssize_t line_len = (utf8proc_ssize_t)str_size;
-	ptrdiff_t code_unit_offset = 0;
-	while (true) {
-		if (code_unit_offset >= utf16_offset || itr >= line_len) { break; }
-
-		utf8proc_int32_t codepoint;
-		utf8proc_ssize_t num_bytes = utf8proc_iterate(
-			(const utf8proc_uint8_t*)utf8str + itr,
-			line_len - itr,
-			&codepoint
-		);
-
-		if (num_bytes < 0) {
-			// If an invalid codepoint is encountered, skip the byte
-			itr += 1;
-		} else {
-			itr += num_bytes;
-			code_unit_offset += (codepoint <= 0xFFFF ? 1 : 2);
+	if (utf16_offset <= 0) { return 0; }
+	size_t target = (size_t)utf16_offset;
+
+	size_t i = 0;
+	size_t code_unit_offset = 0;
+#ifdef BIO_LSP_SSE2
+	// Whole blocks are skipped while they end before the target.
+	// A block may end in the middle of a sequence whose remaining bytes are
+	// continuations.
+	for (; i + 16 <= str_size; i += 16) {
+		size_t block_len = bio_lsp_utf16_len_of_block(utf8str + i);
+		if (code_unit_offset + block_len >= target) { break; }
+		code_unit_offset += block_len;
+	}
+#endif
+	for (; i < str_size; ++i) {
+		unsigned char byte = (unsigned char)utf8str[i];
+		if ((byte & 0xc0) != 0x80) {
+			if (code_unit_offset >= target) { break; }
+			code_unit_offset += bio_lsp_utf16_len_of_byte(byte);
 		}
 	}
 
-	return itr;
+	return (ptrdiff_t)i;
+}
+
+static ptrdiff_t
+bio_lsp_clamp_byte_offset(size_t str_size, ptrdiff_t byte_offset) {
+	if (byte_offset < 0) { return 0; }
+	if ((size_t)byte_offset > str_size) { return (ptrdiff_t)str_size; }
+	return byte_offset;
+}
+
+ptrdiff_t
+bio_lsp_character_from_byte_offset(
+	bio_lsp_position_encoding_t encoding,
+	const char* utf8str, size_t str_size,
+	ptrdiff_t byte_offset
+) {
+	switch (encoding) {
+		case BIO_LSP_POSITION_ENCODING_UTF8:
+			return bio_lsp_clamp_byte_offset(str_size, byte_offset);
+		case BIO_LSP_POSITION_ENCODING_UTF16:
+			break;
+	}
+
+	return bio_lsp_utf16_offset_from_byte_offset(utf8str, str_size, byte_offset);
+}
+
+ptrdiff_t
+bio_lsp_byte_offset_from_character(
+	bio_lsp_position_encoding_t encoding,
+	const char* utf8str, size_t str_size,
+	ptrdiff_t character
+) {
+	switch (encoding) {
+		case BIO_LSP_POSITION_ENCODING_UTF8:
+			return bio_lsp_clamp_byte_offset(str_size, character);
+		case BIO_LSP_POSITION_ENCODING_UTF16:
+			break;
+	}
+
+	return bio_lsp_byte_offset_from_utf16_offset(utf8str, str_size, character);
 }
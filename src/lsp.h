@@ -50,6 +50,12 @@ typedef struct {
 	int character;
 } bio_lsp_position_t;
 
+// How the character of a position is counted
+typedef enum {
+	BIO_LSP_POSITION_ENCODING_UTF16,  // The default
+	BIO_LSP_POSITION_ENCODING_UTF8,
+} bio_lsp_position_encoding_t;
+
 typedef struct {
 	bio_lsp_position_t start;
 	bio_lsp_position_t end;
@@ -78,12 +84,31 @@ bio_lsp_send_msg(
 	bio_error_t* error
 );
 
+// Number of leading bytes which are ASCII
+size_t
+bio_lsp_ascii_prefix_len(const char* str, size_t len);
+
 ptrdiff_t
 bio_lsp_utf16_offset_from_byte_offset(const char* utf8str, size_t str_size, ptrdiff_t byte_offset);
 
 ptrdiff_t
 bio_lsp_byte_offset_from_utf16_offset(const char* utf8str, size_t str_size, ptrdiff_t utf16_offset);
 
+// Convert between byte offsets in a line and the characters of a position
+ptrdiff_t
+bio_lsp_character_from_byte_offset(
+	bio_lsp_position_encoding_t encoding,
+	const char* utf8str, size_t str_size,
+	ptrdiff_t byte_offset
+);
+
+ptrdiff_t
+bio_lsp_byte_offset_from_character(
+	bio_lsp_position_encoding_t encoding,
+	const char* utf8str, size_t str_size,
+	ptrdiff_t character
+);
+
 static inline int
 bio_lsp_cmp_pos(bio_lsp_position_t lhs, bio_lsp_position_t rhs) {
 	if (lhs.line == rhs.line) {
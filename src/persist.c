@@ -0,0 +1,657 @@
+#include "persist.h"
+#include "workspace.h"
+#include "common.h"
+#include <bmacro.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#define BUXN_LS_PERSIST_DIR ".buxn-ls/"
+#define BUXN_LS_PERSIST_MAGIC "BUXNLSIX"
+
+// Bump this whenever the layout or the meaning of any field changes
+static const uint32_t BUXN_LS_PERSIST_VERSION = 1;
+static const uint32_t BUXN_LS_PERSIST_BYTE_ORDER = 0x01020304;
+static const uint32_t BUXN_LS_PERSIST_NONE = UINT32_MAX;
+
+// Sections follow the header in the same order as the counts.
+// Every record is a multiple of 8 bytes so the records stay aligned when the
+// whole file is read into a single heap buffer.
+// Strings are offsets into the string table at the end and are always
+// terminated.
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t num_sources;
+	uint32_t num_includes;
+	uint32_t num_syms;
+	uint32_t num_diags;
+	uint32_t strings_size;
+	uint32_t position_encoding;  // Characters of every range are counted in this
+} buxn_ls_persist_header_t;
+
+enum {
+	BUXN_LS_PERSIST_IS_ENTRY = 1 << 0,
+	BUXN_LS_PERSIST_IS_CHECKED = 1 << 1,
+};
+
+typedef struct {
+	uint64_t content_hash;
+	uint32_t filename;
+	uint32_t flags;
+} buxn_ls_persist_source_t;
+
+// An edge from an entry to a file it opened
+typedef struct {
+	uint32_t entry;
+	uint32_t include;
+} buxn_ls_persist_include_t;
+
+typedef struct {
+	uint32_t source;
+	uint32_t entry;
+	uint32_t name;
+	uint32_t name_len;
+	uint32_t documentation;
+	uint32_t documentation_len;
+	uint32_t signature;
+	uint32_t signature_len;
+	uint32_t definition;  // Index of the referenced symbol, NONE for definitions
+	int32_t byte_offset;
+	int32_t range[4];
+	uint16_t address;
+	uint8_t type;
+	uint8_t semantics;
+	uint8_t padding[4];
+} buxn_ls_persist_sym_t;
+
+typedef struct {
+	uint32_t source;
+	uint32_t related_source;
+	uint32_t entry;
+	uint32_t message;
+	uint32_t related_message;
+	uint32_t severity;
+	uint32_t tool;
+	int32_t range[4];
+	int32_t related_range[4];
+	uint32_t padding;
+} buxn_ls_persist_diag_t;
+
+// Diagnostic sources are string literals so only their index is saved
+static const char* const BUXN_LS_PERSIST_TOOLS[] = {
+	"buxn-asm",
+	"buxn-chess",
+};
+
+typedef struct {
+	buxn_ls_persist_header_t header;
+	barray(buxn_ls_persist_source_t) sources;
+	barray(buxn_ls_persist_include_t) includes;
+	barray(buxn_ls_persist_sym_t) syms;
+	barray(buxn_ls_persist_diag_t) diags;
+	barray(char) strings;
+
+	const char* dir;
+	const char* path;
+	const char* tmp_path;
+	const char* gitignore_path;
+	int error;
+} buxn_ls_persist_writer_t;
+
+typedef struct {
+	const char* path;
+	char* data;
+	size_t size;
+	int error;
+} buxn_ls_persist_reader_t;
+
+static void
+buxn_ls_persist_range_out(int32_t out[4], const bio_lsp_range_t* range) {
+	out[0] = range->start.line;
+	out[1] = range->start.character;
+	out[2] = range->end.line;
+	out[3] = range->end.character;
+}
+
+static bio_lsp_range_t
+buxn_ls_persist_range_in(const int32_t in[4]) {
+	return (bio_lsp_range_t){
+		.start = { .line = in[0], .character = in[1] },
+		.end = { .line = in[2], .character = in[3] },
+	};
+}
+
+static uint32_t
+buxn_ls_persist_add_str(buxn_ls_persist_writer_t* writer, const char* chars, size_t len) {
+	if (chars == NULL) { return BUXN_LS_PERSIST_NONE; }
+
+	size_t offset = barray_len(writer->strings);
+	barray_resize(writer->strings, offset + len + 1, NULL);
+	memcpy(writer->strings + offset, chars, len);
+	writer->strings[offset + len] = '\0';
+	return (uint32_t)offset;
+}
+
+static uint32_t
+buxn_ls_persist_source_index(
+	const buxn_ls_analyzer_ctx_t* ctx,
+	buxn_ls_workspace_t* workspace,
+	const char* uri
+) {
+	if (uri == NULL) { return BUXN_LS_PERSIST_NONE; }
+
+	const char* filename = uri + (sizeof("file://") - 1) + workspace->root_dir_len;
+	bhash_index_t index = bhash_find(&ctx->sources, filename);
+	return bhash_is_valid(index) ? (uint32_t)index : BUXN_LS_PERSIST_NONE;
+}
+
+static uint32_t
+buxn_ls_persist_tool(const char* source) {
+	for (uint32_t i = 0; i < BCOUNT_OF(BUXN_LS_PERSIST_TOOLS); ++i) {
+		if (strcmp(BUXN_LS_PERSIST_TOOLS[i], source) == 0) { return i; }
+	}
+
+	return BUXN_LS_PERSIST_NONE;
+}
+
+static void
+buxn_ls_persist_add_sym(
+	buxn_ls_persist_writer_t* writer,
+	const buxn_ls_analyzer_ctx_t* ctx,
+	uint32_t source_index,
+	const buxn_ls_sym_node_t* sym,
+	uint32_t definition
+) {
+	bhash_index_t entry_index = bhash_find(&ctx->sources, sym->entry->filename);
+	buxn_ls_persist_sym_t record = {
+		.source = source_index,
+		.entry = (uint32_t)entry_index,
+		.name = buxn_ls_persist_add_str(writer, sym->name.chars, sym->name.len),
+		.name_len = (uint32_t)sym->name.len,
+		.documentation = buxn_ls_persist_add_str(
+			writer, sym->documentation.chars, sym->documentation.len
+		),
+		.documentation_len = (uint32_t)sym->documentation.len,
+		.signature = buxn_ls_persist_add_str(writer, sym->signature.chars, sym->signature.len),
+		.signature_len = (uint32_t)sym->signature.len,
+		.definition = definition,
+		.byte_offset = sym->byte_offset,
+		.address = sym->address,
+		.type = (uint8_t)sym->type,
+		.semantics = (uint8_t)sym->semantics,
+	};
+	buxn_ls_persist_range_out(record.range, &sym->range);
+	barray_push(writer->syms, record, NULL);
+}
+
+static void
+buxn_ls_persist_serialize(
+	buxn_ls_persist_writer_t* writer,
+	const buxn_ls_analyzer_ctx_t* ctx,
+	buxn_ls_workspace_t* workspace,
+	bio_lsp_position_encoding_t position_encoding
+) {
+	// Sources are stored in table order so an index in the table is also an
+	// index in the file
+	bhash_index_t num_sources = bhash_len(&ctx->sources);
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		const buxn_ls_src_node_t* node = ctx->sources.values[i];
+		buxn_ls_persist_source_t record = {
+			.content_hash = (uint64_t)node->content_hash,
+			.filename = buxn_ls_persist_add_str(writer, node->filename, strlen(node->filename)),
+			.flags = (node->is_entry ? BUXN_LS_PERSIST_IS_ENTRY : 0)
+				| (node->is_checked ? BUXN_LS_PERSIST_IS_CHECKED : 0),
+		};
+		barray_push(writer->sources, record, NULL);
+
+		for (
+			const buxn_ls_edge_t* edge = node->base.out_edges;
+			edge != NULL;
+			edge = edge->next_out
+		) {
+			const buxn_ls_src_node_t* include = BCONTAINER_OF(edge->to, buxn_ls_src_node_t, base);
+			buxn_ls_persist_include_t include_record = {
+				.entry = (uint32_t)i,
+				.include = (uint32_t)bhash_find(&ctx->sources, include->filename),
+			};
+			barray_push(writer->includes, include_record, NULL);
+		}
+	}
+
+	// Definitions go first so that references can point back at them
+	BHASH_TABLE(const buxn_ls_sym_node_t*, uint32_t) def_indices;
+	bhash_config_t hash_config = bhash_config_default();
+	hash_config.removable = false;
+	bhash_init(&def_indices, hash_config);
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		const buxn_ls_src_node_t* node = ctx->sources.values[i];
+		for (const buxn_ls_sym_node_t* def = node->definitions; def != NULL; def = def->next) {
+			bhash_put(&def_indices, def, (uint32_t)barray_len(writer->syms));
+			buxn_ls_persist_add_sym(writer, ctx, (uint32_t)i, def, BUXN_LS_PERSIST_NONE);
+		}
+	}
+	for (bhash_index_t i = 0; i < num_sources; ++i) {
+		const buxn_ls_src_node_t* node = ctx->sources.values[i];
+		for (const buxn_ls_sym_node_t* ref = node->references; ref != NULL; ref = ref->next) {
+			if (ref->base.out_edges == NULL) { continue; }
+
+			const buxn_ls_sym_node_t* def = BCONTAINER_OF(
+				ref->base.out_edges->to, buxn_ls_sym_node_t, base
+			);
+			bhash_index_t def_index = bhash_find(&def_indices, def);
+			if (!bhash_is_valid(def_index)) { continue; }
+
+			buxn_ls_persist_add_sym(writer, ctx, (uint32_t)i, ref, def_indices.values[def_index]);
+		}
+	}
+	bhash_cleanup(&def_indices);
+
+	size_t num_diags = barray_len(ctx->diagnostics);
+	for (size_t i = 0; i < num_diags; ++i) {
+		const buxn_ls_diagnostic_t* diag = &ctx->diagnostics[i];
+		buxn_ls_persist_diag_t record = {
+			.source = buxn_ls_persist_source_index(ctx, workspace, diag->location.uri),
+			.related_source = buxn_ls_persist_source_index(ctx, workspace, diag->related_location.uri),
+			.entry = (uint32_t)bhash_find(&ctx->sources, diag->entry->filename),
+			.message = buxn_ls_persist_add_str(writer, diag->message, strlen(diag->message)),
+			.related_message = diag->related_message != NULL
+				? buxn_ls_persist_add_str(writer, diag->related_message, strlen(diag->related_message))
+				: BUXN_LS_PERSIST_NONE,
+			.severity = (uint32_t)diag->severity,
+			.tool = buxn_ls_persist_tool(diag->source),
+		};
+		if (record.source == BUXN_LS_PERSIST_NONE || record.tool == BUXN_LS_PERSIST_NONE) {
+			continue;
+		}
+		buxn_ls_persist_range_out(record.range, &diag->location.range);
+		buxn_ls_persist_range_out(record.related_range, &diag->related_location.range);
+		barray_push(writer->diags, record, NULL);
+	}
+
+	writer->header = (buxn_ls_persist_header_t){
+		.version = BUXN_LS_PERSIST_VERSION,
+		.byte_order = BUXN_LS_PERSIST_BYTE_ORDER,
+		.num_sources = (uint32_t)barray_len(writer->sources),
+		.num_includes = (uint32_t)barray_len(writer->includes),
+		.num_syms = (uint32_t)barray_len(writer->syms),
+		.num_diags = (uint32_t)barray_len(writer->diags),
+		.strings_size = (uint32_t)barray_len(writer->strings),
+		.position_encoding = (uint32_t)position_encoding,
+	};
+	memcpy(writer->header.magic, BUXN_LS_PERSIST_MAGIC, sizeof(writer->header.magic));
+}
+
+static bool
+buxn_ls_persist_write_section(FILE* file, const void* data, size_t size) {
+	return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+// Runs on the thread pool since it blocks
+static void
+buxn_ls_persist_run_write(void* userdata) {
+	buxn_ls_persist_writer_t* writer = userdata;
+
+#ifdef _WIN32
+	if (_mkdir(writer->dir) == 0) {
+#else
+	if (mkdir(writer->dir, 0755) == 0) {
+#endif
+		// Keep the index out of version control
+		FILE* gitignore = fopen(writer->gitignore_path, "wb");
+		if (gitignore != NULL) {
+			fputs("*\n", gitignore);
+			fclose(gitignore);
+		}
+	} else if (errno != EEXIST) {
+		writer->error = errno;
+		return;
+	}
+
+	// Write to a temporary file first so a crash never leaves a partial index
+	FILE* file = fopen(writer->tmp_path, "wb");
+	if (file == NULL) {
+		writer->error = errno;
+		return;
+	}
+
+	bool success = buxn_ls_persist_write_section(file, &writer->header, sizeof(writer->header))
+		&& buxn_ls_persist_write_section(
+			file, writer->sources, sizeof(writer->sources[0]) * barray_len(writer->sources)
+		)
+		&& buxn_ls_persist_write_section(
+			file, writer->includes, sizeof(writer->includes[0]) * barray_len(writer->includes)
+		)
+		&& buxn_ls_persist_write_section(
+			file, writer->syms, sizeof(writer->syms[0]) * barray_len(writer->syms)
+		)
+		&& buxn_ls_persist_write_section(
+			file, writer->diags, sizeof(writer->diags[0]) * barray_len(writer->diags)
+		)
+		&& buxn_ls_persist_write_section(file, writer->strings, barray_len(writer->strings));
+	if (fclose(file) != 0) { success = false; }
+	if (!success) {
+		writer->error = errno != 0 ? errno : EIO;
+		remove(writer->tmp_path);
+		return;
+	}
+
+#ifdef _WIN32
+	remove(writer->path);
+#endif
+	if (rename(writer->tmp_path, writer->path) != 0) {
+		writer->error = errno;
+		remove(writer->tmp_path);
+	}
+}
+
+// Runs on the thread pool since it blocks.
+// The file is read into the heap instead of being mapped and every string is
+// copied into the context arena.
+// Nothing then refers to the file after loading so it can be overwritten by
+// the next save.
+static void
+buxn_ls_persist_run_read(void* userdata) {
+	buxn_ls_persist_reader_t* reader = userdata;
+
+	FILE* file = fopen(reader->path, "rb");
+	if (file == NULL) {
+		reader->error = errno;
+		return;
+	}
+
+	long size;
+	if (
+		fseek(file, 0, SEEK_END) != 0
+		|| (size = ftell(file)) < 0
+		|| fseek(file, 0, SEEK_SET) != 0
+	) {
+		reader->error = errno;
+		fclose(file);
+		return;
+	}
+
+	reader->size = (size_t)size;
+	reader->data = buxn_ls_malloc(reader->size > 0 ? reader->size : 1);
+	if (fread(reader->data, 1, reader->size, file) != reader->size) {
+		reader->error = EIO;
+		buxn_ls_free(reader->data);
+		reader->data = NULL;
+	}
+	fclose(file);
+}
+
+static bool
+buxn_ls_persist_is_valid_str(const buxn_ls_persist_header_t* header, const char* strings, uint32_t str) {
+	return str < header->strings_size
+		&& memchr(strings + str, '\0', header->strings_size - str) != NULL;
+}
+
+static buxn_ls_str_t
+buxn_ls_persist_get_str(
+	barena_t* arena,
+	const buxn_ls_persist_header_t* header,
+	const char* strings,
+	uint32_t str,
+	uint32_t len
+) {
+	if (
+		str == BUXN_LS_PERSIST_NONE
+		|| len >= header->strings_size
+		|| str > header->strings_size - len - 1
+	) {
+		return (buxn_ls_str_t){ 0 };
+	}
+
+	return buxn_ls_arena_cstrcpy(arena, (buxn_ls_str_t){ .chars = strings + str, .len = len });
+}
+
+static bool
+buxn_ls_persist_deserialize(
+	buxn_ls_analyzer_ctx_t* ctx,
+	buxn_ls_workspace_t* workspace,
+	bio_lsp_position_encoding_t position_encoding,
+	const char* data,
+	size_t size
+) {
+	buxn_ls_persist_header_t header;
+	if (size < sizeof(header)) { return false; }
+	memcpy(&header, data, sizeof(header));
+	if (
+		memcmp(header.magic, BUXN_LS_PERSIST_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != BUXN_LS_PERSIST_VERSION
+		|| header.byte_order != BUXN_LS_PERSIST_BYTE_ORDER
+		|| header.position_encoding != (uint32_t)position_encoding
+	) {
+		return false;
+	}
+
+	size_t expected_size = sizeof(header)
+		+ (size_t)header.num_sources * sizeof(buxn_ls_persist_source_t)
+		+ (size_t)header.num_includes * sizeof(buxn_ls_persist_include_t)
+		+ (size_t)header.num_syms * sizeof(buxn_ls_persist_sym_t)
+		+ (size_t)header.num_diags * sizeof(buxn_ls_persist_diag_t)
+		+ (size_t)header.strings_size;
+	if (size != expected_size) { return false; }
+
+	const buxn_ls_persist_source_t* sources = (const void*)(data + sizeof(header));
+	const buxn_ls_persist_include_t* includes = (const void*)(sources + header.num_sources);
+	const buxn_ls_persist_sym_t* syms = (const void*)(includes + header.num_includes);
+	const buxn_ls_persist_diag_t* diags = (const void*)(syms + header.num_syms);
+	const char* strings = (const char*)(diags + header.num_diags);
+
+	// Validate every index first so that a corrupted file is simply ignored
+	for (uint32_t i = 0; i < header.num_sources; ++i) {
+		if (!buxn_ls_persist_is_valid_str(&header, strings, sources[i].filename)) { return false; }
+	}
+	for (uint32_t i = 0; i < header.num_includes; ++i) {
+		if (
+			includes[i].entry >= header.num_sources
+			|| includes[i].include >= header.num_sources
+		) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header.num_syms; ++i) {
+		const buxn_ls_persist_sym_t* sym = &syms[i];
+		if (
+			sym->source >= header.num_sources
+			|| sym->entry >= header.num_sources
+			|| (sym->definition != BUXN_LS_PERSIST_NONE && sym->definition >= i)
+		) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header.num_diags; ++i) {
+		const buxn_ls_persist_diag_t* diag = &diags[i];
+		if (
+			diag->source >= header.num_sources
+			|| diag->entry >= header.num_sources
+			|| (diag->related_source != BUXN_LS_PERSIST_NONE && diag->related_source >= header.num_sources)
+			|| diag->tool >= BCOUNT_OF(BUXN_LS_PERSIST_TOOLS)
+			|| !buxn_ls_persist_is_valid_str(&header, strings, diag->message)
+			|| (
+				diag->related_message != BUXN_LS_PERSIST_NONE
+				&& !buxn_ls_persist_is_valid_str(&header, strings, diag->related_message)
+			)
+		) {
+			return false;
+		}
+	}
+
+	barray(buxn_ls_src_node_t*) nodes = NULL;
+	for (uint32_t i = 0; i < header.num_sources; ++i) {
+		buxn_ls_src_node_t* node = buxn_ls_find_or_alloc_node(
+			ctx, workspace, strings + sources[i].filename
+		);
+		node->analyzed = true;
+		node->is_entry = (sources[i].flags & BUXN_LS_PERSIST_IS_ENTRY) != 0;
+		node->is_checked = (sources[i].flags & BUXN_LS_PERSIST_IS_CHECKED) != 0;
+		node->content_hash = (bhash_hash_t)sources[i].content_hash;
+		barray_push(nodes, node, NULL);
+	}
+
+	// Lists are built by prepending so they are walked backward to keep the
+	// saved order
+	for (uint32_t i = header.num_includes; i > 0; --i) {
+		const buxn_ls_persist_include_t* include = &includes[i - 1];
+		buxn_ls_graph_add_edge(
+			&ctx->arena,
+			&nodes[include->entry]->base,
+			&nodes[include->include]->base
+		);
+	}
+
+	barray(buxn_ls_sym_node_t*) sym_nodes = NULL;
+	for (uint32_t i = 0; i < header.num_syms; ++i) {
+		const buxn_ls_persist_sym_t* sym = &syms[i];
+		buxn_ls_sym_node_t* sym_node = barena_memalign(
+			&ctx->arena,
+			sizeof(buxn_ls_sym_node_t), _Alignof(buxn_ls_sym_node_t)
+		);
+		*sym_node = (buxn_ls_sym_node_t){
+			.name = buxn_ls_persist_get_str(&ctx->arena, &header, strings, sym->name, sym->name_len),
+			.documentation = buxn_ls_persist_get_str(
+				&ctx->arena, &header, strings, sym->documentation, sym->documentation_len
+			),
+			.signature = buxn_ls_persist_get_str(
+				&ctx->arena, &header, strings, sym->signature, sym->signature_len
+			),
+			.source = nodes[sym->source],
+			.entry = nodes[sym->entry],
+			.type = (buxn_asm_sym_type_t)sym->type,
+			.semantics = (buxn_ls_symbol_semantics_t)sym->semantics,
+			.byte_offset = sym->byte_offset,
+			.range = buxn_ls_persist_range_in(sym->range),
+			.address = sym->address,
+		};
+		barray_push(sym_nodes, sym_node, NULL);
+	}
+	for (uint32_t i = header.num_syms; i > 0; --i) {
+		const buxn_ls_persist_sym_t* sym = &syms[i - 1];
+		buxn_ls_sym_node_t* sym_node = sym_nodes[i - 1];
+		if (sym->definition == BUXN_LS_PERSIST_NONE) {
+			sym_node->next = sym_node->source->definitions;
+			sym_node->source->definitions = sym_node;
+		} else {
+			sym_node->next = sym_node->source->references;
+			sym_node->source->references = sym_node;
+			buxn_ls_graph_add_edge(&ctx->arena, &sym_node->base, &sym_nodes[sym->definition]->base);
+		}
+	}
+
+	for (uint32_t i = 0; i < header.num_diags; ++i) {
+		const buxn_ls_persist_diag_t* diag = &diags[i];
+		buxn_ls_diagnostic_t diag_copy = {
+			.location = {
+				.uri = nodes[diag->source]->uri,
+				.range = buxn_ls_persist_range_in(diag->range),
+			},
+			.related_location = {
+				.uri = diag->related_source != BUXN_LS_PERSIST_NONE
+					? nodes[diag->related_source]->uri
+					: NULL,
+				.range = buxn_ls_persist_range_in(diag->related_range),
+			},
+			.severity = (bio_lsp_diagnostic_severity_t)diag->severity,
+			.source = BUXN_LS_PERSIST_TOOLS[diag->tool],
+			.message = buxn_ls_arena_strcpy(&ctx->arena, strings + diag->message),
+			.related_message = diag->related_message != BUXN_LS_PERSIST_NONE
+				? buxn_ls_arena_strcpy(&ctx->arena, strings + diag->related_message)
+				: NULL,
+			.entry = nodes[diag->entry],
+		};
+		barray_push(ctx->diagnostics, diag_copy, NULL);
+	}
+
+	barray_free(NULL, sym_nodes);
+	barray_free(NULL, nodes);
+	buxn_ls_sort_symbols(ctx);
+	return true;
+}
+
+bool
+buxn_ls_persist_load(
+	buxn_ls_analyzer_ctx_t* ctx,
+	buxn_ls_workspace_t* workspace,
+	bio_lsp_position_encoding_t position_encoding
+) {
+	bio_time_t start_time = bio_current_time_ms();
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s" BUXN_LS_PERSIST_DIR "index", workspace->root_dir);
+	buxn_ls_persist_reader_t reader = { .path = path };
+	bio_run_async_and_wait(buxn_ls_persist_run_read, &reader);
+	if (reader.data == NULL) {
+		if (reader.error != ENOENT) {
+			BIO_WARN("Could not read %s: %s", path, strerror(reader.error));
+		}
+		return false;
+	}
+
+	bool success = buxn_ls_persist_deserialize(
+		ctx, workspace, position_encoding, reader.data, reader.size
+	);
+	buxn_ls_free(reader.data);
+	if (success) {
+		BIO_INFO(
+			"Loaded %d file(s) from %s in %dms",
+			(int)bhash_len(&ctx->sources), path,
+			(int)(bio_current_time_ms() - start_time)
+		);
+	} else {
+		BIO_WARN("Ignoring outdated or corrupted index: %s", path);
+		barena_reset(&ctx->arena);
+		bhash_clear(&ctx->sources);
+		barray_clear(ctx->diagnostics);
+		ctx->name_index = (buxn_ls_sym_index_t){ 0 };
+		++ctx->generation;
+	}
+	return success;
+}
+
+void
+buxn_ls_persist_save(
+	const buxn_ls_analyzer_ctx_t* ctx,
+	buxn_ls_workspace_t* workspace,
+	bio_lsp_position_encoding_t position_encoding
+) {
+	bio_time_t start_time = bio_current_time_ms();
+
+	char dir[1024];
+	char path[1024];
+	char tmp_path[1024];
+	char gitignore_path[1024];
+	snprintf(dir, sizeof(dir), "%s" BUXN_LS_PERSIST_DIR, workspace->root_dir);
+	snprintf(path, sizeof(path), "%sindex", dir);
+	snprintf(tmp_path, sizeof(tmp_path), "%sindex.tmp", dir);
+	snprintf(gitignore_path, sizeof(gitignore_path), "%s.gitignore", dir);
+	buxn_ls_persist_writer_t writer = {
+		.dir = dir,
+		.path = path,
+		.tmp_path = tmp_path,
+		.gitignore_path = gitignore_path,
+	};
+	buxn_ls_persist_serialize(&writer, ctx, workspace, position_encoding);
+	bio_run_async_and_wait(buxn_ls_persist_run_write, &writer);
+
+	if (writer.error != 0) {
+		BIO_WARN("Could not write %s: %s", path, strerror(writer.error));
+	} else {
+		BIO_INFO(
+			"Saved %u file(s) to %s in %dms",
+			writer.header.num_sources, path,
+			(int)(bio_current_time_ms() - start_time)
+		);
+	}
+
+	barray_free(NULL, writer.sources);
+	barray_free(NULL, writer.includes);
+	barray_free(NULL, writer.syms);
+	barray_free(NULL, writer.diags);
+	barray_free(NULL, writer.strings);
+}
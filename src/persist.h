@@ -0,0 +1,31 @@
+#ifndef BUXN_LS_PERSIST_H
+#define BUXN_LS_PERSIST_H
+
+#include "analyze.h"
+
+struct buxn_ls_workspace_s;
+
+// The analysis is saved under the root dir so that a new session can answer
+// requests before its first analysis completes.
+// Nothing is validated on load.
+// Entries are only reused by the next analysis if the content hashes of all
+// their files still match.
+
+// Load the saved analysis into an empty context.
+// Returns false if there is none, it was written by a different version or
+// with a different position encoding.
+bool
+buxn_ls_persist_load(
+	buxn_ls_analyzer_ctx_t* ctx,
+	struct buxn_ls_workspace_s* workspace,
+	bio_lsp_position_encoding_t position_encoding
+);
+
+void
+buxn_ls_persist_save(
+	const buxn_ls_analyzer_ctx_t* ctx,
+	struct buxn_ls_workspace_s* workspace,
+	bio_lsp_position_encoding_t position_encoding
+);
+
+#endif
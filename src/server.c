@@ -5,6 +5,7 @@
 #include <bhash.h>
 #include "ls.h"
 #include "lsp.h"
+#include "workspace.h"
 
 typedef struct {
 	BHASH_SET(bio_coro_t) clients;
@@ -115,6 +116,7 @@ server_entry(void* userdata) {
 		bio_join(ctx.clients.keys[0]);
 	}
 	bhash_cleanup(&ctx.clients);
+	buxn_ls_file_cache_cleanup();
 
 	bio_join(exit_handler_coro);
 	barena_pool_cleanup(&pool);
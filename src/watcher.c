@@ -0,0 +1,167 @@
+#include "watcher.h"
+#include <stdio.h>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef __linux__
+
+#define BUXN_LS_WATCH_BUF_SIZE 4096
+
+static const int BUXN_LS_WATCH_POLL_MS = 250;
+
+typedef struct {
+	_Alignas(struct inotify_event) char buf[BUXN_LS_WATCH_BUF_SIZE];
+} buxn_ls_watch_buf_t;
+
+static void
+buxn_ls_wake_watcher(void* userdata) {
+	buxn_ls_watcher_t* watcher = userdata;
+	bio_raise_signal(watcher->wake_signal);
+}
+
+// The inotify fd is non-blocking so it is drained on the bio thread and
+// checked again on a timer while it is empty.
+// This does not keep a thread busy for every client.
+static void
+buxn_ls_watch(void* userdata) {
+	buxn_ls_watcher_t* watcher = userdata;
+	bio_set_coro_name("watcher");
+
+	buxn_ls_watch_buf_t* buf = buxn_ls_malloc(sizeof(buxn_ls_watch_buf_t));
+	char filename[1024];
+	while (!watcher->should_stop) {
+		ssize_t num_bytes = read(watcher->fd, buf->buf, sizeof(buf->buf));
+		if (num_bytes < 0 && errno != EAGAIN && errno != EINTR) {
+			BIO_WARN("Could not read file events: %s", strerror(errno));
+			break;
+		}
+		if (num_bytes <= 0) {
+			watcher->wake_signal = bio_make_signal();
+			watcher->poll_timer = bio_create_timer(
+				BIO_TIMER_ONESHOT,
+				BUXN_LS_WATCH_POLL_MS,
+				buxn_ls_wake_watcher, watcher
+			);
+			bio_wait_for_one_signal(watcher->wake_signal);
+			continue;
+		}
+
+		for (ssize_t offset = 0; offset < num_bytes;) {
+			const struct inotify_event* event = (const struct inotify_event*)(buf->buf + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+			if (event->len == 0) { continue; }
+
+			bhash_index_t dir_index = bhash_find(&watcher->dirs_by_wd, event->wd);
+			if (!bhash_is_valid(dir_index)) { continue; }
+
+			snprintf(
+				filename, sizeof(filename),
+				"%s%s", watcher->dirs_by_wd.values[dir_index], event->name
+			);
+			if (bhash_is_valid(bhash_find(&watcher->files, (char*){ filename }))) {
+				watcher->callback(watcher->userdata, filename);
+			}
+		}
+	}
+
+	buxn_ls_free(buf);
+}
+
+#endif
+
+void
+buxn_ls_watcher_init(
+	buxn_ls_watcher_t* watcher,
+	const char* root_dir,
+	buxn_ls_watch_callback_t callback,
+	void* userdata
+) {
+	*watcher = (buxn_ls_watcher_t){
+		.fd = -1,
+		.root_dir = root_dir,
+		.callback = callback,
+		.userdata = userdata,
+	};
+
+	bhash_config_t hash_config = bhash_config_default();
+	hash_config.removable = false;
+	bhash_init(&watcher->dirs_by_wd, hash_config);
+
+	hash_config.eq = buxn_ls_str_eq;
+	hash_config.hash = buxn_ls_str_hash;
+	bhash_init(&watcher->wds_by_dir, hash_config);
+	bhash_init_set(&watcher->files, hash_config);
+
+#ifdef __linux__
+	watcher->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (watcher->fd < 0) {
+		BIO_WARN("Could not initialize inotify: %s", strerror(errno));
+	} else {
+		watcher->coro = bio_spawn(buxn_ls_watch, watcher);
+	}
+#endif
+}
+
+void
+buxn_ls_watcher_cleanup(buxn_ls_watcher_t* watcher) {
+#ifdef __linux__
+	if (watcher->fd >= 0) {
+		watcher->should_stop = true;
+		if (bio_is_timer_pending(watcher->poll_timer)) {
+			bio_cancel_timer(watcher->poll_timer);
+			bio_raise_signal(watcher->wake_signal);
+		}
+		bio_join(watcher->coro);
+		close(watcher->fd);
+	}
+#endif
+
+	for (bhash_index_t i = 0; i < bhash_len(&watcher->wds_by_dir); ++i) {
+		buxn_ls_free(watcher->wds_by_dir.keys[i]);
+	}
+	for (bhash_index_t i = 0; i < bhash_len(&watcher->files); ++i) {
+		buxn_ls_free(watcher->files.keys[i]);
+	}
+	bhash_cleanup(&watcher->dirs_by_wd);
+	bhash_cleanup(&watcher->wds_by_dir);
+	bhash_cleanup(&watcher->files);
+}
+
+void
+buxn_ls_watcher_add(buxn_ls_watcher_t* watcher, const char* filename) {
+	if (watcher->fd < 0) { return; }
+	if (bhash_is_valid(bhash_find(&watcher->files, (char*){ (char*)filename }))) { return; }
+
+	char* filename_copy = buxn_ls_strcpy(filename);
+	bhash_put_key(&watcher->files, filename_copy);
+
+#ifdef __linux__
+	// The directory keeps its trailing slash so event names can be appended
+	const char* last_slash = strrchr(filename, '/');
+	size_t dir_len = last_slash != NULL ? (size_t)(last_slash - filename) + 1 : 0;
+	char dir[1024];
+	if (dir_len >= sizeof(dir)) { return; }
+	memcpy(dir, filename, dir_len);
+	dir[dir_len] = '\0';
+	if (bhash_is_valid(bhash_find(&watcher->wds_by_dir, (char*){ dir }))) { return; }
+
+	char full_path[1024];
+	snprintf(full_path, sizeof(full_path), "%s%s", watcher->root_dir, dir);
+	int wd = inotify_add_watch(
+		watcher->fd, full_path,
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE
+	);
+	if (wd < 0) {
+		BIO_WARN("Could not watch %s: %s", full_path, strerror(errno));
+		return;
+	}
+
+	BIO_DEBUG("Watching %s", full_path);
+	char* dir_copy = buxn_ls_strcpy(dir);
+	bhash_put(&watcher->wds_by_dir, dir_copy, wd);
+	bhash_put(&watcher->dirs_by_wd, wd, dir_copy);
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef BUXN_LS_WATCHER_H
+#define BUXN_LS_WATCHER_H
+
+#include <bhash.h>
+#include <bio/timer.h>
+#include "common.h"
+
+// Called with a filename relative to the root dir
+typedef void (*buxn_ls_watch_callback_t)(void* userdata, const char* filename);
+
+// Watches files on disk for changes made outside of the editor.
+// Directories are watched instead of files so that atomic saves through
+// rename are also caught.
+// This does nothing on platforms without inotify.
+typedef struct {
+	int fd;
+	const char* root_dir;
+	BHASH_TABLE(int, char*) dirs_by_wd;
+	BHASH_TABLE(char*, int) wds_by_dir;
+	BHASH_SET(char*) files;
+
+	buxn_ls_watch_callback_t callback;
+	void* userdata;
+	bio_coro_t coro;
+	bio_timer_t poll_timer;
+	bio_signal_t wake_signal;
+	bool should_stop;
+} buxn_ls_watcher_t;
+
+void
+buxn_ls_watcher_init(
+	buxn_ls_watcher_t* watcher,
+	const char* root_dir,
+	buxn_ls_watch_callback_t callback,
+	void* userdata
+);
+
+void
+buxn_ls_watcher_cleanup(buxn_ls_watcher_t* watcher);
+
+void
+buxn_ls_watcher_add(buxn_ls_watcher_t* watcher, const char* filename);
+
+#endif
@@ -1,8 +1,85 @@
+#ifdef __linux__
+// For st_mtim
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "workspace.h"
 #include "common.h"
 #include "lsp.h"
 #include <yyjson.h>
 #include <yuarel.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+// Identifies a version of a file on disk
+typedef struct {
+	uint64_t device;
+	uint64_t inode;
+	int64_t mtime;
+	uint64_t size;
+} buxn_ls_file_id_t;
+
+typedef struct {
+	buxn_ls_file_id_t id;
+	buxn_ls_doc_t* doc;
+	unsigned int generation;  // The prefetch which last validated this
+} buxn_ls_cached_file_t;
+
+typedef struct {
+	const char* path;
+	bool read_content;
+	bool is_cached;
+	buxn_ls_file_id_t cached_id;
+
+	buxn_ls_file_id_t id;
+	buxn_ls_doc_t* doc;
+	int error;
+} buxn_ls_file_task_t;
+
+typedef struct {
+	buxn_ls_file_task_t* tasks;
+	size_t num_tasks;
+} buxn_ls_prefetch_batch_t;
+
+typedef BHASH_SET(char*) buxn_ls_path_set_t;
+
+typedef struct {
+	size_t piece_index;
+	size_t piece_offset;
+	size_t offset;
+	size_t line;  // Number of line ends before offset
+} buxn_ls_text_cursor_t;
+
+typedef struct {
+	size_t offset;
+	size_t line;
+} buxn_ls_text_point_t;
+
+typedef struct {
+	const char* root_dir;
+	barray(char*) files;
+	barray(char*) roots;
+} buxn_ls_crawl_t;
+
+static const bhash_index_t BUXN_LS_FILE_CACHE_CAPACITY = 1024;
+static const size_t BUXN_LS_CRAWL_MAX_FILES = 4096;
+static const int BUXN_LS_CRAWL_MAX_DEPTH = 16;
+// Edits are merged into a new snapshot past this
+static const size_t BUXN_LS_TEXT_MAX_PIECES = 512;
+// Position mapping is given up past these
+static const size_t BUXN_LS_TEXT_MAX_CHECKPOINTS = 4;
+static const size_t BUXN_LS_TEXT_MAX_CHANGES = 4096;
+
+// Only touched from the bio thread
+static BHASH_TABLE(char*, buxn_ls_cached_file_t) buxn_ls_file_cache;
+static bool buxn_ls_file_cache_initialized = false;
+static unsigned int buxn_ls_file_cache_generation = 0;
 
 char*
 buxn_ls_workspace_resolve_path(buxn_ls_workspace_t* workspace, char* uri) {
@@ -20,6 +97,1035 @@ buxn_ls_workspace_resolve_path(buxn_ls_workspace_t* workspace, char* uri) {
 	}
 }
 
+static buxn_ls_doc_t*
+buxn_ls_doc_alloc(size_t len, char** chars) {
+	buxn_ls_doc_t* doc = buxn_ls_malloc(sizeof(buxn_ls_doc_t) + len);
+	*chars = (char*)(doc + 1);
+	*doc = (buxn_ls_doc_t){
+		.ref_count = 1,
+		.len = len,
+		.chars = *chars,
+	};
+	return doc;
+}
+
+buxn_ls_doc_t*
+buxn_ls_doc_create(const char* content, size_t len) {
+	char* chars;
+	buxn_ls_doc_t* doc = buxn_ls_doc_alloc(len, &chars);
+	if (len > 0) { memcpy(chars, content, len); }
+	doc->content_hash = bhash_hash(chars, len);
+	return doc;
+}
+
+void
+buxn_ls_doc_unref(buxn_ls_doc_t* doc) {
+	if (--doc->ref_count == 0) {
+		buxn_ls_free(doc);
+	}
+}
+
+// A "\r\n" ends at its '\n'.
+// A trailing '\r' is not counted since it could be followed by a '\n'.
+static size_t
+buxn_ls_count_newlines(const char* chars, size_t len) {
+	size_t count = 0;
+	for (
+		size_t i = buxn_ls_find_line_end(chars, 0, len);
+		i < len;
+		i = buxn_ls_find_line_end(chars, i + 1, len)
+	) {
+		if (chars[i] == '\r' && (i + 1 == len || chars[i + 1] == '\n')) { continue; }
+		++count;
+	}
+	return count;
+}
+
+static inline const char*
+buxn_ls_piece_chars(const buxn_ls_text_t* text, const buxn_ls_piece_t* piece) {
+	return (piece->is_added ? text->added : text->base->chars) + piece->start;
+}
+
+// Line ends in a piece including a trailing '\r' which is not followed by a
+// '\n' in the next piece
+static size_t
+buxn_ls_piece_num_lines(const buxn_ls_text_t* text, size_t index) {
+	const buxn_ls_piece_t* piece = &text->pieces[index];
+	if (buxn_ls_piece_chars(text, piece)[piece->len - 1] != '\r') {
+		return piece->num_newlines;
+	}
+
+	bool is_crlf = index + 1 < barray_len(text->pieces)
+		&& buxn_ls_piece_chars(text, &text->pieces[index + 1])[0] == '\n';
+	return piece->num_newlines + (is_crlf ? 0 : 1);
+}
+
+// Returns '\0' past the end
+static char
+buxn_ls_text_byte_at(const buxn_ls_text_t* text, size_t offset) {
+	for (size_t i = 0; i < barray_len(text->pieces); ++i) {
+		const buxn_ls_piece_t* piece = &text->pieces[i];
+		if (offset < piece->len) { return buxn_ls_piece_chars(text, piece)[offset]; }
+		offset -= piece->len;
+	}
+	return '\0';
+}
+
+static void
+buxn_ls_text_forget_changes(buxn_ls_text_t* text) {
+	barray_clear(text->changes);
+	barray_clear(text->checkpoints);
+	text->first_change_version = text->version;
+}
+
+// Take ownership of a snapshot and make it the whole content
+static void
+buxn_ls_text_rebase(buxn_ls_text_t* text, buxn_ls_doc_t* doc) {
+	if (text->base != NULL) { buxn_ls_doc_unref(text->base); }
+	text->base = doc;
+	text->len = doc->len;
+	text->is_flat = true;
+	barray_clear(text->added);
+	barray_clear(text->pieces);
+	if (doc->len > 0) {
+		buxn_ls_piece_t piece = {
+			.start = 0,
+			.len = doc->len,
+			.num_newlines = buxn_ls_count_newlines(doc->chars, doc->len),
+			.is_added = false,
+		};
+		barray_push(text->pieces, piece, NULL);
+	}
+}
+
+// Replace the whole content.
+// Positions can no longer be mapped to older snapshots.
+static void
+buxn_ls_text_reset(buxn_ls_text_t* text, buxn_ls_doc_t* doc) {
+	buxn_ls_text_rebase(text, doc);
+	++text->version;
+	buxn_ls_text_forget_changes(text);
+}
+
+static void
+buxn_ls_text_cleanup(buxn_ls_text_t* text) {
+	buxn_ls_doc_unref(text->base);
+	barray_free(NULL, text->added);
+	barray_free(NULL, text->pieces);
+	barray_free(NULL, text->changes);
+	barray_free(NULL, text->checkpoints);
+}
+
+static void
+buxn_ls_text_add_checkpoint(buxn_ls_text_t* text) {
+	size_t num_checkpoints = barray_len(text->checkpoints);
+	if (
+		num_checkpoints > 0
+		&& text->checkpoints[num_checkpoints - 1].version == text->version
+	) {
+		return;
+	}
+
+	if (num_checkpoints == BUXN_LS_TEXT_MAX_CHECKPOINTS) {
+		memmove(
+			text->checkpoints, text->checkpoints + 1,
+			sizeof(text->checkpoints[0]) * (num_checkpoints - 1)
+		);
+		barray_resize(text->checkpoints, num_checkpoints - 1, NULL);
+
+		// Drop the changes which are only needed by the removed checkpoint
+		size_t num_dropped = text->checkpoints[0].version - text->first_change_version;
+		size_t num_changes = barray_len(text->changes);
+		memmove(
+			text->changes, text->changes + num_dropped,
+			sizeof(text->changes[0]) * (num_changes - num_dropped)
+		);
+		barray_resize(text->changes, num_changes - num_dropped, NULL);
+		text->first_change_version = text->checkpoints[0].version;
+	}
+
+	buxn_ls_text_checkpoint_t checkpoint = {
+		.content_hash = text->base->content_hash,
+		.version = text->version,
+	};
+	barray_push(text->checkpoints, checkpoint, NULL);
+}
+
+buxn_ls_doc_t*
+buxn_ls_text_flatten(buxn_ls_text_t* text) {
+	if (text->is_flat) { return text->base; }
+
+	char* chars;
+	buxn_ls_doc_t* doc = buxn_ls_doc_alloc(text->len, &chars);
+	size_t offset = 0;
+	for (size_t i = 0; i < barray_len(text->pieces); ++i) {
+		const buxn_ls_piece_t* piece = &text->pieces[i];
+		memcpy(chars + offset, buxn_ls_piece_chars(text, piece), piece->len);
+		offset += piece->len;
+	}
+	doc->content_hash = bhash_hash(chars, text->len);
+
+	// Later edits are made against the new snapshot so the added text can be
+	// dropped
+	buxn_ls_text_rebase(text, doc);
+	return doc;
+}
+
+// Find where a line starts.
+// Returns false with a cursor at the end if the text has fewer lines.
+static bool
+buxn_ls_text_seek_line(
+	const buxn_ls_text_t* text,
+	size_t line,
+	buxn_ls_text_cursor_t* cursor
+) {
+	*cursor = (buxn_ls_text_cursor_t){ 0 };
+	size_t num_pieces = barray_len(text->pieces);
+	for (; cursor->piece_index < num_pieces; ++cursor->piece_index) {
+		const buxn_ls_piece_t* piece = &text->pieces[cursor->piece_index];
+		size_t num_lines = buxn_ls_piece_num_lines(text, cursor->piece_index);
+		if (cursor->line + num_lines < line) {
+			cursor->line += num_lines;
+			cursor->offset += piece->len;
+			continue;
+		}
+
+		// A trailing '\r' is only reached when it ends a line on its own
+		const char* chars = buxn_ls_piece_chars(text, piece);
+		size_t piece_offset = 0;
+		while (cursor->line < line) {
+			size_t end = buxn_ls_find_line_end(chars, piece_offset, piece->len);
+			if (chars[end] == '\r' && end + 1 < piece->len && chars[end + 1] == '\n') {
+				++end;
+			}
+			piece_offset = end + 1;
+			++cursor->line;
+		}
+		cursor->piece_offset = piece_offset;
+		cursor->offset += piece_offset;
+		return true;
+	}
+
+	return cursor->line == line;
+}
+
+// Length of the line at the cursor without its terminator
+static size_t
+buxn_ls_text_line_length(const buxn_ls_text_t* text, buxn_ls_text_cursor_t cursor) {
+	size_t len = 0;
+	size_t piece_offset = cursor.piece_offset;
+	for (size_t i = cursor.piece_index; i < barray_len(text->pieces); ++i) {
+		const buxn_ls_piece_t* piece = &text->pieces[i];
+		const char* chars = buxn_ls_piece_chars(text, piece);
+		size_t end = buxn_ls_find_line_end(chars, piece_offset, piece->len);
+		if (end < piece->len) { return len + (end - piece_offset); }
+
+		len += piece->len - piece_offset;
+		piece_offset = 0;
+	}
+	return len;
+}
+
+static void
+buxn_ls_text_copy(
+	const buxn_ls_text_t* text,
+	buxn_ls_text_cursor_t cursor,
+	size_t len,
+	char* out
+) {
+	size_t piece_offset = cursor.piece_offset;
+	for (size_t i = cursor.piece_index; len > 0 && i < barray_len(text->pieces); ++i) {
+		const buxn_ls_piece_t* piece = &text->pieces[i];
+		size_t copy_len = piece->len - piece_offset;
+		if (copy_len > len) { copy_len = len; }
+		memcpy(out, buxn_ls_piece_chars(text, piece) + piece_offset, copy_len);
+
+		out += copy_len;
+		len -= copy_len;
+		piece_offset = 0;
+	}
+}
+
+bool
+buxn_ls_text_copy_line(
+	const buxn_ls_text_t* text,
+	int line,
+	barena_t* arena,
+	buxn_ls_str_t* line_content
+) {
+	buxn_ls_text_cursor_t cursor;
+	if (line < 0 || !buxn_ls_text_seek_line(text, (size_t)line, &cursor)) {
+		return false;
+	}
+
+	size_t len = buxn_ls_text_line_length(text, cursor);
+	char* chars = barena_memalign(arena, len + 1, _Alignof(char));
+	buxn_ls_text_copy(text, cursor, len, chars);
+	chars[len] = '\0';
+
+	*line_content = (buxn_ls_str_t){ .chars = chars, .len = len };
+	return true;
+}
+
+// Convert a position into a byte offset.
+// Positions past the end of a line or of the text are clamped.
+static buxn_ls_text_point_t
+buxn_ls_text_locate(
+	buxn_ls_workspace_t* workspace,
+	const buxn_ls_text_t* text,
+	bio_lsp_position_t position
+) {
+	buxn_ls_text_cursor_t cursor;
+	size_t line = position.line > 0 ? (size_t)position.line : 0;
+	if (!buxn_ls_text_seek_line(text, line, &cursor)) {
+		return (buxn_ls_text_point_t){ .offset = cursor.offset, .line = cursor.line };
+	}
+
+	size_t line_len = buxn_ls_text_line_length(text, cursor);
+	barray_resize(workspace->line_scratch, line_len, NULL);
+	buxn_ls_text_copy(text, cursor, line_len, workspace->line_scratch);
+
+	ptrdiff_t byte_offset = bio_lsp_byte_offset_from_character(
+		workspace->position_encoding,
+		workspace->line_scratch, line_len,
+		position.character
+	);
+	return (buxn_ls_text_point_t){
+		.offset = cursor.offset + (size_t)byte_offset,
+		.line = cursor.line,
+	};
+}
+
+// The position after some text which is inserted at another position
+static bio_lsp_position_t
+buxn_ls_position_after(
+	bio_lsp_position_encoding_t encoding,
+	bio_lsp_position_t position,
+	const char* content,
+	size_t content_len
+) {
+	size_t last_line = 0;
+	for (
+		size_t end;
+		(end = buxn_ls_find_line_end(content, last_line, content_len)) < content_len;
+	) {
+		if (content[end] == '\r' && end + 1 < content_len && content[end + 1] == '\n') {
+			++end;
+		}
+		last_line = end + 1;
+		position.line += 1;
+		position.character = 0;
+	}
+
+	size_t last_line_len = content_len - last_line;
+	position.character += (int)bio_lsp_character_from_byte_offset(
+		encoding, content + last_line, last_line_len, (ptrdiff_t)last_line_len
+	);
+	return position;
+}
+
+static void
+buxn_ls_text_record_change(
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_text_t* text,
+	bio_lsp_range_t range,
+	const char* content,
+	size_t content_len,
+	bool joins_crlf
+) {
+	++text->version;
+
+	// Nothing can refer to the older versions
+	if (barray_len(text->checkpoints) == 0) {
+		text->first_change_version = text->version;
+		return;
+	}
+
+	// Lines around the edit were merged or split in a way which a change
+	// can't describe
+	if (joins_crlf || barray_len(text->changes) >= BUXN_LS_TEXT_MAX_CHANGES) {
+		buxn_ls_text_forget_changes(text);
+		return;
+	}
+
+	buxn_ls_text_change_t change = {
+		.range = range,
+		.new_end = buxn_ls_position_after(
+			workspace->position_encoding, range.start, content, content_len
+		),
+	};
+	barray_push(text->changes, change, NULL);
+}
+
+// Replace a range of the text.
+// Only the pieces around the range are split, the rest are kept as is.
+static void
+buxn_ls_text_edit(
+	buxn_ls_workspace_t* workspace,
+	buxn_ls_text_t* text,
+	bio_lsp_range_t range,
+	const char* content,
+	size_t content_len
+) {
+	buxn_ls_text_point_t start = buxn_ls_text_locate(workspace, text, range.start);
+	buxn_ls_text_point_t end = buxn_ls_text_locate(workspace, text, range.end);
+	if (end.offset < start.offset) { end = start; }
+
+	// Whether a "\r\n" crosses either end of the edit, before or after it
+	char before = start.offset > 0 ? buxn_ls_text_byte_at(text, start.offset - 1) : '\0';
+	char after = buxn_ls_text_byte_at(text, end.offset);
+	char old_first = start.offset < end.offset ? buxn_ls_text_byte_at(text, start.offset) : after;
+	char old_last = start.offset < end.offset ? buxn_ls_text_byte_at(text, end.offset - 1) : before;
+	char new_first = content_len > 0 ? content[0] : after;
+	char new_last = content_len > 0 ? content[content_len - 1] : before;
+	bool joins_crlf = (before == '\r' && (old_first == '\n' || new_first == '\n'))
+		|| (after == '\n' && (old_last == '\r' || new_last == '\r'));
+
+	buxn_ls_piece_t insertion = {
+		.start = barray_len(text->added),
+		.len = content_len,
+		.num_newlines = buxn_ls_count_newlines(content, content_len),
+		.is_added = true,
+	};
+	if (content_len > 0) {
+		barray_resize(text->added, insertion.start + content_len, NULL);
+		memcpy(text->added + insertion.start, content, content_len);
+	}
+	bool inserted = content_len == 0;
+
+	buxn_ls_text_record_change(workspace, text, range, content, content_len, joins_crlf);
+
+	// Line counts of the split pieces follow from the lines of the range.
+	// Those are counted with the trailing '\r' of a piece which is left out
+	// of num_newlines.
+	barray(buxn_ls_piece_t) pieces = workspace->piece_scratch;
+	barray_clear(pieces);
+	size_t piece_start = 0;
+	size_t lines_before = 0;
+	for (size_t i = 0; i < barray_len(text->pieces); ++i) {
+		buxn_ls_piece_t piece = text->pieces[i];
+		size_t piece_end = piece_start + piece.len;
+		size_t lines_after = lines_before + buxn_ls_piece_num_lines(text, i);
+
+		if (piece_end <= start.offset) {
+			barray_push(pieces, piece, NULL);
+		} else if (piece_start >= end.offset) {
+			if (!inserted) {
+				barray_push(pieces, insertion, NULL);
+				inserted = true;
+			}
+			barray_push(pieces, piece, NULL);
+		} else {
+			if (piece_start < start.offset) {
+				// A trailing '\r' was counted unless a '\n' followed it
+				const char* chars = buxn_ls_piece_chars(text, &piece);
+				size_t left_len = start.offset - piece_start;
+				bool ends_line = chars[left_len - 1] == '\r' && chars[left_len] != '\n';
+				buxn_ls_piece_t left = {
+					.start = piece.start,
+					.len = left_len,
+					.num_newlines = start.line - lines_before - (ends_line ? 1 : 0),
+					.is_added = piece.is_added,
+				};
+				barray_push(pieces, left, NULL);
+			}
+			if (!inserted) {
+				barray_push(pieces, insertion, NULL);
+				inserted = true;
+			}
+			if (piece_end > end.offset) {
+				// Same end as the whole piece so a trailing '\r' is left out
+				// of both
+				buxn_ls_piece_t right = {
+					.start = piece.start + (end.offset - piece_start),
+					.len = piece_end - end.offset,
+					.num_newlines = lines_before + piece.num_newlines - end.line,
+					.is_added = piece.is_added,
+				};
+				barray_push(pieces, right, NULL);
+			}
+		}
+
+		piece_start = piece_end;
+		lines_before = lines_after;
+	}
+	if (!inserted) { barray_push(pieces, insertion, NULL); }
+
+	workspace->piece_scratch = text->pieces;
+	text->pieces = pieces;
+	text->len = text->len - (end.offset - start.offset) + content_len;
+	text->is_flat = false;
+
+	// Keep lookups short
+	if (barray_len(text->pieces) > BUXN_LS_TEXT_MAX_PIECES) {
+		buxn_ls_text_flatten(text);
+	}
+}
+
+static bool
+buxn_ls_file_id_eq(const buxn_ls_file_id_t* lhs, const buxn_ls_file_id_t* rhs) {
+	return lhs->device == rhs->device
+		&& lhs->inode == rhs->inode
+		&& lhs->mtime == rhs->mtime
+		&& lhs->size == rhs->size;
+}
+
+// Seconds are not enough to tell apart two writes of the same size in quick
+// succession
+static int64_t
+buxn_ls_mtime_ns(const struct stat* stat_buf) {
+#if defined(__linux__)
+	return (int64_t)stat_buf->st_mtim.tv_sec * 1000000000 + (int64_t)stat_buf->st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	return (int64_t)stat_buf->st_mtimespec.tv_sec * 1000000000 + (int64_t)stat_buf->st_mtimespec.tv_nsec;
+#else
+	return (int64_t)stat_buf->st_mtime * 1000000000;
+#endif
+}
+
+static buxn_ls_file_id_t
+buxn_ls_file_id_from_stat(const struct stat* stat_buf) {
+	return (buxn_ls_file_id_t){
+		.device = (uint64_t)stat_buf->st_dev,
+		.inode = (uint64_t)stat_buf->st_ino,
+		.mtime = buxn_ls_mtime_ns(stat_buf),
+		.size = (uint64_t)stat_buf->st_size,
+	};
+}
+
+// Runs on the thread pool since it blocks
+static void
+buxn_ls_run_file_task(void* userdata) {
+	buxn_ls_file_task_t* task = userdata;
+	struct stat stat_buf;
+
+	if (!task->read_content) {
+		if (stat(task->path, &stat_buf) != 0) {
+			task->error = errno;
+			return;
+		}
+		task->id = buxn_ls_file_id_from_stat(&stat_buf);
+		return;
+	}
+
+#ifndef _WIN32
+	int fd = open(task->path, O_RDONLY);
+	if (fd < 0) {
+		task->error = errno;
+		return;
+	}
+	if (fstat(fd, &stat_buf) != 0) {
+		task->error = errno;
+		close(fd);
+		return;
+	}
+	task->id = buxn_ls_file_id_from_stat(&stat_buf);
+
+	// Read into the heap instead of mapping the file.
+	// A mapping would be pinned by the cache and analyses so truncating the
+	// file in place would fault when it is read.
+	size_t size = (size_t)stat_buf.st_size;
+	char* chars;
+	task->doc = buxn_ls_doc_alloc(size, &chars);
+	size_t num_read = 0;
+	while (num_read < size) {
+		ssize_t result = read(fd, chars + num_read, size - num_read);
+		if (result <= 0) {
+			task->error = result < 0 ? errno : EIO;
+			buxn_ls_doc_unref(task->doc);
+			task->doc = NULL;
+			break;
+		}
+		num_read += (size_t)result;
+	}
+	close(fd);
+	if (task->doc != NULL) {
+		task->doc->content_hash = bhash_hash(task->doc->chars, size);
+	}
+#else
+	FILE* file = fopen(task->path, "rb");
+	if (file == NULL) {
+		task->error = errno;
+		return;
+	}
+	if (fstat(_fileno(file), &stat_buf) != 0) {
+		task->error = errno;
+		fclose(file);
+		return;
+	}
+	task->id = buxn_ls_file_id_from_stat(&stat_buf);
+
+	size_t size = (size_t)stat_buf.st_size;
+	char* chars;
+	task->doc = buxn_ls_doc_alloc(size, &chars);
+	if (fread(chars, 1, size, file) == size) {
+		task->doc->content_hash = bhash_hash(chars, size);
+	} else {
+		task->error = EIO;
+		buxn_ls_doc_unref(task->doc);
+		task->doc = NULL;
+	}
+	fclose(file);
+#endif
+}
+
+// Drop files which are no longer used by any analysis
+static void
+buxn_ls_trim_file_cache(void) {
+	for (bhash_index_t i = bhash_len(&buxn_ls_file_cache) - 1; i >= 0; --i) {
+		if (buxn_ls_file_cache.values[i].doc->ref_count > 1) { continue; }
+
+		bhash_index_t removed_index = bhash_remove(
+			&buxn_ls_file_cache, buxn_ls_file_cache.keys[i]
+		);
+		buxn_ls_doc_unref(buxn_ls_file_cache.values[removed_index].doc);
+		buxn_ls_free(buxn_ls_file_cache.keys[removed_index]);
+	}
+}
+
+static void
+buxn_ls_init_file_cache(void) {
+	if (buxn_ls_file_cache_initialized) { return; }
+
+	bhash_config_t config = bhash_config_default();
+	config.hash = buxn_ls_str_hash;
+	config.eq = buxn_ls_str_eq;
+	config.removable = true;
+	bhash_init(&buxn_ls_file_cache, config);
+	buxn_ls_file_cache_initialized = true;
+}
+
+// Takes ownership of the task's doc
+static void
+buxn_ls_put_cached_file(const buxn_ls_file_task_t* task, unsigned int generation) {
+	bhash_index_t cache_index = bhash_find(&buxn_ls_file_cache, (char*){ (char*)task->path });
+	if (bhash_is_valid(cache_index)) {
+		BIO_DEBUG("Reloading %s", task->path);
+		buxn_ls_doc_unref(buxn_ls_file_cache.values[cache_index].doc);
+	} else {
+		if (bhash_len(&buxn_ls_file_cache) >= BUXN_LS_FILE_CACHE_CAPACITY) {
+			buxn_ls_trim_file_cache();
+		}
+		cache_index = bhash_alloc(&buxn_ls_file_cache, (char*){ (char*)task->path }).index;
+		buxn_ls_file_cache.keys[cache_index] = buxn_ls_strcpy(task->path);
+	}
+	buxn_ls_file_cache.values[cache_index] = (buxn_ls_cached_file_t){
+		.id = task->id,
+		.doc = task->doc,
+		.generation = generation,
+	};
+}
+
+static buxn_ls_doc_t*
+buxn_ls_load_file_from_disk(const char* path) {
+	buxn_ls_init_file_cache();
+
+	buxn_ls_file_task_t task = { .path = path };
+	bhash_index_t cache_index = bhash_find(&buxn_ls_file_cache, (char*){ (char*)path });
+	if (bhash_is_valid(cache_index)) {
+		// Already validated by the prefetch of the ongoing analysis
+		buxn_ls_cached_file_t* cached_file = &buxn_ls_file_cache.values[cache_index];
+		if (cached_file->generation == buxn_ls_file_cache_generation) {
+			return buxn_ls_doc_ref(cached_file->doc);
+		}
+
+		bio_run_async_and_wait(buxn_ls_run_file_task, &task);
+		if (task.error != 0) {
+			BIO_ERROR("Could not stat %s: %s", path, strerror(task.error));
+			return NULL;
+		}
+
+		// Other clients may have changed the cache while this was waiting
+		cache_index = bhash_find(&buxn_ls_file_cache, (char*){ (char*)path });
+		if (
+			bhash_is_valid(cache_index)
+			&& buxn_ls_file_id_eq(&buxn_ls_file_cache.values[cache_index].id, &task.id)
+		) {
+			return buxn_ls_doc_ref(buxn_ls_file_cache.values[cache_index].doc);
+		}
+	}
+
+	task.read_content = true;
+	bio_run_async_and_wait(buxn_ls_run_file_task, &task);
+	if (task.doc == NULL) {
+		BIO_ERROR("Could not read %s: %s", path, strerror(task.error));
+		return NULL;
+	}
+
+	// Not validated by a prefetch, it has to be checked again next time
+	buxn_ls_put_cached_file(&task, buxn_ls_file_cache_generation - 1);
+	return buxn_ls_doc_ref(task.doc);
+}
+
+// Runs on the thread pool.
+// The whole batch is processed in one go instead of hopping between threads
+// for every file.
+static void
+buxn_ls_run_prefetch(void* userdata) {
+	buxn_ls_prefetch_batch_t* batch = userdata;
+	for (size_t i = 0; i < batch->num_tasks; ++i) {
+		buxn_ls_file_task_t* task = &batch->tasks[i];
+		if (task->is_cached) {
+			buxn_ls_run_file_task(task);
+			if (task->error != 0) { continue; }
+			if (buxn_ls_file_id_eq(&task->id, &task->cached_id)) { continue; }
+		}
+
+		task->read_content = true;
+		buxn_ls_run_file_task(task);
+	}
+}
+
+void
+buxn_ls_workspace_prefetch(
+	buxn_ls_workspace_t* workspace,
+	const char* const* filenames,
+	size_t num_files
+) {
+	buxn_ls_init_file_cache();
+	bio_time_t start_time = bio_current_time_ms();
+	unsigned int generation = ++buxn_ls_file_cache_generation;
+
+	buxn_ls_prefetch_batch_t batch = {
+		.tasks = buxn_ls_malloc(sizeof(buxn_ls_file_task_t) * (num_files > 0 ? num_files : 1)),
+	};
+	for (size_t i = 0; i < num_files; ++i) {
+		const char* filename = filenames[i];
+		if (bhash_is_valid(bhash_find(&workspace->docs, (char*){ (char*)filename }))) {
+			continue;  // File is managed
+		}
+
+		size_t path_len = workspace->root_dir_len + strlen(filename) + 1;
+		char* path = buxn_ls_malloc(path_len);
+		snprintf(path, path_len, "%s%s", workspace->root_dir, filename);
+
+		buxn_ls_file_task_t* task = &batch.tasks[batch.num_tasks++];
+		*task = (buxn_ls_file_task_t){ .path = path };
+		bhash_index_t cache_index = bhash_find(&buxn_ls_file_cache, (char*){ path });
+		if (bhash_is_valid(cache_index)) {
+			task->is_cached = true;
+			task->cached_id = buxn_ls_file_cache.values[cache_index].id;
+		}
+	}
+
+	if (batch.num_tasks > 0) {
+		bio_run_async_and_wait(buxn_ls_run_prefetch, &batch);
+	}
+
+	int num_read = 0;
+	for (size_t i = 0; i < batch.num_tasks; ++i) {
+		buxn_ls_file_task_t* task = &batch.tasks[i];
+		if (task->doc != NULL) {
+			buxn_ls_put_cached_file(task, generation);
+			++num_read;
+		} else if (task->error == 0) {  // Unchanged
+			bhash_index_t cache_index = bhash_find(&buxn_ls_file_cache, (char*){ (char*)task->path });
+			if (bhash_is_valid(cache_index)) {
+				buxn_ls_file_cache.values[cache_index].generation = generation;
+			}
+		}
+		// Errors are reported when the file is actually loaded
+		buxn_ls_free((char*)task->path);
+	}
+	buxn_ls_free(batch.tasks);
+
+	BIO_INFO(
+		"Prefetched %zu file(s), %d read, in %dms",
+		batch.num_tasks, num_read, (int)(bio_current_time_ms() - start_time)
+	);
+}
+
+#ifndef _WIN32
+static void
+buxn_ls_crawl_dir(buxn_ls_crawl_t* crawl, const char* dir, int depth) {
+	if (depth > BUXN_LS_CRAWL_MAX_DEPTH) { return; }
+
+	char full_path[1024];
+	snprintf(full_path, sizeof(full_path), "%s%s", crawl->root_dir, dir);
+	DIR* handle = opendir(full_path);
+	if (handle == NULL) { return; }
+
+	struct dirent* entry;
+	while (
+		barray_len(crawl->files) < BUXN_LS_CRAWL_MAX_FILES
+		&& (entry = readdir(handle)) != NULL
+	) {
+		// Skip hidden files, ".", ".." and things like ".git"
+		if (entry->d_name[0] == '.') { continue; }
+
+		char path[1024];
+		int path_len = snprintf(path, sizeof(path), "%s%s", dir, entry->d_name);
+		if (path_len < 0 || (size_t)path_len + 1 >= sizeof(path)) { continue; }
+
+		struct stat stat_buf;
+		snprintf(full_path, sizeof(full_path), "%s%s", crawl->root_dir, path);
+		if (stat(full_path, &stat_buf) != 0) { continue; }
+
+		if (S_ISDIR(stat_buf.st_mode)) {
+			path[path_len] = '/';
+			path[path_len + 1] = '\0';
+			buxn_ls_crawl_dir(crawl, path, depth + 1);
+		} else if (
+			S_ISREG(stat_buf.st_mode)
+			&& path_len > 4
+			&& strcmp(path + path_len - 4, ".tal") == 0
+		) {
+			barray_push(crawl->files, buxn_ls_strcpy(path), NULL);
+		}
+	}
+	closedir(handle);
+}
+#endif
+
+// Collect the `~path` tokens of a file, skipping comments
+static void
+buxn_ls_scan_includes(
+	const char* content,
+	size_t len,
+	buxn_ls_path_set_t* included
+) {
+	int comment_depth = 0;
+	size_t i = 0;
+	while (i < len) {
+		while (i < len && (unsigned char)content[i] <= ' ') { ++i; }
+		size_t token_start = i;
+		while (i < len && (unsigned char)content[i] > ' ') { ++i; }
+		size_t token_len = i - token_start;
+		if (token_len == 0) { break; }
+
+		const char* token = content + token_start;
+		if (token[0] == '(') {
+			++comment_depth;
+		} else if (token[0] == ')' && comment_depth > 0) {
+			--comment_depth;
+		} else if (comment_depth == 0 && token[0] == '~' && token_len > 1) {
+			// Paths are relative to the root
+			++token;
+			--token_len;
+			if (token_len > 2 && token[0] == '.' && token[1] == '/') {
+				token += 2;
+				token_len -= 2;
+			}
+			char* path = buxn_ls_malloc(token_len + 1);
+			memcpy(path, token, token_len);
+			path[token_len] = '\0';
+			if (bhash_is_valid(bhash_find(included, path))) {
+				buxn_ls_free(path);
+			} else {
+				bhash_put_key(included, path);
+			}
+		}
+	}
+}
+
+// Runs on the thread pool since it blocks
+static void
+buxn_ls_run_crawl(void* userdata) {
+	buxn_ls_crawl_t* crawl = userdata;
+#ifndef _WIN32
+	buxn_ls_crawl_dir(crawl, "", 0);
+#endif
+
+	buxn_ls_path_set_t included;
+	bhash_config_t config = bhash_config_default();
+	config.hash = buxn_ls_str_hash;
+	config.eq = buxn_ls_str_eq;
+	bhash_init_set(&included, config);
+
+	size_t num_files = barray_len(crawl->files);
+	for (size_t i = 0; i < num_files; ++i) {
+		char full_path[1024];
+		snprintf(full_path, sizeof(full_path), "%s%s", crawl->root_dir, crawl->files[i]);
+		buxn_ls_file_task_t task = {
+			.path = full_path,
+			.read_content = true,
+		};
+		buxn_ls_run_file_task(&task);
+		if (task.doc == NULL) { continue; }
+
+		buxn_ls_scan_includes(task.doc->chars, task.doc->len, &included);
+		buxn_ls_doc_unref(task.doc);
+	}
+
+	for (size_t i = 0; i < num_files; ++i) {
+		if (!bhash_is_valid(bhash_find(&included, crawl->files[i]))) {
+			barray_push(crawl->roots, crawl->files[i], NULL);
+		} else {
+			buxn_ls_free(crawl->files[i]);
+		}
+	}
+
+	bhash_index_t num_included = bhash_len(&included);
+	for (bhash_index_t i = 0; i < num_included; ++i) {
+		buxn_ls_free(included.keys[i]);
+	}
+	bhash_cleanup(&included);
+}
+
+void
+buxn_ls_workspace_find_roots(buxn_ls_workspace_t* workspace) {
+	bio_time_t start_time = bio_current_time_ms();
+	buxn_ls_crawl_t crawl = { .root_dir = workspace->root_dir };
+	bio_run_async_and_wait(buxn_ls_run_crawl, &crawl);
+
+	for (size_t i = 0; i < barray_len(workspace->roots); ++i) {
+		buxn_ls_free(workspace->roots[i]);
+	}
+	barray_clear(workspace->roots);
+	for (size_t i = 0; i < barray_len(crawl.roots); ++i) {
+		barray_push(workspace->roots, crawl.roots[i], NULL);
+	}
+
+	BIO_INFO(
+		"Found %zu root(s) in %zu file(s) in %dms",
+		barray_len(crawl.roots), barray_len(crawl.files),
+		(int)(bio_current_time_ms() - start_time)
+	);
+	barray_free(NULL, crawl.files);
+	barray_free(NULL, crawl.roots);
+}
+
+buxn_ls_doc_t*
+buxn_ls_workspace_load_file(buxn_ls_workspace_t* workspace, const char* filename) {
+	bhash_index_t doc_index = bhash_find(&workspace->docs, (char*){ (char*)filename });
+	if (bhash_is_valid(doc_index)) {  // File is managed
+		buxn_ls_text_t* text = &workspace->docs.values[doc_index];
+		buxn_ls_doc_t* doc = buxn_ls_text_flatten(text);
+		// The analysis may refer to this snapshot until the next one completes
+		buxn_ls_text_add_checkpoint(text);
+		return buxn_ls_doc_ref(doc);
+	}
+
+	char full_path[1024];
+	snprintf(full_path, sizeof(full_path), "%s%s", workspace->root_dir, filename);
+	return buxn_ls_load_file_from_disk(full_path);
+}
+
+static const buxn_ls_text_change_t*
+buxn_ls_workspace_find_changes(
+	buxn_ls_workspace_t* workspace,
+	const char* filename,
+	bhash_hash_t content_hash,
+	size_t* num_changes
+) {
+	bhash_index_t doc_index = bhash_find(&workspace->docs, (char*){ (char*)filename });
+	if (!bhash_is_valid(doc_index)) { return NULL; }
+
+	const buxn_ls_text_t* text = &workspace->docs.values[doc_index];
+	for (size_t i = barray_len(text->checkpoints); i > 0; --i) {
+		const buxn_ls_text_checkpoint_t* checkpoint = &text->checkpoints[i - 1];
+		if (checkpoint->content_hash == content_hash) {
+			size_t first_change = checkpoint->version - text->first_change_version;
+			*num_changes = barray_len(text->changes) - first_change;
+			return text->changes + first_change;
+		}
+	}
+
+	return NULL;
+}
+
+static bio_lsp_position_t
+buxn_ls_shift_position(
+	bio_lsp_position_t position,
+	bio_lsp_position_t from,
+	bio_lsp_position_t to
+) {
+	if (position.line == from.line) {
+		return (bio_lsp_position_t){
+			.line = to.line,
+			.character = to.character + (position.character - from.character),
+		};
+	} else {
+		return (bio_lsp_position_t){
+			.line = position.line + (to.line - from.line),
+			.character = position.character,
+		};
+	}
+}
+
+bool
+buxn_ls_workspace_map_to_snapshot(
+	buxn_ls_workspace_t* workspace,
+	const char* filename,
+	bhash_hash_t content_hash,
+	bio_lsp_position_t* position
+) {
+	size_t num_changes;
+	const buxn_ls_text_change_t* changes = buxn_ls_workspace_find_changes(
+		workspace, filename, content_hash, &num_changes
+	);
+	if (changes == NULL) { return true; }
+
+	// Undo the changes from the latest
+	for (size_t i = num_changes; i > 0; --i) {
+		const buxn_ls_text_change_t* change = &changes[i - 1];
+		if (bio_lsp_cmp_pos(*position, change->range.start) <= 0) {
+			continue;
+		} else if (bio_lsp_cmp_pos(*position, change->new_end) >= 0) {
+			*position = buxn_ls_shift_position(*position, change->new_end, change->range.end);
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void
+buxn_ls_workspace_map_from_snapshot(
+	buxn_ls_workspace_t* workspace,
+	const char* filename,
+	bhash_hash_t content_hash,
+	bio_lsp_range_t* range
+) {
+	size_t num_changes;
+	const buxn_ls_text_change_t* changes = buxn_ls_workspace_find_changes(
+		workspace, filename, content_hash, &num_changes
+	);
+	if (changes == NULL) { return; }
+
+	for (size_t i = 0; i < num_changes; ++i) {
+		const buxn_ls_text_change_t* change = &changes[i];
+		bio_lsp_position_t* positions[] = { &range->start, &range->end };
+		for (int j = 0; j < 2; ++j) {
+			bio_lsp_position_t* position = positions[j];
+			if (bio_lsp_cmp_pos(*position, change->range.start) < 0) {
+				continue;
+			} else if (bio_lsp_cmp_pos(*position, change->range.end) >= 0) {
+				*position = buxn_ls_shift_position(*position, change->range.end, change->new_end);
+			} else {
+				*position = change->range.start;
+			}
+		}
+	}
+}
+
+void
+buxn_ls_workspace_invalidate_file(buxn_ls_workspace_t* workspace, const char* filename) {
+	if (!buxn_ls_file_cache_initialized) { return; }
+
+	char full_path[1024];
+	snprintf(full_path, sizeof(full_path), "%s%s", workspace->root_dir, filename);
+	bhash_index_t removed_index = bhash_remove(&buxn_ls_file_cache, (char*){ full_path });
+	if (bhash_is_valid(removed_index)) {
+		buxn_ls_doc_unref(buxn_ls_file_cache.values[removed_index].doc);
+		buxn_ls_free(buxn_ls_file_cache.keys[removed_index]);
+	}
+}
+
+void
+buxn_ls_file_cache_cleanup(void) {
+	if (!buxn_ls_file_cache_initialized) { return; }
+
+	bhash_index_t num_files = bhash_len(&buxn_ls_file_cache);
+	for (bhash_index_t i = 0; i < num_files; ++i) {
+		buxn_ls_free(buxn_ls_file_cache.keys[i]);
+		buxn_ls_doc_unref(buxn_ls_file_cache.values[i].doc);
+	}
+	bhash_cleanup(&buxn_ls_file_cache);
+	buxn_ls_file_cache_initialized = false;
+}
+
 void
 buxn_ls_workspace_init(buxn_ls_workspace_t* workspace, const char* root_dir) {
 	size_t root_dir_len = strlen(root_dir);
@@ -38,18 +1144,36 @@ buxn_ls_workspace_init(buxn_ls_workspace_t* workspace, const char* root_dir) {
 	config.hash = buxn_ls_str_hash;
 	config.eq = buxn_ls_str_eq;
 	bhash_init(&workspace->docs, config);
+	workspace->position_encoding = BIO_LSP_POSITION_ENCODING_UTF16;
+	workspace->piece_scratch = NULL;
+	workspace->line_scratch = NULL;
+	workspace->roots = NULL;
 }
 
 void
 buxn_ls_workspace_cleanup(buxn_ls_workspace_t* workspace) {
 	for (bhash_index_t i = 0; i < bhash_len(&workspace->docs); ++i) {
 		buxn_ls_free(workspace->docs.keys[i]);
-		buxn_ls_free((char*)workspace->docs.values[i].chars);
+		buxn_ls_text_cleanup(&workspace->docs.values[i]);
 	}
 	bhash_cleanup(&workspace->docs);
+	barray_free(NULL, workspace->piece_scratch);
+	barray_free(NULL, workspace->line_scratch);
+	for (size_t i = 0; i < barray_len(workspace->roots); ++i) {
+		buxn_ls_free(workspace->roots[i]);
+	}
+	barray_free(NULL, workspace->roots);
 	buxn_ls_free(workspace->root_dir);
 }
 
+static bio_lsp_position_t
+buxn_ls_parse_position(yyjson_val* json) {
+	return (bio_lsp_position_t){
+		.line = yyjson_get_int(BIO_LSP_JSON_GET_LIT(json, "line")),
+		.character = yyjson_get_int(BIO_LSP_JSON_GET_LIT(json, "character")),
+	};
+}
+
 void
 buxn_ls_workspace_update(buxn_ls_workspace_t* workspace, const struct bio_lsp_in_msg_s* msg) {
 	if (msg->type == BIO_LSP_MSG_NOTIFICATION) {
@@ -70,63 +1194,56 @@ buxn_ls_workspace_update(buxn_ls_workspace_t* workspace, const struct bio_lsp_in
 			BIO_INFO("Registering %s", path);
 
 			bhash_alloc_result_t alloc_result = bhash_alloc(&workspace->docs, path);
-			buxn_ls_str_t* doc;
 			if (alloc_result.is_new) {
 				workspace->docs.keys[alloc_result.index] = buxn_ls_strcpy(path);
-				doc = &workspace->docs.values[alloc_result.index];
+				workspace->docs.values[alloc_result.index] = (buxn_ls_text_t){ 0 };
 			} else {
 				BIO_WARN("Document is already opened");
-				doc = &workspace->docs.values[alloc_result.index];
-				buxn_ls_free((char*)doc->chars);
 			}
-
-			if (content_size > 0) {
-				doc->chars = buxn_ls_malloc(content_size);
-				memcpy((char*)doc->chars, content, content_size);
-			} else {
-				doc->chars = NULL;
-			}
-			doc->len = content_size;
+			buxn_ls_text_reset(
+				&workspace->docs.values[alloc_result.index],
+				buxn_ls_doc_create(content, content_size)
+			);
 		} else if (strcmp(msg->method, "textDocument/didChange") == 0) {
-			// TODO: support incremental sync
-			const char* content = NULL;
-			size_t content_size = 0;
-			yyjson_val* changes = BIO_LSP_JSON_GET_LIT(msg->value, "contentChanges");
-			yyjson_val* last_change = yyjson_arr_get_last(changes);
-			yyjson_val* json_text = BIO_LSP_JSON_GET_LIT(last_change, "text");
-			content = yyjson_get_str(json_text);
-			if (content != NULL) {
-				content_size = yyjson_get_len(json_text);
-			}
-
 			BIO_INFO("Updating %s", path);
 
-			bhash_index_t index = bhash_find(&workspace->docs, path);
-			buxn_ls_str_t* doc;
-			if (bhash_is_valid(index)) {
-				doc = &workspace->docs.values[index];
-				buxn_ls_free((char*)doc->chars);
-			} else {
+			bhash_alloc_result_t alloc_result = bhash_alloc(&workspace->docs, path);
+			buxn_ls_text_t* text = &workspace->docs.values[alloc_result.index];
+			if (alloc_result.is_new) {
 				BIO_WARN("Document was not opened");
-				index = bhash_alloc(&workspace->docs, path).index;
-				workspace->docs.keys[index] = buxn_ls_strcpy(path);
-				doc = &workspace->docs.values[index];
+				workspace->docs.keys[alloc_result.index] = buxn_ls_strcpy(path);
+				*text = (buxn_ls_text_t){ 0 };
+				buxn_ls_text_reset(text, buxn_ls_doc_create(NULL, 0));
 			}
 
-			if (content_size > 0) {
-				doc->chars = buxn_ls_malloc(content_size);
-				memcpy((char*)doc->chars, content, content_size);
-			} else {
-				doc->chars= NULL;
+			// Changes are applied in order, each against the result of the
+			// previous one
+			yyjson_val* changes = BIO_LSP_JSON_GET_LIT(msg->value, "contentChanges");
+			size_t change_index, max_changes;
+			yyjson_val* change;
+			yyjson_arr_foreach(changes, change_index, max_changes, change) {
+				yyjson_val* json_text = BIO_LSP_JSON_GET_LIT(change, "text");
+				const char* content = yyjson_get_str(json_text);
+				size_t content_size = content != NULL ? yyjson_get_len(json_text) : 0;
+
+				yyjson_val* json_range = BIO_LSP_JSON_GET_LIT(change, "range");
+				if (json_range != NULL) {
+					bio_lsp_range_t range = {
+						.start = buxn_ls_parse_position(BIO_LSP_JSON_GET_LIT(json_range, "start")),
+						.end = buxn_ls_parse_position(BIO_LSP_JSON_GET_LIT(json_range, "end")),
+					};
+					buxn_ls_text_edit(workspace, text, range, content, content_size);
+				} else {
+					buxn_ls_text_reset(text, buxn_ls_doc_create(content, content_size));
+				}
 			}
-			doc->len = content_size;
 		} else if (strcmp(msg->method, "textDocument/didClose") == 0) {
 			BIO_INFO("Closing %s", path);
 
 			bhash_index_t index = bhash_remove(&workspace->docs, path);
 			if (bhash_is_valid(index)) {
 				buxn_ls_free(workspace->docs.keys[index]);
-				buxn_ls_free((char*)workspace->docs.values[index].chars);
+				buxn_ls_text_cleanup(&workspace->docs.values[index]);
 			} else {
 				BIO_WARN("Document was not opened");
 			}
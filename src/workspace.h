@@ -6,12 +6,128 @@
 
 struct bio_lsp_in_msg_s;
 
+// An immutable snapshot of a document's content.
+// The workspace publishes a new one when an edited document is loaded so the
+// analyzer can keep using an old one without copying it.
+// Only touched from the bio thread so the count is not atomic.
+typedef struct buxn_ls_doc_s {
+	int ref_count;
+	size_t len;
+	const char* chars;
+	bhash_hash_t content_hash;
+} buxn_ls_doc_t;
+
+// A span of an opened document, either from its base snapshot or from the
+// text added by edits
+typedef struct {
+	size_t start;
+	size_t len;
+	// Line ends within the piece.
+	// A trailing '\r' is left out since it depends on the next piece.
+	size_t num_newlines;
+	bool is_added;
+} buxn_ls_piece_t;
+
+// A change in the positions of the text it was applied to
+typedef struct {
+	bio_lsp_range_t range;  // Replaced range
+	bio_lsp_position_t new_end;  // End of the inserted text
+} buxn_ls_text_change_t;
+
+// A snapshot which was loaded by the analyzer
+typedef struct {
+	bhash_hash_t content_hash;
+	unsigned int version;
+} buxn_ls_text_checkpoint_t;
+
+// An opened document.
+// Edits are applied to a piece table so their cost is proportional to the
+// size of the edit instead of the document's.
+// A contiguous snapshot is only made when the content is needed as a whole.
+// Lines end the same way as in buxn_ls_split_file, even when a "\r\n" is
+// split between two pieces.
+typedef struct {
+	buxn_ls_doc_t* base;
+	barray(char) added;  // Append only until the next flatten
+	barray(buxn_ls_piece_t) pieces;
+	size_t len;
+	bool is_flat;  // base is the whole content
+
+	// Changes since the oldest checkpoint so positions can be mapped between
+	// an analyzed snapshot and the current content.
+	// A change takes the text from its version to the next.
+	barray(buxn_ls_text_change_t) changes;
+	barray(buxn_ls_text_checkpoint_t) checkpoints;
+	unsigned int version;
+	unsigned int first_change_version;
+} buxn_ls_text_t;
+
 typedef struct buxn_ls_workspace_s {
 	char* root_dir;
 	size_t root_dir_len;
-	BHASH_TABLE(char*, buxn_ls_str_t) docs;
+	BHASH_TABLE(char*, buxn_ls_text_t) docs;
+	// Negotiated with the client, used to apply ranged edits
+	bio_lsp_position_encoding_t position_encoding;
+	barray(buxn_ls_piece_t) piece_scratch;
+	barray(char) line_scratch;
+	// Files under root_dir which are not included by any other file
+	barray(char*) roots;
 } buxn_ls_workspace_t;
 
+buxn_ls_doc_t*
+buxn_ls_doc_create(const char* content, size_t len);
+
+void
+buxn_ls_doc_unref(buxn_ls_doc_t* doc);
+
+static inline buxn_ls_doc_t*
+buxn_ls_doc_ref(buxn_ls_doc_t* doc) {
+	++doc->ref_count;
+	return doc;
+}
+
+static inline buxn_ls_str_t
+buxn_ls_doc_content(const buxn_ls_doc_t* doc) {
+	return (buxn_ls_str_t){ .chars = doc->chars, .len = doc->len };
+}
+
+// Return a contiguous snapshot of the text, copying the pieces if needed.
+// The returned snapshot is borrowed.
+buxn_ls_doc_t*
+buxn_ls_text_flatten(buxn_ls_text_t* text);
+
+// Copy a line without its terminator into an arena.
+// Returns false if the text has fewer lines.
+bool
+buxn_ls_text_copy_line(
+	const buxn_ls_text_t* text,
+	int line,
+	barena_t* arena,
+	buxn_ls_str_t* line_content
+);
+
+// Map a position in an opened document back to an older snapshot of it.
+// Returns false if the position is in text inserted since then.
+// The position is kept as is if the snapshot is unknown.
+bool
+buxn_ls_workspace_map_to_snapshot(
+	buxn_ls_workspace_t* workspace,
+	const char* filename,
+	bhash_hash_t content_hash,
+	bio_lsp_position_t* position
+);
+
+// Map a range of an older snapshot to the current content of an opened
+// document.
+// Positions in replaced text are moved to the start of the replacement.
+void
+buxn_ls_workspace_map_from_snapshot(
+	buxn_ls_workspace_t* workspace,
+	const char* filename,
+	bhash_hash_t content_hash,
+	bio_lsp_range_t* range
+);
+
 void
 buxn_ls_workspace_init(buxn_ls_workspace_t* workspace, const char* root_dir);
 
@@ -24,4 +140,32 @@ buxn_ls_workspace_update(buxn_ls_workspace_t* workspace, const struct bio_lsp_in
 char*
 buxn_ls_workspace_resolve_path(buxn_ls_workspace_t* workspace, char* uri);
 
+// Return the content of a file, either from an opened document or from disk.
+// The returned snapshot must be released with buxn_ls_doc_unref.
+buxn_ls_doc_t*
+buxn_ls_workspace_load_file(buxn_ls_workspace_t* workspace, const char* filename);
+
+// Validate and load the cached content of many files from disk in one batch.
+// Opened documents are skipped.
+void
+buxn_ls_workspace_prefetch(
+	buxn_ls_workspace_t* workspace,
+	const char* const* filenames,
+	size_t num_files
+);
+
+// Crawl root_dir for source files and infer which of them are entries.
+// Only includes are scanned, nothing is assembled.
+void
+buxn_ls_workspace_find_roots(buxn_ls_workspace_t* workspace);
+
+// Drop the cached content of a file which was changed outside of the editor
+void
+buxn_ls_workspace_invalidate_file(buxn_ls_workspace_t* workspace, const char* filename);
+
+// Files loaded from disk are cached for the whole process.
+// In server mode, this is shared by all clients.
+void
+buxn_ls_file_cache_cleanup(void);
+
 #endif